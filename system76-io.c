@@ -17,24 +17,65 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <linux/debugfs.h>
 #include <linux/hwmon.h>
 #include <linux/hwmon-sysfs.h>
 #include <linux/kernel.h>
+#include <linux/ktime.h>
 #include <linux/module.h>
+#include <linux/sched/signal.h>
+#include <linux/seq_file.h>
 #include <linux/slab.h>
 #include <linux/suspend.h>
+#include <linux/thermal.h>
+#include <linux/uaccess.h>
 #include <linux/usb.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
 
-#define IO_VENDOR 0x1209
-#define IO_DEVICE 0x1776
-#define IO_INTF_CTRL 0
-#define IO_EP_CTRL 0x00
-#define IO_INTF_DATA 1
-#define IO_EP_IN 0x83
-#define IO_EP_OUT 0x04
-#define IO_MSG_SIZE 32
-#define IO_TIMEOUT 1000
+#include "system76-io_proto.h"
 
+#define IO_TIMEOUT 1000
+#define IO_FAN_COUNT 2
+
+static unsigned int sample_interval = 250;
+module_param(sample_interval, uint, 0644);
+MODULE_PARM_DESC(sample_interval, "Initial shortest background tach sampling interval in ms while a fan filter is selected");
+
+static char * sample_thermal_zone = "";
+module_param(sample_thermal_zone, charp, 0644);
+MODULE_PARM_DESC(sample_thermal_zone, "Thermal zone type that keeps the sampler at its shortest interval while hot, empty to ignore");
+
+static int sample_thermal_temp = 80000;
+module_param(sample_thermal_temp, int, 0644);
+MODULE_PARM_DESC(sample_thermal_temp, "Temperature in millidegrees Celsius at which sample_thermal_zone counts as hot");
+
+static char * workqueue = "highpri";
+module_param(workqueue, charp, 0444);
+MODULE_PARM_DESC(workqueue, "Workqueue for device I/O: highpri (per-CPU) or unbound, both high priority");
+
+static unsigned int watchdog_timeout = 0;
+module_param(watchdog_timeout, uint, 0644);
+MODULE_PARM_DESC(watchdog_timeout, "Initial fan watchdog timeout in seconds for new devices, 0 to disable");
+
+static unsigned int watchdog_pwm = 255;
+module_param(watchdog_pwm, uint, 0644);
+MODULE_PARM_DESC(watchdog_pwm, "PWM value (0-255) forced by the fan watchdog");
+
+static struct dentry * io_debugfs;
+static struct workqueue_struct * io_wq;
+// Commands sent for sysfs readers and PM notifications, see io_exec_call
+static struct workqueue_struct * io_exec_wq;
+
+#include "system76-io_capture.c"
+#include "system76-io_cmdq.c"
+#include "system76-io_exec.c"
+#include "system76-io_filter.c"
+#include "system76-io_flight.c"
+#include "system76-io_parser.c"
+#include "system76-io_pid.c"
+#include "system76-io_rate.c"
+#include "system76-io_shadow.c"
 #include "system76-io_dev.c"
 #include "system76-io_hwmon.c"
 
@@ -50,6 +91,14 @@ static u8 line_encoding[7] = {
     8
 };
 
+static int io_exec_bootloader(struct io_exec * exec) {
+    return io_dev_bootloader(exec->data, IO_TIMEOUT);
+}
+
+static int io_exec_revision(struct io_exec * exec) {
+    return io_dev_revision(exec->data, exec->out, exec->arg, IO_TIMEOUT);
+}
+
 static ssize_t show_bootloader(struct device *dev, struct device_attribute *attr, char *buf) {
     return sprintf(buf, "%d\n", 0);
 }
@@ -60,19 +109,19 @@ static ssize_t set_bootloader(struct device *dev, struct device_attribute *attr,
 
     struct io_dev * io_dev = dev_get_drvdata(dev);
 
-    mutex_lock(&io_dev->lock);
+    io_cmdq_lock(&io_dev->cmdq, IO_CMDQ_WRITE);
 
     ret = kstrtouint(buf, 10, &val);
     if (!ret) {
         if (val) {
-            ret = io_dev_bootloader(io_dev, IO_TIMEOUT);
+            ret = io_exec_call(io_exec_wq, io_exec_bootloader, io_dev, 0, NULL);
             if(!ret) {
                 ret = size;
             }
         }
     }
 
-    mutex_unlock(&io_dev->lock);
+    io_cmdq_unlock(&io_dev->cmdq);
 
     return ret;
 }
@@ -84,11 +133,14 @@ static ssize_t show_revision(struct device *dev, struct device_attribute *attr,
 
     struct io_dev * io_dev = dev_get_drvdata(dev);
 
-    mutex_lock(&io_dev->lock);
+    ret = io_cmdq_lock_killable(&io_dev->cmdq);
+    if (ret) {
+        return ret;
+    }
 
-    ret = io_dev_revision(io_dev, buf, PAGE_SIZE, IO_TIMEOUT);
+    ret = io_exec_call(io_exec_wq, io_exec_revision, io_dev, PAGE_SIZE, buf);
 
-    mutex_unlock(&io_dev->lock);
+    io_cmdq_unlock(&io_dev->cmdq);
 
     return ret;
 }
@@ -96,20 +148,29 @@ static ssize_t show_revision(struct device *dev, struct device_attribute *attr,
 static DEVICE_ATTR(revision, S_IRUGO, show_revision, NULL);
 
 #ifdef CONFIG_PM_SLEEP
+static int io_exec_suspend(struct io_exec * exec) {
+    return io_dev_set_suspend(exec->data, exec->arg, IO_TIMEOUT);
+}
+
+// io_exec_wq is freezable, these notifications come before the freeze and after the thaw
 static int io_pm(struct notifier_block *nb, unsigned long action, void *data) {
     struct io_dev * io_dev = container_of(nb, struct io_dev, pm_notifier);
 
-    mutex_lock(&io_dev->lock);
+    io_cmdq_lock(&io_dev->cmdq, IO_CMDQ_WRITE);
 
     switch (action) {
         case PM_HIBERNATION_PREPARE:
         case PM_SUSPEND_PREPARE:
-            io_dev_set_suspend(io_dev, 1, IO_TIMEOUT);
+            io_dev->suspended = true;
+            io_exec_call(io_exec_wq, io_exec_suspend, io_dev, 1, NULL);
             break;
 
         case PM_POST_HIBERNATION:
         case PM_POST_SUSPEND:
-            io_dev_set_suspend(io_dev, 0, IO_TIMEOUT);
+            io_dev->suspended = false;
+            io_exec_call(io_exec_wq, io_exec_suspend, io_dev, 0, NULL);
+            // Give userspace a full period to come back before the watchdog fires
+            io_dev->watchdog_keepalive = jiffies;
             break;
 
         case PM_POST_RESTORE:
@@ -118,164 +179,308 @@ static int io_pm(struct notifier_block *nb, unsigned long action, void *data) {
             break;
     }
 
-    mutex_unlock(&io_dev->lock);
+    io_cmdq_unlock(&io_dev->cmdq);
 
     return NOTIFY_DONE;
 }
 #endif
 
+// Configures the CDC line, which the board forgets on every reset
+static int io_ctrl_setup(struct usb_interface *interface) {
+    int result;
+
+    result = usb_control_msg(
+        interface_to_usbdev(interface),
+        usb_sndctrlpipe(interface_to_usbdev(interface), IO_EP_CTRL),
+        0x22,
+        0x21,
+        0x03,
+        0,
+        NULL,
+        0,
+        IO_TIMEOUT
+    );
+    if (result < 0) {
+        dev_err(&interface->dev, "set line state failed: %d\n", -result);
+        return result;
+    }
+
+
+    result = usb_control_msg(
+        interface_to_usbdev(interface),
+        usb_sndctrlpipe(interface_to_usbdev(interface), IO_EP_CTRL),
+        0x20,
+        0x21,
+        0,
+        0,
+        line_encoding,
+        7,
+        IO_TIMEOUT
+    );
+    if (result < 0) {
+        dev_err(&interface->dev, "set line encoding failed: %d\n", -result);
+        return result;
+    }
+
+    return 0;
+}
+
+static struct usb_driver io_driver;
+
 static int io_probe(struct usb_interface *interface, const struct usb_device_id *id) {
-    int retry;
+    int i;
     int result;
+    bool restored;
+    char path[64];
     struct io_dev * io_dev;
+    struct usb_interface * data;
 
     dev_info(&interface->dev, "id %04X:%04X interface %d probe\n", id->idVendor, id->idProduct, id->bInterfaceNumber);
 
-    if (id->bInterfaceNumber == IO_INTF_CTRL) {
-        result = usb_control_msg(
-            interface_to_usbdev(interface),
-            usb_sndctrlpipe(interface_to_usbdev(interface), IO_EP_CTRL),
-            0x22,
-            0x21,
-            0x03,
-            0,
-            NULL,
-            0,
-            IO_TIMEOUT
-        );
-        if (result < 0) {
-            dev_err(&interface->dev, "set line state failed: %d\n", -result);
-            return result;
-        }
+    data = usb_ifnum_to_if(interface_to_usbdev(interface), IO_INTF_DATA);
+    if (!data) {
+        dev_err(&interface->dev, "no data interface\n");
+        return -ENODEV;
+    }
 
+    io_dev = kmalloc(sizeof(struct io_dev), GFP_KERNEL);
+    if (IS_ERR_OR_NULL(io_dev)) {
+        dev_err(&interface->dev, "kmalloc failed\n");
+        return -ENOMEM;
+    }
 
-        result = usb_control_msg(
-            interface_to_usbdev(interface),
-            usb_sndctrlpipe(interface_to_usbdev(interface), IO_EP_CTRL),
-            0x20,
-            0x21,
-            0,
-            0,
-            line_encoding,
-            7,
-            IO_TIMEOUT
-        );
-        if (result < 0) {
-            dev_err(&interface->dev, "set line encoding failed: %d\n", -result);
-            return result;
-        }
+    memset(io_dev, 0, sizeof(struct io_dev));
+
+    io_cmdq_init(&io_dev->cmdq);
+    spin_lock_init(&io_dev->sample_lock);
+    INIT_DELAYED_WORK(&io_dev->sample_work, io_sample_work);
+    INIT_DELAYED_WORK(&io_dev->watchdog_work, io_watchdog_work);
+    INIT_DELAYED_WORK(&io_dev->duty_work, io_duty_work);
+    io_capture_init(&io_dev->capture);
+    io_latency_init(&io_dev->latency);
+    io_rate_init(&io_dev->rate, sample_interval);
+    io_pid_gains_init(&io_dev->pid_gains);
+    for (i = 0; i < IO_FAN_COUNT; i++) {
+        io_flight_init(&io_dev->tach_flight[i]);
+        io_flight_init(&io_dev->duty_flight[i]);
+    }
+    io_dev->filter_mode = IO_FILTER_NONE;
+    io_dev->filter_window = IO_FILTER_WINDOW;
 
-        return 0;
-    } else if (id->bInterfaceNumber == IO_INTF_DATA) {
-        io_dev = kmalloc(sizeof(struct io_dev), GFP_KERNEL);
-        if (IS_ERR_OR_NULL(io_dev)) {
-            dev_err(&interface->dev, "kmalloc failed\n");
-            return -ENOMEM;
-        }
+    io_cmdq_lock(&io_dev->cmdq, IO_CMDQ_WRITE);
 
-        memset(io_dev, 0, sizeof(struct io_dev));
+    io_dev->usb_dev = usb_get_dev(interface_to_usbdev(interface));
+    io_dev->ctrl = interface;
+    io_dev->data = data;
 
-        mutex_init(&io_dev->lock);
+    // The line has to be up before anything is sent on the data endpoints
+    result = io_ctrl_setup(interface);
+    if (result) {
+        goto fail1;
+    }
 
-        mutex_lock(&io_dev->lock);
+    result = usb_driver_claim_interface(&io_driver, data, io_dev);
+    if (result) {
+        dev_err(&interface->dev, "claiming data interface failed: %d\n", result);
+        goto fail1;
+    }
 
-        io_dev->usb_dev = usb_get_dev(interface_to_usbdev(interface));
+    usb_set_intfdata(interface, io_dev);
 
-        usb_set_intfdata(interface, io_dev);
+    result = io_dev_alloc(io_dev);
+    if (result) {
+        dev_err(&interface->dev, "io_dev_alloc failed: %d\n", result);
+        goto fail2;
+    }
 
-        for(retry = 0; retry < 8; retry++) {
-            dev_info(&interface->dev, "trying reset: %d\n", retry);
-            result = io_dev_reset(io_dev, IO_TIMEOUT);
-            if (result != -ETIMEDOUT) {
-                break;
-            }
-        }
-        if (result) {
-            dev_err(&interface->dev, "io_dev_reset failed: %d\n", result);
-            goto fail1;
-        }
+    result = io_dev_ready(io_dev);
+    if (result) {
+        dev_err(&interface->dev, "io_dev_ready failed: %d: %s\n", result, io_dev->error);
+        goto fail2;
+    }
 
-        result = device_create_file(&interface->dev, &dev_attr_bootloader);
-        if (result) {
-            dev_err(&interface->dev, "device_create_file failed: %d\n", result);
-            goto fail1;
-        }
+    usb_make_path(io_dev->usb_dev, path, sizeof(path));
+    io_shadow_key(io_dev->shadow_key, path, io_dev->usb_dev->serial);
 
-        result = device_create_file(&interface->dev, &dev_attr_revision);
-        if (result) {
-            dev_err(&interface->dev, "device_create_file failed: %d\n", result);
-            goto fail2;
-        }
+    io_watchdog_init(io_dev);
+    restored = io_shadow_load(io_dev);
+    if (restored) {
+        dev_info(&interface->dev, "restored previous state\n");
+    }
 
-        io_dev->hwmon_dev = hwmon_device_register_with_groups(&interface->dev, "system76_io", io_dev, io_groups);
-        if (IS_ERR(io_dev->hwmon_dev)) {
-            result = PTR_ERR(io_dev->hwmon_dev);
+    result = device_create_file(&data->dev, &dev_attr_bootloader);
+    if (result) {
+        dev_err(&interface->dev, "device_create_file failed: %d\n", result);
+        goto fail_shadow;
+    }
 
-            dev_err(&interface->dev, "hwmon_device_register_with_groups failed: %d\n", result);
-            goto fail3;
-        }
+    result = device_create_file(&data->dev, &dev_attr_revision);
+    if (result) {
+        dev_err(&interface->dev, "device_create_file failed: %d\n", result);
+        goto fail3;
+    }
+
+    io_dev->hwmon_dev = hwmon_device_register_with_groups(&data->dev, "system76_io", io_dev, io_groups);
+    if (IS_ERR(io_dev->hwmon_dev)) {
+        result = PTR_ERR(io_dev->hwmon_dev);
+
+        dev_err(&interface->dev, "hwmon_device_register_with_groups failed: %d\n", result);
+        goto fail4;
+    }
 
 #ifdef CONFIG_PM_SLEEP
-        io_dev->pm_notifier.notifier_call = io_pm;
-        register_pm_notifier(&io_dev->pm_notifier);
+    io_dev->pm_notifier.notifier_call = io_pm;
+    register_pm_notifier(&io_dev->pm_notifier);
 #endif
 
-        mutex_unlock(&io_dev->lock);
+    io_dev->debugfs = debugfs_create_dir(dev_name(&data->dev), io_debugfs);
+    io_capture_debugfs(&io_dev->capture, io_dev->debugfs);
+    io_cmdq_debugfs(&io_dev->cmdq, io_dev->debugfs);
+    io_latency_debugfs(&io_dev->latency, io_dev->debugfs);
 
-        return 0;
-
-    fail3:
-        device_remove_file(&interface->dev, &dev_attr_revision);
-    fail2:
-        device_remove_file(&interface->dev, &dev_attr_bootloader);
-    fail1:
-        usb_set_intfdata(interface, NULL);
-        usb_put_dev(io_dev->usb_dev);
+    io_watchdog_schedule(io_dev);
+    if (io_dev->filter_mode != IO_FILTER_NONE) {
+        io_sample_schedule(io_dev, 0);
+    }
 
-        mutex_unlock(&io_dev->lock);
+    io_cmdq_unlock(&io_dev->cmdq);
 
-        mutex_destroy(&io_dev->lock);
-        kfree(io_dev);
+    return 0;
 
-        return result;
-    } else {
-        return -ENODEV;
+fail4:
+    device_remove_file(&data->dev, &dev_attr_revision);
+fail3:
+    device_remove_file(&data->dev, &dev_attr_bootloader);
+fail_shadow:
+    // Keep the saved state for the next probe of this board
+    if (restored) {
+        io_shadow_store(io_dev);
     }
+fail2:
+    usb_set_intfdata(interface, NULL);
+    usb_set_intfdata(data, NULL);
+    usb_driver_release_interface(&io_driver, data);
+fail1:
+    io_dev_free(io_dev);
+    usb_put_dev(io_dev->usb_dev);
+
+    io_cmdq_unlock(&io_dev->cmdq);
+
+    kfree(io_dev);
+
+    return result;
 }
 
+// Called for either interface, whichever goes first tears down both
 static void io_disconnect(struct usb_interface *interface) {
     struct io_dev * io_dev;
-
-    dev_info(&interface->dev, "disconnect\n");
+    struct usb_interface * other;
 
     io_dev = usb_get_intfdata(interface);
+    if (!io_dev) {
+        return;
+    }
 
-    if (io_dev) {
-        mutex_lock(&io_dev->lock);
+    dev_info(&interface->dev, "disconnect\n");
 
 #ifdef CONFIG_PM_SLEEP
-        unregister_pm_notifier(&io_dev->pm_notifier);
+    unregister_pm_notifier(&io_dev->pm_notifier);
 #endif
 
-        hwmon_device_unregister(io_dev->hwmon_dev);
+    hwmon_device_unregister(io_dev->hwmon_dev);
+
+    debugfs_remove_recursive(io_dev->debugfs);
+
+    // The background work takes the queue, so stop it before taking it here
+    cancel_delayed_work_sync(&io_dev->sample_work);
+    cancel_delayed_work_sync(&io_dev->watchdog_work);
+    cancel_delayed_work_sync(&io_dev->duty_work);
+
+    io_cmdq_lock(&io_dev->cmdq, IO_CMDQ_WRITE);
+
+    io_shadow_store(io_dev);
+
+    device_remove_file(&io_dev->data->dev, &dev_attr_revision);
+
+    device_remove_file(&io_dev->data->dev, &dev_attr_bootloader);
+
+    usb_set_intfdata(io_dev->ctrl, NULL);
+    usb_set_intfdata(io_dev->data, NULL);
+    io_dev_free(io_dev);
+    io_capture_free(&io_dev->capture);
+    usb_put_dev(io_dev->usb_dev);
+
+    io_cmdq_unlock(&io_dev->cmdq);
+
+    // Comes back in here with no intfdata
+    other = interface == io_dev->ctrl ? io_dev->data : io_dev->ctrl;
+    usb_driver_release_interface(&io_driver, other);
+
+    kfree(io_dev);
+}
+
+// Without suspend and resume callbacks the USB core unbinds and reprobes on
+// every system resume, which resets the board
+static int io_suspend(struct usb_interface *interface, pm_message_t message) {
+    return 0;
+}
+
+static int io_resume(struct usb_interface *interface) {
+    return 0;
+}
+
+// The board lost power or was reset during suspend, replay the last state.
+// Both interfaces get the callback, the control one does the work.
+static int io_reset_resume(struct usb_interface *interface) {
+    int result;
+
+    struct io_dev * io_dev = usb_get_intfdata(interface);
+
+    if (!io_dev || interface != io_dev->ctrl) {
+        return 0;
+    }
 
-        device_remove_file(&interface->dev, &dev_attr_revision);
+    io_cmdq_lock(&io_dev->cmdq, IO_CMDQ_WRITE);
+    result = io_ctrl_setup(interface);
+    if (!result) {
+        io_restore(io_dev);
+    }
+    io_cmdq_unlock(&io_dev->cmdq);
 
-        device_remove_file(&interface->dev, &dev_attr_bootloader);
+    return result;
+}
 
-        usb_set_intfdata(interface, NULL);
-        usb_put_dev(io_dev->usb_dev);
+// Holds the queue across a port reset so no command is lost mid transfer
+static int io_pre_reset(struct usb_interface *interface) {
+    struct io_dev * io_dev = usb_get_intfdata(interface);
 
-        mutex_unlock(&io_dev->lock);
+    if (io_dev && interface == io_dev->ctrl) {
+        io_cmdq_lock(&io_dev->cmdq, IO_CMDQ_WRITE);
+    }
+
+    return 0;
+}
+
+static int io_post_reset(struct usb_interface *interface) {
+    int result;
+
+    struct io_dev * io_dev = usb_get_intfdata(interface);
+
+    if (!io_dev || interface != io_dev->ctrl) {
+        return 0;
+    }
 
-        mutex_destroy(&io_dev->lock);
-        kfree(io_dev);
+    result = io_ctrl_setup(interface);
+    if (!result) {
+        io_restore(io_dev);
     }
+    io_cmdq_unlock(&io_dev->cmdq);
+
+    return result;
 }
 
 static struct usb_device_id io_table[] = {
         { USB_DEVICE_INTERFACE_NUMBER(IO_VENDOR, IO_DEVICE, IO_INTF_CTRL) },
-        { USB_DEVICE_INTERFACE_NUMBER(IO_VENDOR, IO_DEVICE, IO_INTF_DATA) },
         { }
 };
 
@@ -285,15 +490,46 @@ static struct usb_driver io_driver = {
     .name        = "system76-io",
     .probe       = io_probe,
     .disconnect  = io_disconnect,
+    .suspend     = io_suspend,
+    .resume      = io_resume,
+    .reset_resume = io_reset_resume,
+    .pre_reset   = io_pre_reset,
+    .post_reset  = io_post_reset,
     .id_table    = io_table,
 };
 
 static int __init io_init(void) {
-    return usb_register(&io_driver);
+    int result;
+
+    io_wq = io_wq_alloc("system76-io", workqueue, true);
+    if (!io_wq) {
+        return -ENOMEM;
+    }
+
+    io_exec_wq = io_wq_alloc("system76-io-exec", workqueue, false);
+    if (!io_exec_wq) {
+        destroy_workqueue(io_wq);
+        return -ENOMEM;
+    }
+
+    io_debugfs = debugfs_create_dir("system76-io", NULL);
+
+    result = usb_register(&io_driver);
+    if (result) {
+        debugfs_remove_recursive(io_debugfs);
+        destroy_workqueue(io_exec_wq);
+        destroy_workqueue(io_wq);
+    }
+
+    return result;
 }
 
 static void __exit io_exit(void) {
     usb_deregister(&io_driver);
+    debugfs_remove_recursive(io_debugfs);
+    destroy_workqueue(io_exec_wq);
+    destroy_workqueue(io_wq);
+    io_shadow_clear();
 }
 
 module_init(io_init);
@@ -302,3 +538,7 @@ module_exit(io_exit);
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Jeremy Soller <jeremy@system76.com>");
 MODULE_DESCRIPTION("System76 Io driver");
+
+#ifdef SYSTEM76_IO_KUNIT
+#include "system76-io_kunit.c"
+#endif
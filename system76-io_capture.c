@@ -0,0 +1,178 @@
+/*
+ * system76-io_capture.c
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This program is free software;  you can redistribute it and/or modify
+ * it under the terms of the  GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is  distributed in the hope that it  will be useful, but
+ * WITHOUT  ANY   WARRANTY;  without   even  the  implied   warranty  of
+ * MERCHANTABILITY  or FITNESS FOR  A PARTICULAR  PURPOSE.  See  the GNU
+ * General Public License for more details.
+ *
+ * You should  have received  a copy of  the GNU General  Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Command capture, shared by both drivers. Writing 1 to capture_enable in
+// the device debugfs directory starts logging every command/response
+// exchange into a ring. Reading capture drains it as a stream of
+// struct io_capture_record in native byte order, oldest first. When the
+// ring is full the oldest record is overwritten and counted in dropped.
+// The commands and errors counters run regardless of capture_enable, so a
+// benchmark can sample them to get the USB transaction rate of a policy.
+
+#define IO_CAPTURE_RECORDS 1024
+#define IO_CAPTURE_DATA 32
+
+struct io_capture_record {
+    // CLOCK_MONOTONIC time the command was submitted
+    u64 timestamp_ns;
+    u32 latency_ns;
+    // 0 or a negative errno
+    s16 result;
+    u8 tx_len;
+    u8 rx_len;
+    // Command as sent, and reply line (Io) or input report (Thelio Io)
+    u8 tx[IO_CAPTURE_DATA];
+    u8 rx[IO_CAPTURE_DATA];
+} __packed;
+
+struct io_capture {
+    spinlock_t lock;
+    bool enabled;
+    struct io_capture_record * records;
+    unsigned int head;
+    unsigned int count;
+    u64 dropped;
+    // Updated under the command queue, which serializes all exchanges
+    u64 commands;
+    u64 errors;
+};
+
+static void io_capture_init(struct io_capture * capture) {
+    spin_lock_init(&capture->lock);
+}
+
+static void io_capture_free(struct io_capture * capture) {
+    vfree(capture->records);
+    capture->records = NULL;
+}
+
+static void io_capture_add(struct io_capture * capture, u64 start, int result, const void * tx, size_t tx_len, const void * rx, size_t rx_len) {
+    struct io_capture_record * record;
+    u64 now;
+
+    capture->commands++;
+    if (result) {
+        capture->errors++;
+    }
+
+    if (!READ_ONCE(capture->enabled)) {
+        return;
+    }
+
+    now = ktime_get_ns();
+    tx_len = min_t(size_t, tx_len, IO_CAPTURE_DATA);
+    rx_len = min_t(size_t, rx_len, IO_CAPTURE_DATA);
+
+    spin_lock(&capture->lock);
+
+    if (capture->records) {
+        record = &capture->records[capture->head];
+        capture->head = (capture->head + 1) % IO_CAPTURE_RECORDS;
+        if (capture->count < IO_CAPTURE_RECORDS) {
+            capture->count++;
+        } else {
+            capture->dropped++;
+        }
+
+        memset(record, 0, sizeof(*record));
+        record->timestamp_ns = start;
+        record->latency_ns = (u32)min_t(u64, now - start, U32_MAX);
+        record->result = (s16)result;
+        record->tx_len = tx_len;
+        record->rx_len = rx_len;
+        memcpy(record->tx, tx, tx_len);
+        memcpy(record->rx, rx, rx_len);
+    }
+
+    spin_unlock(&capture->lock);
+}
+
+static ssize_t io_capture_read(struct file * file, char __user * buf, size_t len, loff_t * ppos) {
+    struct io_capture * capture = file->private_data;
+    struct io_capture_record record;
+    size_t done;
+
+    done = 0;
+    while (len - done >= sizeof(record)) {
+        spin_lock(&capture->lock);
+        if (!capture->records || !capture->count) {
+            spin_unlock(&capture->lock);
+            break;
+        }
+        record = capture->records[(capture->head + IO_CAPTURE_RECORDS - capture->count) % IO_CAPTURE_RECORDS];
+        capture->count--;
+        spin_unlock(&capture->lock);
+
+        if (copy_to_user(buf + done, &record, sizeof(record))) {
+            return done ? done : -EFAULT;
+        }
+        done += sizeof(record);
+    }
+
+    return done;
+}
+
+static const struct file_operations io_capture_fops = {
+    .owner = THIS_MODULE,
+    .open = simple_open,
+    .read = io_capture_read,
+};
+
+static int io_capture_enable_get(void * data, u64 * value) {
+    struct io_capture * capture = data;
+
+    *value = READ_ONCE(capture->enabled);
+
+    return 0;
+}
+
+static int io_capture_enable_set(void * data, u64 value) {
+    struct io_capture * capture = data;
+    struct io_capture_record * records;
+
+    records = NULL;
+    if (value && !READ_ONCE(capture->records)) {
+        records = vzalloc(IO_CAPTURE_RECORDS * sizeof(*records));
+        if (!records) {
+            return -ENOMEM;
+        }
+    }
+
+    spin_lock(&capture->lock);
+    if (records && !capture->records) {
+        capture->records = records;
+        records = NULL;
+    }
+    capture->enabled = !!value;
+    spin_unlock(&capture->lock);
+
+    vfree(records);
+
+    return 0;
+}
+
+DEFINE_DEBUGFS_ATTRIBUTE(io_capture_enable_fops, io_capture_enable_get, io_capture_enable_set, "%llu\n");
+
+static void io_capture_debugfs(struct io_capture * capture, struct dentry * dir) {
+    debugfs_create_file("capture", 0400, dir, capture, &io_capture_fops);
+    debugfs_create_file_unsafe("capture_enable", 0600, dir, capture, &io_capture_enable_fops);
+    debugfs_create_u64("capture_dropped", 0400, dir, &capture->dropped);
+    debugfs_create_u64("commands", 0400, dir, &capture->commands);
+    debugfs_create_u64("errors", 0400, dir, &capture->errors);
+}
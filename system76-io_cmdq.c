@@ -0,0 +1,182 @@
+/*
+ * system76-io_cmdq.c
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This program is free software;  you can redistribute it and/or modify
+ * it under the terms of the  GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is  distributed in the hope that it  will be useful, but
+ * WITHOUT  ANY   WARRANTY;  without   even  the  implied   warranty  of
+ * MERCHANTABILITY  or FITNESS FOR  A PARTICULAR  PURPOSE.  See  the GNU
+ * General Public License for more details.
+ *
+ * You should  have received  a copy of  the GNU General  Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Device lock with two priority classes, shared by both drivers. Fan control
+// (duty writes, suspend) always goes ahead of queued monitoring reads, except
+// that after IO_CMDQ_STARVE_LIMIT writes in a row one waiting read is let
+// through so scrapers cannot be starved forever.
+
+#define IO_CMDQ_STARVE_LIMIT 4
+
+enum io_cmdq_class {
+    IO_CMDQ_WRITE,
+    IO_CMDQ_READ,
+    IO_CMDQ_CLASSES,
+};
+
+static const char * const io_cmdq_classes[] = {
+    [IO_CMDQ_WRITE] = "write",
+    [IO_CMDQ_READ] = "read",
+};
+
+struct io_cmdq {
+    spinlock_t lock;
+    wait_queue_head_t wait;
+    bool busy;
+    unsigned int streak;
+    unsigned int waiting[IO_CMDQ_CLASSES];
+    unsigned int max_depth[IO_CMDQ_CLASSES];
+    u64 grants[IO_CMDQ_CLASSES];
+#ifdef CONFIG_DEBUG_LOCK_ALLOC
+    // The queue is a sleeping lock that lockdep cannot see through the
+    // spinlock and wait queue, so it gets a map of its own
+    struct lockdep_map dep_map;
+#endif
+};
+
+static void __io_cmdq_init(struct io_cmdq * cmdq, const char * name, struct lock_class_key * key) {
+    memset(cmdq, 0, sizeof(*cmdq));
+    spin_lock_init(&cmdq->lock);
+    init_waitqueue_head(&cmdq->wait);
+    lockdep_init_map(&cmdq->dep_map, name, key, 0);
+}
+
+// One lock class per call site, like mutex_init
+#define io_cmdq_init(cmdq) \
+    do { \
+        static struct lock_class_key __key; \
+        __io_cmdq_init((cmdq), #cmdq, &__key); \
+    } while (0)
+
+// Called with cmdq->lock held
+static bool io_cmdq_may_run(struct io_cmdq * cmdq, enum io_cmdq_class class) {
+    bool starved;
+
+    if (cmdq->busy) {
+        return false;
+    }
+
+    starved = cmdq->waiting[IO_CMDQ_READ] && cmdq->streak >= IO_CMDQ_STARVE_LIMIT;
+    if (class == IO_CMDQ_WRITE) {
+        return !starved;
+    } else {
+        return !cmdq->waiting[IO_CMDQ_WRITE] || starved;
+    }
+}
+
+// Called with cmdq->lock held, which is dropped while sleeping. A killable
+// wait gives up with -EINTR on a fatal signal.
+static int io_cmdq_wait(struct io_cmdq * cmdq, enum io_cmdq_class class, bool killable) {
+    DEFINE_WAIT(wait);
+    int ret = 0;
+
+    for (;;) {
+        prepare_to_wait(&cmdq->wait, &wait, killable ? TASK_KILLABLE : TASK_UNINTERRUPTIBLE);
+        if (io_cmdq_may_run(cmdq, class)) {
+            break;
+        }
+        if (killable && fatal_signal_pending(current)) {
+            ret = -EINTR;
+            break;
+        }
+        spin_unlock_irq(&cmdq->lock);
+        schedule();
+        spin_lock_irq(&cmdq->lock);
+    }
+    finish_wait(&cmdq->wait, &wait);
+
+    return ret;
+}
+
+static int __io_cmdq_lock(struct io_cmdq * cmdq, enum io_cmdq_class class, bool killable) {
+    int ret;
+
+    lock_map_acquire(&cmdq->dep_map);
+
+    spin_lock_irq(&cmdq->lock);
+
+    cmdq->waiting[class]++;
+    cmdq->max_depth[class] = max(cmdq->max_depth[class], cmdq->waiting[class]);
+
+    ret = io_cmdq_wait(cmdq, class, killable);
+
+    cmdq->waiting[class]--;
+    if (ret) {
+        spin_unlock_irq(&cmdq->lock);
+        lock_map_release(&cmdq->dep_map);
+
+        // A write held back for this read may be able to run now
+        wake_up_all(&cmdq->wait);
+        return ret;
+    }
+
+    cmdq->busy = true;
+    cmdq->grants[class]++;
+    if (class == IO_CMDQ_WRITE && cmdq->waiting[IO_CMDQ_READ]) {
+        cmdq->streak++;
+    } else {
+        cmdq->streak = 0;
+    }
+
+    spin_unlock_irq(&cmdq->lock);
+
+    return 0;
+}
+
+// For fan control and background work, which must not be cut short
+static void io_cmdq_lock(struct io_cmdq * cmdq, enum io_cmdq_class class) {
+    __io_cmdq_lock(cmdq, class, false);
+}
+
+// For reads on behalf of a user, who can still be killed while queued
+// behind a slow device
+static int __must_check io_cmdq_lock_killable(struct io_cmdq * cmdq) {
+    return __io_cmdq_lock(cmdq, IO_CMDQ_READ, true);
+}
+
+static void io_cmdq_unlock(struct io_cmdq * cmdq) {
+    spin_lock_irq(&cmdq->lock);
+    cmdq->busy = false;
+    spin_unlock_irq(&cmdq->lock);
+
+    lock_map_release(&cmdq->dep_map);
+
+    wake_up_all(&cmdq->wait);
+}
+
+static int io_cmdq_show(struct seq_file * s, void * unused) {
+    struct io_cmdq * cmdq = s->private;
+    int class;
+
+    seq_printf(s, "%-6s %8s %10s %12s\n", "class", "waiting", "max_depth", "grants");
+
+    spin_lock_irq(&cmdq->lock);
+    for (class = 0; class < IO_CMDQ_CLASSES; class++) {
+        seq_printf(s, "%-6s %8u %10u %12llu\n", io_cmdq_classes[class], cmdq->waiting[class], cmdq->max_depth[class], cmdq->grants[class]);
+    }
+    spin_unlock_irq(&cmdq->lock);
+
+    return 0;
+}
+
+DEFINE_SHOW_ATTRIBUTE(io_cmdq);
+
+static void io_cmdq_debugfs(struct io_cmdq * cmdq, struct dentry * dir) {
+    debugfs_create_file("queue", 0400, dir, cmdq, &io_cmdq_fops);
+}
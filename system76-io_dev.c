@@ -17,189 +17,298 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
+// Readiness detection at probe, in ms. Each IoRSET waits IO_TIMEOUT.
+#define IO_DRAIN_TIMEOUT 5
+#define IO_DRAIN_MAX 16
+#define IO_READY_BUDGET 8000
+
+// Bulk transport of an io_dev, io_dev_usb_ops unless a test model replaces it
+struct io_dev_ops {
+    void * (*alloc)(struct usb_device * dev, size_t size, gfp_t mem_flags, dma_addr_t * dma);
+    void (*free)(struct usb_device * dev, size_t size, void * addr, dma_addr_t dma);
+    int (*submit)(struct urb * urb, gfp_t mem_flags);
+    void (*kill)(struct urb * urb);
+};
+
+static const struct io_dev_ops io_dev_usb_ops = {
+    .alloc = usb_alloc_coherent,
+    .free = usb_free_coherent,
+    .submit = usb_submit_urb,
+    .kill = usb_kill_urb,
+};
+
 struct io_dev {
-    struct mutex lock;
+    // Serializes commands and guards the state below unless noted otherwise
+    struct io_cmdq cmdq;
     struct usb_device * usb_dev;
+    // Bound interface and the data interface claimed from it, both carry io_dev as intfdata
+    struct usb_interface * ctrl;
+    struct usb_interface * data;
     struct device * hwmon_dev;
 #ifdef CONFIG_PM_SLEEP
     struct notifier_block pm_notifier;
 #endif
-    char command[IO_MSG_SIZE];
-    char partial[IO_MSG_SIZE];
-    char lines[2][IO_MSG_SIZE];
-    char response[IO_MSG_SIZE];
+    struct delayed_work sample_work;
+    struct io_rate rate;
+    // Protects filter state, which is read without waiting on the device
+    spinlock_t sample_lock;
+    enum io_filter_mode filter_mode;
+    unsigned int filter_window;
+    struct io_filter filters[IO_FAN_COUNT];
+    // Coalesces concurrent IoTACH and IoDUTY reads per fan
+    struct io_flight tach_flight[IO_FAN_COUNT];
+    struct io_flight duty_flight[IO_FAN_COUNT];
+    // Watchdog state
+    struct delayed_work watchdog_work;
+    unsigned int watchdog_timeout;
+    unsigned long watchdog_keepalive;
+    u16 duty[IO_FAN_COUNT];
+    u8 alarm[IO_FAN_COUNT];
+    u8 stall[IO_FAN_COUNT];
+    // Set between PM_SUSPEND_PREPARE and PM_POST_SUSPEND
+    bool suspended;
+    // Identifies the board across re-enumeration, see system76-io_shadow.c
+    char shadow_key[IO_SHADOW_KEY];
+    // Commanded duty and slew rate limiter state
+    struct delayed_work duty_work;
+    u16 target[IO_FAN_COUNT];
+    unsigned int ramp_rate[IO_FAN_COUNT];
+    // Fraction of a duty step left over from the last tick, in 1/255000 duty units
+    u32 ramp_carry[IO_FAN_COUNT];
+    u64 request_ns[IO_FAN_COUNT];
+    int duty_result[IO_FAN_COUNT];
+    // Consecutive failed ramp steps, see IO_RAMP_RETRIES
+    u8 ramp_errors[IO_FAN_COUNT];
+    struct io_latency latency;
+    // fanN_target regulators, run from the sample work
+    struct io_pid pid[IO_FAN_COUNT];
+    struct io_pid_gains pid_gains;
+    // Preallocated transfers, commands are formatted directly into tx_buf
+    const struct io_dev_ops * ops;
+    struct urb * tx_urb;
+    struct urb * rx_urb;
+    char * tx_buf;
+    char * rx_buf;
+    struct completion urb_done;
+    struct dentry * debugfs;
+    struct io_capture capture;
+    // Response parser state, filled from rx_buf
+    struct io_parser parser;
+    const char * error;
 };
 
-static ssize_t io_dev_read(struct io_dev * io_dev, char * buf, size_t len, int timeout) {
+static void io_dev_urb_complete(struct urb * urb) {
+    complete(urb->context);
+}
+
+static int io_dev_alloc_urb(struct io_dev * io_dev, struct urb ** urb, char ** buf, unsigned int pipe) {
+    *urb = usb_alloc_urb(0, GFP_KERNEL);
+    if (!*urb) {
+        return -ENOMEM;
+    }
+
+    *buf = io_dev->ops->alloc(io_dev->usb_dev, IO_MSG_SIZE, GFP_KERNEL, &(*urb)->transfer_dma);
+    if (!*buf) {
+        usb_free_urb(*urb);
+        *urb = NULL;
+        return -ENOMEM;
+    }
+
+    usb_fill_bulk_urb(*urb, io_dev->usb_dev, pipe, *buf, IO_MSG_SIZE, io_dev_urb_complete, &io_dev->urb_done);
+    (*urb)->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+
+    return 0;
+}
+
+static void io_dev_free_urb(struct io_dev * io_dev, struct urb * urb, char * buf) {
+    if (urb) {
+        io_dev->ops->free(io_dev->usb_dev, IO_MSG_SIZE, buf, urb->transfer_dma);
+        usb_free_urb(urb);
+    }
+}
+
+static void io_dev_free(struct io_dev * io_dev) {
+    io_dev_free_urb(io_dev, io_dev->rx_urb, io_dev->rx_buf);
+    io_dev->rx_urb = NULL;
+    io_dev_free_urb(io_dev, io_dev->tx_urb, io_dev->tx_buf);
+    io_dev->tx_urb = NULL;
+}
+
+static int io_dev_alloc(struct io_dev * io_dev) {
     int result;
-    int count;
-
-    result = usb_bulk_msg(
-        io_dev->usb_dev,
-        usb_rcvbulkpipe(io_dev->usb_dev, IO_EP_IN),
-        (void *)buf,
-        len,
-        &count,
-        timeout
-    );
+
+    if (!io_dev->ops) {
+        io_dev->ops = &io_dev_usb_ops;
+    }
+    init_completion(&io_dev->urb_done);
+
+    result = io_dev_alloc_urb(io_dev, &io_dev->tx_urb, &io_dev->tx_buf, usb_sndbulkpipe(io_dev->usb_dev, IO_EP_OUT));
     if (result) {
         return result;
     }
 
-    return count;
+    result = io_dev_alloc_urb(io_dev, &io_dev->rx_urb, &io_dev->rx_buf, usb_rcvbulkpipe(io_dev->usb_dev, IO_EP_IN));
+    if (result) {
+        io_dev_free(io_dev);
+        return result;
+    }
+
+    return 0;
 }
 
-static ssize_t io_dev_write(struct io_dev * io_dev, const char * buf, size_t len, int timeout) {
+// Synchronous submit, equivalent to usb_bulk_msg but on a preallocated urb
+static ssize_t io_dev_transfer(struct io_dev * io_dev, struct urb * urb, size_t len, int timeout) {
     int result;
-    int count;
-
-    result = usb_bulk_msg(
-        io_dev->usb_dev,
-        usb_sndbulkpipe(io_dev->usb_dev, IO_EP_OUT),
-        (void *)buf,
-        len,
-        &count,
-        timeout
-    );
+
+    urb->transfer_buffer_length = len;
+    reinit_completion(&io_dev->urb_done);
+
+    result = io_dev->ops->submit(urb, GFP_KERNEL);
     if (result) {
         return result;
     }
 
-    return count;
+    if (!wait_for_completion_timeout(&io_dev->urb_done, msecs_to_jiffies(timeout))) {
+        io_dev->ops->kill(urb);
+        // The URB may have completed between the timeout and the kill
+        if (urb->status == -ENOENT) {
+            return -ETIMEDOUT;
+        }
+        if (urb->status) {
+            return urb->status;
+        }
+        return urb->actual_length;
+    }
+
+    if (urb->status) {
+        return urb->status;
+    }
+
+    return urb->actual_length;
 }
 
-static int io_dev_command(struct io_dev * io_dev, const char * command, size_t clen, char * response, size_t rlen, int timeout) {
+static ssize_t io_dev_read(struct io_dev * io_dev, int timeout) {
+    return io_dev_transfer(io_dev, io_dev->rx_urb, IO_MSG_SIZE, timeout);
+}
+
+static ssize_t io_dev_write(struct io_dev * io_dev, size_t len, int timeout) {
+    return io_dev_transfer(io_dev, io_dev->tx_urb, len, timeout);
+}
+
+static int io_dev_exchange(struct io_dev * io_dev, size_t clen, const char ** reply, int timeout) {
     int result;
-    bool cr;
-    bool lf;
-    int i;
-    char c;
-    int lines_i;
-    int line_i;
-    bool error;
 
-    memset(response, 0, rlen);
+    io_dev->error = "";
+    *reply = "";
 
-    result = io_dev_write(io_dev, command, clen, timeout);
+    result = io_dev_write(io_dev, clen, timeout);
     if (result < 0) {
-        snprintf(response, rlen, "io_dev_write");
+        io_dev->error = "io_dev_write";
         return result;
     }
 
-    cr = 0;
-    lf = 0;
-    lines_i = 0;
-    line_i = 0;
-    for (;;) {
-        result = io_dev_read(io_dev, io_dev->partial, IO_MSG_SIZE, timeout);
+    io_parser_init(&io_dev->parser);
+    do {
+        result = io_dev_read(io_dev, timeout);
         if (result < 0) {
-            snprintf(response, rlen, "io_dev_read");
+            io_dev->error = "io_dev_read";
             return result;
         }
 
-        for (i = 0; i < result; i++) {
-            c = io_dev->partial[i];
-            if (c == '\r') {
-                if (!cr) {
-                    cr = 1;
-                } else {
-                    // Unexpected \r, return error
-                    snprintf(response, rlen, "Unexpected CR");
-                    return -EINVAL;
-                }
-            } else if (c == '\n') {
-                if (cr) {
-                    cr = 0;
-                    if (lf) {
-                        // Received a response in full
-                        if (lines_i < 2 && line_i < IO_MSG_SIZE) {
-                            io_dev->lines[lines_i++][line_i] = 0;
-                            line_i = 0;
-                        } else {
-                            snprintf(response, rlen, "Too many lines");
-                            return -EINVAL;
-                        }
-                    }
-                    lf = !lf;
-                } else {
-                    // Unexpected \n, return error
-                    snprintf(response, rlen, "Unexpected LF");
-                    return -EINVAL;
-                }
-            } else if (!cr && lf) {
-                // Received a response byte
-                if (lines_i < 2 && line_i < IO_MSG_SIZE) {
-                    io_dev->lines[lines_i][line_i++] = c;
-                } else {
-                    // Response too long
-                    snprintf(response, rlen, "Too many chars");
-                    return -EINVAL;
-                }
-            } else {
-                // Unexpected data, return error
-                snprintf(response, rlen, "Unexpected char");
-                return -EINVAL;
-            }
+        result = io_parser_feed(&io_dev->parser, io_dev->rx_buf, result, &io_dev->error);
+        if (result < 0) {
+            return result;
         }
+    } while (!result);
 
-        if (lines_i > 0) {
-            if (strcmp(io_dev->lines[lines_i - 1], "OK") == 0) {
-                error = 0;
-                break;
-            } else if (strcmp(io_dev->lines[lines_i - 1], "ERROR") == 0) {
-                error = 1;
-            }
-        }
-    }
+    *reply = io_parser_reply(&io_dev->parser);
 
-    if (lines_i > 1) {
-        snprintf(response, rlen, "%s", io_dev->lines[lines_i - 2]);
-    }
-
-    if (error) {
+    if (io_dev->parser.error) {
+        io_dev->error = *reply;
         return -EIO;
     } else {
         return 0;
     }
 }
 
+// Sends the command already formatted in tx_buf, on success reply points at the response line
+static int io_dev_command(struct io_dev * io_dev, size_t clen, const char ** reply, int timeout) {
+    u64 start;
+    int result;
+
+    start = ktime_get_ns();
+    result = io_dev_exchange(io_dev, clen, reply, timeout);
+    io_capture_add(&io_dev->capture, start, result, io_dev->tx_buf, clen, *reply, strlen(*reply));
+
+    return result;
+}
+
 static int io_dev_bootloader(struct io_dev * io_dev, int timeout) {
+    const char * reply;
     int len;
     int result;
 
-    len = snprintf(io_dev->command, IO_MSG_SIZE, "IoBOOT\r");
+    len = snprintf(io_dev->tx_buf, IO_MSG_SIZE, IO_CMD_BOOT "\r");
     if (len >= IO_MSG_SIZE) {
         return -EINVAL;
     }
 
-    result = io_dev_command(io_dev, io_dev->command, len, io_dev->response, IO_MSG_SIZE, timeout);
+    result = io_dev_command(io_dev, len, &reply, timeout);
     if (result) {
-        dev_err(&io_dev->usb_dev->dev, "io_dev_boot failed: %d: %s\n", -result, io_dev->response);
+        dev_err(&io_dev->usb_dev->dev, "io_dev_boot failed: %d: %s\n", -result, io_dev->error);
         return result;
     }
 
     return 0;
 }
 
+// Sends IoRSET without logging, failures are expected while the board boots
 static int io_dev_reset(struct io_dev * io_dev, int timeout) {
+    const char * reply;
     int len;
-    int result;
 
-    len = snprintf(io_dev->command, IO_MSG_SIZE, "IoRSET\r");
+    len = snprintf(io_dev->tx_buf, IO_MSG_SIZE, IO_CMD_RESET "\r");
     if (len >= IO_MSG_SIZE) {
         return -EINVAL;
     }
 
-    result = io_dev_command(io_dev, io_dev->command, len, io_dev->response, IO_MSG_SIZE, timeout);
-    if (result) {
-        dev_err(&io_dev->usb_dev->dev, "io_dev_reset failed: %d: %s\n", -result, io_dev->response);
-        return result;
+    return io_dev_command(io_dev, len, &reply, timeout);
+}
+
+// Discards anything the board left queued on the IN endpoint, so the next
+// reply read is the answer to the next command
+static void io_dev_drain(struct io_dev * io_dev) {
+    int i;
+
+    for (i = 0; i < IO_DRAIN_MAX; i++) {
+        if (io_dev_read(io_dev, IO_DRAIN_TIMEOUT) < 0) {
+            break;
+        }
     }
+}
 
-    return 0;
+// Waits for the board to answer IoRSET. A healthy board answers the first
+// one, so it is up as soon as it replies rather than after a fixed delay.
+static int io_dev_ready(struct io_dev * io_dev) {
+    unsigned long deadline;
+    int result;
+
+    deadline = jiffies + msecs_to_jiffies(IO_READY_BUDGET);
+
+    do {
+        io_dev_drain(io_dev);
+
+        result = io_dev_reset(io_dev, IO_TIMEOUT);
+        if (!result || result == -ENODEV || result == -ESHUTDOWN) {
+            return result;
+        }
+    } while (time_before(jiffies, deadline));
+
+    return result;
 }
 
 static int io_dev_tach(struct io_dev * io_dev, const char * device, u16 * value, int timeout) {
+    const char * reply;
     int len;
     int result;
 
@@ -207,21 +316,22 @@ static int io_dev_tach(struct io_dev * io_dev, const char * device, u16 * value,
         return -EINVAL;
     }
 
-    len = snprintf(io_dev->command, IO_MSG_SIZE, "IoTACH%s\r", device);
+    len = snprintf(io_dev->tx_buf, IO_MSG_SIZE, IO_CMD_TACH "%s\r", device);
     if (len >= IO_MSG_SIZE) {
         return -EINVAL;
     }
 
-    result = io_dev_command(io_dev, io_dev->command, len, io_dev->response, IO_MSG_SIZE, timeout);
+    result = io_dev_command(io_dev, len, &reply, timeout);
     if (result) {
-        dev_err(&io_dev->usb_dev->dev, "io_dev_tach failed: %d: %s\n", -result, io_dev->response);
+        dev_err(&io_dev->usb_dev->dev, "io_dev_tach failed: %d: %s\n", -result, io_dev->error);
         return result;
     }
 
-    return kstrtou16(io_dev->response, 16, value);
+    return kstrtou16(reply, 16, value);
 }
 
 static int io_dev_duty(struct io_dev * io_dev, const char * device, u16 * value, int timeout) {
+    const char * reply;
     int len;
     int result;
 
@@ -229,21 +339,22 @@ static int io_dev_duty(struct io_dev * io_dev, const char * device, u16 * value,
         return -EINVAL;
     }
 
-    len = snprintf(io_dev->command, IO_MSG_SIZE, "IoDUTY%s\r", device);
+    len = snprintf(io_dev->tx_buf, IO_MSG_SIZE, IO_CMD_DUTY "%s\r", device);
     if (len >= IO_MSG_SIZE) {
         return -EINVAL;
     }
 
-    result = io_dev_command(io_dev, io_dev->command, len, io_dev->response, IO_MSG_SIZE, timeout);
+    result = io_dev_command(io_dev, len, &reply, timeout);
     if (result) {
-        dev_err(&io_dev->usb_dev->dev, "io_dev_duty failed: %d: %s\n", -result, io_dev->response);
+        dev_err(&io_dev->usb_dev->dev, "io_dev_duty failed: %d: %s\n", -result, io_dev->error);
         return result;
     }
 
-    return kstrtou16(io_dev->response, 16, value);
+    return kstrtou16(reply, 16, value);
 }
 
 static int io_dev_set_duty(struct io_dev * io_dev, const char * device, u16 value, int timeout) {
+    const char * reply;
     int len;
     int result;
 
@@ -251,18 +362,18 @@ static int io_dev_set_duty(struct io_dev * io_dev, const char * device, u16 valu
         return -EINVAL;
     }
 
-    if (value > 10000) {
+    if (value > IO_DUTY_MAX) {
         return -EINVAL;
     }
 
-    len = snprintf(io_dev->command, IO_MSG_SIZE, "IoDUTY%s%04X\r", device, value);
+    len = snprintf(io_dev->tx_buf, IO_MSG_SIZE, IO_CMD_DUTY "%s%04X\r", device, value);
     if (len >= IO_MSG_SIZE) {
         return -EINVAL;
     }
 
-    result = io_dev_command(io_dev, io_dev->command, len, io_dev->response, IO_MSG_SIZE, timeout);
+    result = io_dev_command(io_dev, len, &reply, timeout);
     if (result) {
-        dev_err(&io_dev->usb_dev->dev, "io_dev_set_duty failed: %d: %s\n", -result, io_dev->response);
+        dev_err(&io_dev->usb_dev->dev, "io_dev_set_duty failed: %d: %s\n", -result, io_dev->error);
         return result;
     }
 
@@ -270,6 +381,7 @@ static int io_dev_set_duty(struct io_dev * io_dev, const char * device, u16 valu
 }
 
 static int io_dev_set_suspend(struct io_dev * io_dev, u16 value, int timeout) {
+    const char * reply;
     int len;
     int result;
 
@@ -277,14 +389,14 @@ static int io_dev_set_suspend(struct io_dev * io_dev, u16 value, int timeout) {
         return -EINVAL;
     }
 
-    len = snprintf(io_dev->command, IO_MSG_SIZE, "IoSUSP%04X\r", value);
+    len = snprintf(io_dev->tx_buf, IO_MSG_SIZE, IO_CMD_SUSPEND "%04X\r", value);
     if (len >= IO_MSG_SIZE) {
         return -EINVAL;
     }
 
-    result = io_dev_command(io_dev, io_dev->command, len, io_dev->response, IO_MSG_SIZE, timeout);
+    result = io_dev_command(io_dev, len, &reply, timeout);
     if (result) {
-        dev_err(&io_dev->usb_dev->dev, "io_dev_set_suspend failed: %d: %s\n", -result, io_dev->response);
+        dev_err(&io_dev->usb_dev->dev, "io_dev_set_suspend failed: %d: %s\n", -result, io_dev->error);
         return result;
     }
 
@@ -292,19 +404,22 @@ static int io_dev_set_suspend(struct io_dev * io_dev, u16 value, int timeout) {
 }
 
 static int io_dev_revision(struct io_dev * io_dev, char * value, int value_len, int timeout) {
+    const char * reply;
     int len;
     int result;
 
-    len = snprintf(io_dev->command, IO_MSG_SIZE, "IoREVISION\r");
+    len = snprintf(io_dev->tx_buf, IO_MSG_SIZE, IO_CMD_REVISION "\r");
     if (len >= IO_MSG_SIZE) {
         return -EINVAL;
     }
 
-    result = io_dev_command(io_dev, io_dev->command, len, value, value_len, timeout);
+    result = io_dev_command(io_dev, len, &reply, timeout);
     if (result) {
-        dev_err(&io_dev->usb_dev->dev, "io_dev_revision failed: %d: %s\n", -result, value);
+        dev_err(&io_dev->usb_dev->dev, "io_dev_revision failed: %d: %s\n", -result, io_dev->error);
         return result;
     }
 
+    strscpy(value, reply, value_len);
+
     return strlen(value);
 }
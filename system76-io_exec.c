@@ -0,0 +1,136 @@
+/*
+ * system76-io_exec.c
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This program is free software;  you can redistribute it and/or modify
+ * it under the terms of the  GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is  distributed in the hope that it  will be useful, but
+ * WITHOUT  ANY   WARRANTY;  without   even  the  implied   warranty  of
+ * MERCHANTABILITY  or FITNESS FOR  A PARTICULAR  PURPOSE.  See  the GNU
+ * General Public License for more details.
+ *
+ * You should  have received  a copy of  the GNU General  Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Execution context for device I/O, shared by both drivers. Duty writes and
+// all background work run on a dedicated high priority workqueue, sysfs
+// reads and PM notifications on a second one, and the delay from a duty
+// request to its command going out is recorded.
+
+// Bucket i counts latencies below 2^i microseconds, the last one the rest
+#define IO_LATENCY_BUCKETS 16
+
+struct io_latency {
+    spinlock_t lock;
+    u64 count;
+    u64 total_ns;
+    u64 max_ns;
+    u64 buckets[IO_LATENCY_BUCKETS];
+};
+
+// reclaim gives the queue a rescuer, for the background work fan control
+// depends on. The queue behind io_exec_call must not have one, see there.
+static struct workqueue_struct * io_wq_alloc(const char * name, const char * mode, bool reclaim) {
+    unsigned int flags;
+
+    flags = WQ_FREEZABLE | WQ_HIGHPRI;
+    if (reclaim) {
+        flags |= WQ_MEM_RECLAIM;
+    }
+    if (sysfs_streq(mode, "unbound")) {
+        flags |= WQ_UNBOUND;
+    } else if (!sysfs_streq(mode, "highpri")) {
+        pr_warn("%s: unknown workqueue mode '%s', using highpri\n", name, mode);
+    }
+
+    return alloc_workqueue("%s", flags, 0, name);
+}
+
+// A device call made on behalf of a caller outside the workqueue. fn gets
+// the device in data, a fan index or flag in arg and a result buffer in out.
+struct io_exec {
+    struct work_struct work;
+    int (*fn)(struct io_exec * exec);
+    void * data;
+    int arg;
+    void * out;
+    int result;
+};
+
+static void io_exec_work(struct work_struct * work) {
+    struct io_exec * exec = container_of(work, struct io_exec, work);
+
+    exec->result = exec->fn(exec);
+}
+
+// Runs fn on wq and waits for its result. Callers hold the command queue and
+// fn never takes it. wq must not also run works that take the command queue
+// and must not have a rescuer: a rescuer runs its works one at a time, and
+// one blocked on the queue ahead of fn would never let fn run.
+static int io_exec_call(struct workqueue_struct * wq, int (*fn)(struct io_exec *), void * data, int arg, void * out) {
+    struct io_exec exec = {
+        .fn = fn,
+        .data = data,
+        .arg = arg,
+        .out = out,
+    };
+
+    INIT_WORK_ONSTACK(&exec.work, io_exec_work);
+    queue_work(wq, &exec.work);
+    flush_work(&exec.work);
+    destroy_work_on_stack(&exec.work);
+
+    return exec.result;
+}
+
+static void io_latency_init(struct io_latency * latency) {
+    memset(latency, 0, sizeof(*latency));
+    spin_lock_init(&latency->lock);
+}
+
+static void io_latency_add(struct io_latency * latency, u64 start) {
+    u64 ns;
+    u64 us;
+    int bucket;
+
+    ns = ktime_get_ns() - start;
+    us = div_u64(ns, NSEC_PER_USEC);
+    bucket = us ? min(fls64(us), IO_LATENCY_BUCKETS - 1) : 0;
+
+    spin_lock(&latency->lock);
+    latency->count++;
+    latency->total_ns += ns;
+    latency->max_ns = max(latency->max_ns, ns);
+    latency->buckets[bucket]++;
+    spin_unlock(&latency->lock);
+}
+
+static int io_latency_show(struct seq_file * s, void * unused) {
+    struct io_latency * latency = s->private;
+    int bucket;
+
+    spin_lock(&latency->lock);
+
+    seq_printf(s, "count %llu\n", latency->count);
+    seq_printf(s, "avg_ns %llu\n", latency->count ? div64_u64(latency->total_ns, latency->count) : 0);
+    seq_printf(s, "max_ns %llu\n", latency->max_ns);
+    for (bucket = 0; bucket < IO_LATENCY_BUCKETS - 1; bucket++) {
+        seq_printf(s, "lt_%uus %llu\n", 1U << bucket, latency->buckets[bucket]);
+    }
+    seq_printf(s, "ge_%uus %llu\n", 1U << (IO_LATENCY_BUCKETS - 2), latency->buckets[IO_LATENCY_BUCKETS - 1]);
+
+    spin_unlock(&latency->lock);
+
+    return 0;
+}
+
+DEFINE_SHOW_ATTRIBUTE(io_latency);
+
+static void io_latency_debugfs(struct io_latency * latency, struct dentry * dir) {
+    debugfs_create_file("latency", 0400, dir, latency, &io_latency_fops);
+}
@@ -0,0 +1,155 @@
+/*
+ * system76-io_filter.c
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This program is free software;  you can redistribute it and/or modify
+ * it under the terms of the  GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is  distributed in the hope that it  will be useful, but
+ * WITHOUT  ANY   WARRANTY;  without   even  the  implied   warranty  of
+ * MERCHANTABILITY  or FITNESS FOR  A PARTICULAR  PURPOSE.  See  the GNU
+ * General Public License for more details.
+ *
+ * You should  have received  a copy of  the GNU General  Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Ring of recent tach samples per channel, shared by both drivers
+
+#define IO_FILTER_SAMPLES 16
+#define IO_FILTER_WINDOW 8
+// Fixed point fraction bits used for the EMA and median results
+#define IO_FILTER_SHIFT 8
+
+enum io_filter_mode {
+    IO_FILTER_NONE,
+    IO_FILTER_EMA,
+    IO_FILTER_MEDIAN,
+};
+
+static const char * const io_filter_modes[] = {
+    [IO_FILTER_NONE] = "none",
+    [IO_FILTER_EMA] = "ema",
+    [IO_FILTER_MEDIAN] = "median",
+};
+
+struct io_filter {
+    u16 samples[IO_FILTER_SAMPLES];
+    unsigned int head;
+    unsigned int count;
+    u32 ema;
+};
+
+static void io_filter_reset(struct io_filter * filter) {
+    memset(filter, 0, sizeof(*filter));
+}
+
+static void io_filter_push(struct io_filter * filter, u16 value, unsigned int window) {
+    s32 diff;
+
+    filter->samples[filter->head] = value;
+    filter->head = (filter->head + 1) % IO_FILTER_SAMPLES;
+
+    if (filter->count == 0) {
+        filter->ema = (u32)value << IO_FILTER_SHIFT;
+    } else {
+        // alpha = 2 / (window + 1), matching an N sample moving average
+        diff = ((s32)value << IO_FILTER_SHIFT) - (s32)filter->ema;
+        filter->ema = (u32)((s32)filter->ema + (diff * 2) / (s32)(window + 1));
+    }
+
+    if (filter->count < IO_FILTER_SAMPLES) {
+        filter->count++;
+    }
+}
+
+static u32 io_filter_median(const struct io_filter * filter, unsigned int window) {
+    u16 sorted[IO_FILTER_SAMPLES];
+    unsigned int count;
+    unsigned int i;
+    unsigned int j;
+    u16 value;
+
+    count = min(window, filter->count);
+    for (i = 0; i < count; i++) {
+        value = filter->samples[(filter->head + IO_FILTER_SAMPLES - 1 - i) % IO_FILTER_SAMPLES];
+        for (j = i; j > 0 && sorted[j - 1] > value; j--) {
+            sorted[j] = sorted[j - 1];
+        }
+        sorted[j] = value;
+    }
+
+    if (count & 1) {
+        return (u32)sorted[count / 2] << IO_FILTER_SHIFT;
+    } else {
+        return ((u32)sorted[count / 2 - 1] + (u32)sorted[count / 2]) << (IO_FILTER_SHIFT - 1);
+    }
+}
+
+static u16 io_filter_last(const struct io_filter * filter) {
+    return filter->samples[(filter->head + IO_FILTER_SAMPLES - 1) % IO_FILTER_SAMPLES];
+}
+
+// Returns the filtered value multiplied by scale, or -ENODATA if no samples are held
+static int io_filter_value(const struct io_filter * filter, enum io_filter_mode mode, unsigned int window, u32 scale, u32 * value) {
+    u64 fixed;
+
+    if (filter->count == 0) {
+        return -ENODATA;
+    }
+
+    switch (mode) {
+        case IO_FILTER_EMA:
+            fixed = filter->ema;
+            break;
+        case IO_FILTER_MEDIAN:
+            fixed = io_filter_median(filter, window);
+            break;
+        case IO_FILTER_NONE:
+        default:
+            fixed = (u64)io_filter_last(filter) << IO_FILTER_SHIFT;
+            break;
+    }
+
+    *value = (u32)((fixed * scale + (1 << (IO_FILTER_SHIFT - 1))) >> IO_FILTER_SHIFT);
+
+    return 0;
+}
+
+static ssize_t io_filter_mode_show(enum io_filter_mode mode, char * buf) {
+    return sprintf(buf, "%s\n", io_filter_modes[mode]);
+}
+
+static int io_filter_mode_parse(const char * buf, enum io_filter_mode * mode) {
+    int ret;
+
+    ret = sysfs_match_string(io_filter_modes, buf);
+    if (ret < 0) {
+        return ret;
+    }
+
+    *mode = ret;
+
+    return 0;
+}
+
+static int io_filter_window_parse(const char * buf, unsigned int * window) {
+    unsigned int value;
+    int ret;
+
+    ret = kstrtouint(buf, 10, &value);
+    if (ret) {
+        return ret;
+    }
+
+    if (value < 1 || value > IO_FILTER_SAMPLES) {
+        return -EINVAL;
+    }
+
+    *window = value;
+
+    return 0;
+}
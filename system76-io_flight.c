@@ -0,0 +1,78 @@
+/*
+ * system76-io_flight.c
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This program is free software;  you can redistribute it and/or modify
+ * it under the terms of the  GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is  distributed in the hope that it  will be useful, but
+ * WITHOUT  ANY   WARRANTY;  without   even  the  implied   warranty  of
+ * MERCHANTABILITY  or FITNESS FOR  A PARTICULAR  PURPOSE.  See  the GNU
+ * General Public License for more details.
+ *
+ * You should  have received  a copy of  the GNU General  Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Single-flight reads, shared by both drivers. There is one io_flight per
+// (command, channel). A reader arriving while a transaction for the same
+// slot is in progress waits for it and receives its result instead of
+// queueing another round trip. Results are never cached past the flight
+// that produced them.
+
+typedef int (*io_flight_fn)(void * data, int channel, long * value);
+
+struct io_flight {
+    spinlock_t lock;
+    wait_queue_head_t wait;
+    bool busy;
+    unsigned long seq;
+    int result;
+    long value;
+};
+
+static void io_flight_init(struct io_flight * flight) {
+    spin_lock_init(&flight->lock);
+    init_waitqueue_head(&flight->wait);
+    flight->busy = false;
+    flight->seq = 0;
+}
+
+static int io_flight_do(struct io_flight * flight, io_flight_fn fn, void * data, int channel, long * value) {
+    unsigned long seq;
+    int result;
+
+    spin_lock_irq(&flight->lock);
+    while (flight->busy) {
+        // Join the transaction in progress
+        seq = flight->seq;
+        wait_event_lock_irq(flight->wait, flight->seq != seq, flight->lock);
+        result = flight->result;
+        *value = flight->value;
+        // A leader killed while queued never reached the device, so its
+        // -EINTR is not ours to return; try again
+        if (result != -EINTR) {
+            spin_unlock_irq(&flight->lock);
+            return result;
+        }
+    }
+    flight->busy = true;
+    spin_unlock_irq(&flight->lock);
+
+    *value = 0;
+    result = fn(data, channel, value);
+
+    spin_lock_irq(&flight->lock);
+    flight->result = result;
+    flight->value = *value;
+    flight->seq++;
+    flight->busy = false;
+    spin_unlock_irq(&flight->lock);
+
+    wake_up_all(&flight->wait);
+
+    return result;
+}
@@ -35,29 +35,489 @@ static const char * io_fan_name(int index) {
     }
 }
 
-static ssize_t io_fan_input_show(struct device *dev, struct device_attribute *attr, char *buf) {
+static void io_sample_schedule(struct io_dev * io_dev, unsigned long delay) {
+    queue_delayed_work(io_wq, &io_dev->sample_work, delay);
+}
+
+// Moves regulated channels toward their fanN_target from fresh tach counts,
+// returns true while any channel is regulated
+static bool io_pid_run(struct io_dev * io_dev, const u16 * tach, const bool * valid) {
+    bool regulating;
+    bool queue;
+    u64 now;
+    u32 out;
+    int i;
+
+    regulating = false;
+    queue = false;
+    now = ktime_get_ns();
+
+    io_cmdq_lock(&io_dev->cmdq, IO_CMDQ_WRITE);
+
+    for (i = 0; i < IO_FAN_COUNT; i++) {
+        if (!io_dev->pid[i].target) {
+            continue;
+        }
+
+        regulating = true;
+
+        // Leave the channel to the watchdog, or alone after a failed ramp, while it is alarmed
+        if (!valid[i] || io_dev->alarm[i]) {
+            continue;
+        }
+
+        out = io_pid_update(&io_dev->pid[i], &io_dev->pid_gains, (u32)tach[i] * IO_TACH_SCALE, now);
+        io_dev->target[i] = (u16)div_u64((u64)out * IO_DUTY_MAX, IO_PID_OUT_MAX);
+        if (io_dev->target[i] != io_dev->duty[i]) {
+            queue = true;
+        }
+    }
+
+    io_cmdq_unlock(&io_dev->cmdq);
+
+    if (queue) {
+        mod_delayed_work(io_wq, &io_dev->duty_work, 0);
+    }
+
+    return regulating;
+}
+
+static void io_sample_work(struct work_struct *work) {
+    struct io_filter * filter;
     const char *name;
+    bool active;
+    bool regulating;
+    bool valid[IO_FAN_COUNT];
+    u16 tach[IO_FAN_COUNT];
     u16 value;
+    int i;
+
+    struct io_dev * io_dev = container_of(to_delayed_work(work), struct io_dev, sample_work);
+
+    active = false;
+    memset(valid, 0, sizeof(valid));
+
+    io_cmdq_lock(&io_dev->cmdq, IO_CMDQ_READ);
+
+    for (i = 1; i <= IO_FAN_COUNT; i++) {
+        if (!(name = io_fan_name(i))) {
+            continue;
+        }
+
+        if (!io_dev_tach(io_dev, name, &value, IO_TIMEOUT)) {
+            tach[i - 1] = value;
+            valid[i - 1] = true;
+            filter = &io_dev->filters[i - 1];
+            spin_lock(&io_dev->sample_lock);
+            if (filter->count && io_rate_changed(io_filter_last(filter), value)) {
+                active = true;
+            }
+            io_filter_push(filter, value, io_dev->filter_window);
+            spin_unlock(&io_dev->sample_lock);
+        }
+
+        // A ramp in progress is about to move the tach
+        if (io_dev->duty[i - 1] != io_dev->target[i - 1]) {
+            active = true;
+        }
+    }
+
+    io_cmdq_unlock(&io_dev->cmdq);
+
+    // Regulation runs at the shortest period for a steady loop rate
+    regulating = io_pid_run(io_dev, tach, valid);
+    if (regulating || io_rate_thermal(sample_thermal_zone, sample_thermal_temp)) {
+        active = true;
+    }
+
+    if (regulating || READ_ONCE(io_dev->filter_mode) != IO_FILTER_NONE) {
+        io_sample_schedule(io_dev, io_rate_next(&io_dev->rate, active));
+    }
+}
+
+// hwmon PWM values are 0-255, IoDUTY takes hundredths of a percent
+static u16 io_pwm_to_duty(u32 pwm) {
+    return (u16)((min(pwm, 255U) * IO_DUTY_MAX) / 255);
+}
+
+static u32 io_duty_to_pwm(u16 duty) {
+    return (((u32)duty) * 255) / IO_DUTY_MAX;
+}
+
+#define IO_ALARM_WATCHDOG BIT(0)
+#define IO_ALARM_STALL BIT(1)
+// The board kept refusing the steps of a ramp, cleared by the next pwmN or fanN_target write
+#define IO_ALARM_DUTY BIT(2)
+// Alarms that make the watchdog force watchdog_pwm
+#define IO_ALARM_FORCED (IO_ALARM_WATCHDOG | IO_ALARM_STALL)
+// Consecutive zero tach readings at non-zero duty before a fan counts as stalled
+#define IO_STALL_COUNT 2
+
+static void io_watchdog_schedule(struct io_dev * io_dev) {
+    if (io_dev->watchdog_timeout) {
+        mod_delayed_work(io_wq, &io_dev->watchdog_work, HZ);
+    }
+}
+
+// Called with cmdq held after reset, seeds the duty shadow from the device
+static void io_watchdog_init(struct io_dev * io_dev) {
+    const char *name;
+    int i;
+
+    io_dev->watchdog_timeout = watchdog_timeout;
+    io_dev->watchdog_keepalive = jiffies;
+
+    for (i = 1; i <= IO_FAN_COUNT; i++) {
+        if ((name = io_fan_name(i))) {
+            if (io_dev_duty(io_dev, name, &io_dev->duty[i - 1], IO_TIMEOUT)) {
+                io_dev->duty[i - 1] = 0;
+            }
+            io_dev->target[i - 1] = io_dev->duty[i - 1];
+        }
+    }
+}
+
+// Called with cmdq held, sends the commanded state back after the board lost it
+static void io_restore(struct io_dev * io_dev) {
+    const char *name;
+    int i;
+
+    for (i = 1; i <= IO_FAN_COUNT; i++) {
+        if ((name = io_fan_name(i))) {
+            io_dev_set_duty(io_dev, name, io_dev->duty[i - 1], IO_TIMEOUT);
+        }
+    }
+
+    if (io_dev->suspended) {
+        io_dev_set_suspend(io_dev, 1, IO_TIMEOUT);
+    }
+}
+
+// Called with cmdq held on disconnect
+static void io_shadow_store(struct io_dev * io_dev) {
+    struct io_shadow shadow;
+    int i;
+
+    memset(&shadow, 0, sizeof(shadow));
+    strscpy(shadow.key, io_dev->shadow_key, IO_SHADOW_KEY);
+    for (i = 0; i < IO_FAN_COUNT; i++) {
+        // An unfinished ramp resumes at its target
+        shadow.duty[i] = io_dev->target[i];
+        shadow.ramp_rate[i] = io_dev->ramp_rate[i];
+    }
+    shadow.filter_mode = io_dev->filter_mode;
+    shadow.filter_window = io_dev->filter_window;
+    shadow.sample_min_ms = io_dev->rate.min_ms;
+    shadow.sample_max_ms = io_dev->rate.max_ms;
+    shadow.watchdog_timeout = io_dev->watchdog_timeout;
+    shadow.suspended = io_dev->suspended;
+
+    io_shadow_save(&shadow);
+}
+
+// Called with cmdq held after io_watchdog_init, replays the state saved when
+// this board was last disconnected and returns true if there was one
+static bool io_shadow_load(struct io_dev * io_dev) {
+    struct io_shadow shadow;
+    int i;
+
+    BUILD_BUG_ON(IO_FAN_COUNT > IO_SHADOW_CHANNELS);
+
+    if (!io_shadow_take(io_dev->shadow_key, &shadow)) {
+        return false;
+    }
+
+    for (i = 0; i < IO_FAN_COUNT; i++) {
+        io_dev->duty[i] = shadow.duty[i];
+        io_dev->target[i] = shadow.duty[i];
+        io_dev->ramp_rate[i] = shadow.ramp_rate[i];
+    }
+    io_dev->filter_mode = shadow.filter_mode;
+    io_dev->filter_window = shadow.filter_window;
+    io_dev->rate.min_ms = shadow.sample_min_ms;
+    io_dev->rate.max_ms = shadow.sample_max_ms;
+    io_dev->rate.period_ms = shadow.sample_min_ms;
+    io_dev->watchdog_timeout = shadow.watchdog_timeout;
+    io_dev->suspended = shadow.suspended;
+
+    io_restore(io_dev);
+
+    return true;
+}
+
+// Called with cmdq held when userspace commanded a duty
+static void io_watchdog_feed(struct io_dev * io_dev, int index) {
+    io_dev->alarm[index - 1] &= ~(IO_ALARM_WATCHDOG | IO_ALARM_DUTY);
+    io_dev->stall[index - 1] = 0;
+    io_dev->watchdog_keepalive = jiffies;
+}
+
+static void io_watchdog_work(struct work_struct *work) {
+    const char *name;
+    bool expired;
+    u16 safe;
+    u16 value;
+    u8 alarm;
+    int i;
+
+    struct io_dev * io_dev = container_of(to_delayed_work(work), struct io_dev, watchdog_work);
+
+    io_cmdq_lock(&io_dev->cmdq, IO_CMDQ_WRITE);
+
+    if (!io_dev->watchdog_timeout) {
+        io_cmdq_unlock(&io_dev->cmdq);
+        return;
+    }
+
+    expired = time_after(jiffies, io_dev->watchdog_keepalive + io_dev->watchdog_timeout * HZ);
+    safe = io_pwm_to_duty(watchdog_pwm);
+
+    for (i = 1; i <= IO_FAN_COUNT; i++) {
+        if (!(name = io_fan_name(i))) {
+            continue;
+        }
+
+        if (io_dev->duty[i - 1] > 0 && !io_dev_tach(io_dev, name, &value, IO_TIMEOUT)) {
+            if (value == 0) {
+                if (io_dev->stall[i - 1] < IO_STALL_COUNT) {
+                    io_dev->stall[i - 1]++;
+                }
+            } else {
+                io_dev->stall[i - 1] = 0;
+            }
+        }
+
+        alarm = io_dev->alarm[i - 1];
+        if (io_dev->stall[i - 1] >= IO_STALL_COUNT) {
+            alarm |= IO_ALARM_STALL;
+        } else {
+            alarm &= ~IO_ALARM_STALL;
+        }
+        // A regulated channel is driven by the sample work, not by userspace,
+        // so only the stall check applies to it
+        if (expired && !io_dev->pid[i - 1].target) {
+            alarm |= IO_ALARM_WATCHDOG;
+        }
+
+        if ((alarm & IO_ALARM_FORCED) && !(io_dev->alarm[i - 1] & IO_ALARM_FORCED)) {
+            dev_warn(&io_dev->usb_dev->dev, "watchdog: %s %s, forcing duty %d\n", name, (alarm & IO_ALARM_WATCHDOG) ? "timed out" : "stalled", safe);
+        }
+        if ((alarm & IO_ALARM_FORCED) && io_dev->duty[i - 1] != safe) {
+            if (!io_dev_set_duty(io_dev, name, safe, IO_TIMEOUT)) {
+                io_dev->duty[i - 1] = safe;
+            }
+        }
+        if (alarm & IO_ALARM_FORCED) {
+            // Stop any ramp from walking the duty back down
+            io_dev->target[i - 1] = io_dev->duty[i - 1];
+        }
+        io_dev->alarm[i - 1] = alarm;
+    }
+
+    io_cmdq_unlock(&io_dev->cmdq);
+
+    io_watchdog_schedule(io_dev);
+}
+
+#define IO_RAMP_TICK_MS 50
+// Consecutive failed ramp steps before the ramp is abandoned
+#define IO_RAMP_RETRIES 3
+
+// Applies commanded duties, stepping by ramp_rate every tick where one is set
+static void io_duty_work(struct work_struct *work) {
+    const char *name;
+    bool pending;
+    u16 duty;
+    u16 target;
+    u32 step;
+    int ret;
+    int i;
+
+    struct io_dev * io_dev = container_of(to_delayed_work(work), struct io_dev, duty_work);
+
+    pending = false;
+
+    io_cmdq_lock(&io_dev->cmdq, IO_CMDQ_WRITE);
+
+    for (i = 1; i <= IO_FAN_COUNT; i++) {
+        duty = io_dev->duty[i - 1];
+        target = io_dev->target[i - 1];
+        // A fresh request is always sent, even if the shadow already matches
+        if ((duty == target && !io_dev->request_ns[i - 1]) || !(name = io_fan_name(i))) {
+            continue;
+        }
+
+        // ramp_rate is in PWM units per second, duty in hundredths of a percent.
+        // The remainder carries over so slow rates are honoured on average.
+        step = io_dev->ramp_rate[i - 1] * IO_DUTY_MAX * IO_RAMP_TICK_MS + io_dev->ramp_carry[i - 1];
+        io_dev->ramp_carry[i - 1] = step % (255 * 1000);
+        step /= 255 * 1000;
+        if (!io_dev->ramp_rate[i - 1] || (u32)abs((int)target - (int)duty) <= step) {
+            duty = target;
+        } else if (duty < target) {
+            duty += step;
+        } else {
+            duty -= step;
+        }
+        if (duty == target) {
+            io_dev->ramp_carry[i - 1] = 0;
+        }
+
+        if (io_dev->request_ns[i - 1]) {
+            io_latency_add(&io_dev->latency, io_dev->request_ns[i - 1]);
+            io_dev->request_ns[i - 1] = 0;
+        }
+
+        ret = io_dev_set_duty(io_dev, name, duty, IO_TIMEOUT);
+        if (!ret) {
+            io_dev->duty[i - 1] = duty;
+            io_dev->ramp_errors[i - 1] = 0;
+        } else if (!io_dev->ramp_rate[i - 1]) {
+            // Report the failure to the writer instead of retrying
+            io_dev->duty_result[i - 1] = ret;
+            io_dev->target[i - 1] = io_dev->duty[i - 1];
+        } else if (++io_dev->ramp_errors[i - 1] >= IO_RAMP_RETRIES) {
+            // Nobody waits on a ramp, so stop it where it is and raise fanN_alarm
+            dev_warn(&io_dev->usb_dev->dev, "%s: ramp abandoned after %d failures: %d\n", name, IO_RAMP_RETRIES, ret);
+            io_dev->duty_result[i - 1] = ret;
+            io_dev->target[i - 1] = io_dev->duty[i - 1];
+            io_dev->ramp_errors[i - 1] = 0;
+            io_dev->ramp_carry[i - 1] = 0;
+            io_dev->alarm[i - 1] |= IO_ALARM_DUTY;
+        }
+
+        if (io_dev->duty[i - 1] != io_dev->target[i - 1]) {
+            pending = true;
+        }
+    }
+
+    io_cmdq_unlock(&io_dev->cmdq);
+
+    if (pending) {
+        queue_delayed_work(io_wq, &io_dev->duty_work, msecs_to_jiffies(IO_RAMP_TICK_MS));
+    }
+}
+
+static ssize_t io_fan_alarm_show(struct device *dev, struct device_attribute *attr, char *buf) {
+    int index;
     int ret;
 
     struct io_dev * io_dev = dev_get_drvdata(dev);
 
-    mutex_lock(&io_dev->lock);
+    index = to_sensor_dev_attr(attr)->index;
+    if (!io_fan_name(index)) {
+        return -ENOENT;
+    }
+
+    ret = io_cmdq_lock_killable(&io_dev->cmdq);
+    if (ret) {
+        return ret;
+    }
+    ret = sprintf(buf, "%i\n", io_dev->alarm[index - 1] ? 1 : 0);
+    io_cmdq_unlock(&io_dev->cmdq);
+
+    return ret;
+}
+
+static int io_exec_tach(struct io_exec * exec) {
+    return io_dev_tach(exec->data, io_fan_name(exec->arg), exec->out, IO_TIMEOUT);
+}
+
+static int io_exec_duty(struct io_exec * exec) {
+    return io_dev_duty(exec->data, io_fan_name(exec->arg), exec->out, IO_TIMEOUT);
+}
+
+// The reads below run their command on io_exec_wq, not in the reader's context
+static int io_fetch_tach(void * data, int index, long * value) {
+    u16 tach;
+    int ret;
+
+    struct io_dev * io_dev = data;
+
+    ret = io_cmdq_lock_killable(&io_dev->cmdq);
+    if (ret) {
+        return ret;
+    }
+    ret = io_exec_call(io_exec_wq, io_exec_tach, io_dev, index, &tach);
+    io_cmdq_unlock(&io_dev->cmdq);
+
+    if (!ret) {
+        *value = tach;
+    }
+
+    return ret;
+}
+
+static int io_fetch_duty(void * data, int index, long * value) {
+    u16 duty;
+    int ret;
+
+    struct io_dev * io_dev = data;
+
+    ret = io_cmdq_lock_killable(&io_dev->cmdq);
+    if (ret) {
+        return ret;
+    }
+    ret = io_exec_call(io_exec_wq, io_exec_duty, io_dev, index, &duty);
+    io_cmdq_unlock(&io_dev->cmdq);
+
+    if (!ret) {
+        *value = duty;
+    }
+
+    return ret;
+}
+
+static ssize_t io_fan_raw_show(struct device *dev, struct device_attribute *attr, char *buf) {
+    int index;
+    long value;
+    int ret;
+
+    struct io_dev * io_dev = dev_get_drvdata(dev);
 
-    if ((name = io_fan_name(to_sensor_dev_attr(attr)->index))) {
-        ret = io_dev_tach(io_dev, name, &value, IO_TIMEOUT);
+    index = to_sensor_dev_attr(attr)->index;
+    if (io_fan_name(index)) {
+        ret = io_flight_do(&io_dev->tach_flight[index - 1], io_fetch_tach, io_dev, index, &value);
         if (!ret) {
-            ret = sprintf(buf, "%i\n", value * 30);
+            ret = sprintf(buf, "%li\n", value * IO_TACH_SCALE);
         }
     } else {
         ret = -ENOENT;
     }
 
-    mutex_unlock(&io_dev->lock);
-
     return ret;
 }
 
+static ssize_t io_fan_input_show(struct device *dev, struct device_attribute *attr, char *buf) {
+    int index;
+    u32 value;
+    int ret;
+
+    struct io_dev * io_dev = dev_get_drvdata(dev);
+
+    index = to_sensor_dev_attr(attr)->index;
+    if (!io_fan_name(index)) {
+        return -ENOENT;
+    }
+
+    io_rate_touch(&io_dev->rate);
+
+    spin_lock(&io_dev->sample_lock);
+    if (io_dev->filter_mode != IO_FILTER_NONE) {
+        ret = io_filter_value(&io_dev->filters[index - 1], io_dev->filter_mode, io_dev->filter_window, IO_TACH_SCALE, &value);
+    } else {
+        ret = -ENODATA;
+    }
+    spin_unlock(&io_dev->sample_lock);
+
+    if (!ret) {
+        return sprintf(buf, "%u\n", value);
+    }
+
+    // Unfiltered, or the sampler has not produced a reading yet
+    return io_fan_raw_show(dev, attr, buf);
+}
+
 static ssize_t io_fan_label_show(struct device *dev, struct device_attribute *attr, char *buf) {
     int ret;
 
@@ -72,58 +532,186 @@ static ssize_t io_fan_label_show(struct device *dev, struct device_attribute *at
 }
 
 static ssize_t io_pwm_show(struct device *dev, struct device_attribute *attr, char *buf) {
-    const char *name;
-    u16 value;
+    int index;
+    long value;
     int ret;
 
     struct io_dev * io_dev = dev_get_drvdata(dev);
 
-    mutex_lock(&io_dev->lock);
-
-    if ((name = io_fan_name(to_sensor_dev_attr(attr)->index))) {
-        ret = io_dev_duty(io_dev, name, &value, IO_TIMEOUT);
+    index = to_sensor_dev_attr(attr)->index;
+    if (io_fan_name(index)) {
+        ret = io_flight_do(&io_dev->duty_flight[index - 1], io_fetch_duty, io_dev, index, &value);
         if (!ret) {
-            ret = sprintf(buf, "%i\n", (((u32)value) * 255) / 10000);
+            ret = sprintf(buf, "%i\n", io_duty_to_pwm(value));
         }
     } else {
         ret = -ENOENT;
     }
 
-    mutex_unlock(&io_dev->lock);
-
     return ret;
 }
 
 static ssize_t io_pwm_set(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
-	const char *name;
   	u32 value;
+    int index;
+    bool ramp;
   	int ret;
 
     struct io_dev * io_dev = dev_get_drvdata(dev);
 
-    mutex_lock(&io_dev->lock);
+    index = to_sensor_dev_attr(attr)->index;
+    if (!io_fan_name(index)) {
+        return -ENOENT;
+    }
 
-    if ((name = io_fan_name(to_sensor_dev_attr(attr)->index))) {
-      	ret = kstrtou32(buf, 10, &value);
-      	if (!ret) {
-            if (value <= 255) {
-                ret = io_dev_set_duty(io_dev, name, (u16)((value * 10000) / 255), IO_TIMEOUT);
-                if (!ret) {
-                    ret = count;
-                }
-            } else {
-                ret = -EINVAL;
-            }
-        }
+  	ret = kstrtou32(buf, 10, &value);
+  	if (ret) {
+        return ret;
+    }
+
+    if (value > 255) {
+        return -EINVAL;
+    }
+
+    io_cmdq_lock(&io_dev->cmdq, IO_CMDQ_WRITE);
+    // A direct duty takes the channel back from fanN_target
+    io_pid_stop(&io_dev->pid[index - 1]);
+    io_dev->target[index - 1] = io_pwm_to_duty(value);
+    io_dev->request_ns[index - 1] = ktime_get_ns();
+    io_dev->duty_result[index - 1] = 0;
+    io_watchdog_feed(io_dev, index);
+    ramp = io_dev->ramp_rate[index - 1] != 0;
+    io_cmdq_unlock(&io_dev->cmdq);
+
+    // The duty work sends the command from the dedicated workqueue
+    mod_delayed_work(io_wq, &io_dev->duty_work, 0);
+    if (ramp) {
+        return count;
+    }
+
+    flush_delayed_work(&io_dev->duty_work);
+
+    ret = READ_ONCE(io_dev->duty_result[index - 1]);
+
+    return ret ? ret : count;
+}
+
+static ssize_t io_fan_target_show(struct device *dev, struct device_attribute *attr, char *buf) {
+    int index;
+    int ret;
+
+    struct io_dev * io_dev = dev_get_drvdata(dev);
+
+    index = to_sensor_dev_attr(attr)->index;
+    if (!io_fan_name(index)) {
+        return -ENOENT;
+    }
+
+    ret = io_cmdq_lock_killable(&io_dev->cmdq);
+    if (ret) {
+        return ret;
+    }
+    ret = sprintf(buf, "%u\n", io_dev->pid[index - 1].target);
+    io_cmdq_unlock(&io_dev->cmdq);
+
+    return ret;
+}
+
+// Non-zero RPM starts the regulator, 0 stops it and keeps the current duty
+static ssize_t io_fan_target_set(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
+    struct io_pid * pid;
+    u32 value;
+    int index;
+    int ret;
+
+    struct io_dev * io_dev = dev_get_drvdata(dev);
+
+    index = to_sensor_dev_attr(attr)->index;
+    if (!io_fan_name(index)) {
+        return -ENOENT;
+    }
+
+    ret = kstrtou32(buf, 10, &value);
+    if (ret) {
+        return ret;
+    }
+
+    if (value > IO_PID_TARGET_MAX) {
+        return -EINVAL;
+    }
+
+    io_cmdq_lock(&io_dev->cmdq, IO_CMDQ_WRITE);
+    pid = &io_dev->pid[index - 1];
+    if (!value) {
+        io_pid_stop(pid);
+    } else if (!pid->target) {
+        io_pid_start(pid, &io_dev->pid_gains, value, (u32)div_u64((u64)io_dev->target[index - 1] * IO_PID_OUT_MAX, IO_DUTY_MAX));
     } else {
-        ret = -ENOENT;
+        pid->target = value;
+    }
+    if (value) {
+        io_watchdog_feed(io_dev, index);
+    }
+    io_cmdq_unlock(&io_dev->cmdq);
+
+    // Starts the sampler if no filter kept it running
+    if (value) {
+        mod_delayed_work(io_wq, &io_dev->sample_work, 0);
+    }
+
+    return count;
+}
+
+static ssize_t io_pwm_ramp_rate_show(struct device *dev, struct device_attribute *attr, char *buf) {
+    int index;
+    int ret;
+
+    struct io_dev * io_dev = dev_get_drvdata(dev);
+
+    index = to_sensor_dev_attr(attr)->index;
+    if (!io_fan_name(index)) {
+        return -ENOENT;
     }
 
-    mutex_unlock(&io_dev->lock);
+    ret = io_cmdq_lock_killable(&io_dev->cmdq);
+    if (ret) {
+        return ret;
+    }
+    ret = sprintf(buf, "%u\n", io_dev->ramp_rate[index - 1]);
+    io_cmdq_unlock(&io_dev->cmdq);
 
     return ret;
 }
 
+static ssize_t io_pwm_ramp_rate_set(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
+    unsigned int value;
+    int index;
+    int ret;
+
+    struct io_dev * io_dev = dev_get_drvdata(dev);
+
+    index = to_sensor_dev_attr(attr)->index;
+    if (!io_fan_name(index)) {
+        return -ENOENT;
+    }
+
+    ret = kstrtouint(buf, 10, &value);
+    if (ret) {
+        return ret;
+    }
+
+    // Anything above a full sweep per tick is the same as no limit
+    if (value > 255 * 1000 / IO_RAMP_TICK_MS) {
+        return -EINVAL;
+    }
+
+    io_cmdq_lock(&io_dev->cmdq, IO_CMDQ_WRITE);
+    io_dev->ramp_rate[index - 1] = value;
+    io_cmdq_unlock(&io_dev->cmdq);
+
+    return count;
+}
+
 static ssize_t io_pwm_enable_show(struct device *dev, struct device_attribute *attr, char *buf) {
     int ret;
 
@@ -158,22 +746,272 @@ static ssize_t io_pwm_enable_set(struct device *dev, struct device_attribute *at
     return ret;
 }
 
+static ssize_t io_fan_filter_show(struct device *dev, struct device_attribute *attr, char *buf) {
+    struct io_dev * io_dev = dev_get_drvdata(dev);
+
+    return io_filter_mode_show(READ_ONCE(io_dev->filter_mode), buf);
+}
+
+static ssize_t io_fan_filter_set(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
+    enum io_filter_mode mode;
+    bool start;
+    int ret;
+    int i;
+
+    struct io_dev * io_dev = dev_get_drvdata(dev);
+
+    ret = io_filter_mode_parse(buf, &mode);
+    if (ret) {
+        return ret;
+    }
+
+    spin_lock(&io_dev->sample_lock);
+    start = io_dev->filter_mode == IO_FILTER_NONE && mode != IO_FILTER_NONE;
+    if (start) {
+        for (i = 0; i < IO_FAN_COUNT; i++) {
+            io_filter_reset(&io_dev->filters[i]);
+        }
+    }
+    io_dev->filter_mode = mode;
+    spin_unlock(&io_dev->sample_lock);
+
+    if (start) {
+        mod_delayed_work(io_wq, &io_dev->sample_work, 0);
+    }
+
+    return count;
+}
+
+static ssize_t io_fan_filter_window_show(struct device *dev, struct device_attribute *attr, char *buf) {
+    struct io_dev * io_dev = dev_get_drvdata(dev);
+
+    return sprintf(buf, "%u\n", READ_ONCE(io_dev->filter_window));
+}
+
+static ssize_t io_fan_filter_window_set(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
+    unsigned int window;
+    int ret;
+
+    struct io_dev * io_dev = dev_get_drvdata(dev);
+
+    ret = io_filter_window_parse(buf, &window);
+    if (ret) {
+        return ret;
+    }
+
+    spin_lock(&io_dev->sample_lock);
+    io_dev->filter_window = window;
+    spin_unlock(&io_dev->sample_lock);
+
+    return count;
+}
+
+static ssize_t io_watchdog_set(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
+    struct io_dev * io_dev = dev_get_drvdata(dev);
+
+    io_cmdq_lock(&io_dev->cmdq, IO_CMDQ_WRITE);
+    io_dev->watchdog_keepalive = jiffies;
+    io_cmdq_unlock(&io_dev->cmdq);
+
+    return count;
+}
+
+static ssize_t io_watchdog_timeout_show(struct device *dev, struct device_attribute *attr, char *buf) {
+    struct io_dev * io_dev = dev_get_drvdata(dev);
+
+    return sprintf(buf, "%u\n", READ_ONCE(io_dev->watchdog_timeout));
+}
+
+static ssize_t io_watchdog_timeout_set(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
+    unsigned int value;
+    int ret;
+
+    struct io_dev * io_dev = dev_get_drvdata(dev);
+
+    ret = kstrtouint(buf, 10, &value);
+    if (ret) {
+        return ret;
+    }
+
+    if (value > 3600) {
+        return -EINVAL;
+    }
+
+    io_cmdq_lock(&io_dev->cmdq, IO_CMDQ_WRITE);
+    io_dev->watchdog_timeout = value;
+    io_dev->watchdog_keepalive = jiffies;
+    io_watchdog_schedule(io_dev);
+    io_cmdq_unlock(&io_dev->cmdq);
+
+    return count;
+}
+
+static ssize_t io_sample_min_ms_show(struct device *dev, struct device_attribute *attr, char *buf) {
+    struct io_dev * io_dev = dev_get_drvdata(dev);
+
+    return sprintf(buf, "%u\n", READ_ONCE(io_dev->rate.min_ms));
+}
+
+static ssize_t io_sample_min_ms_set(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
+    int ret;
+
+    struct io_dev * io_dev = dev_get_drvdata(dev);
+
+    ret = io_rate_min_parse(&io_dev->rate, buf);
+    if (ret) {
+        return ret;
+    }
+
+    // Do not leave a backed off sampler waiting out its old period
+    if (READ_ONCE(io_dev->filter_mode) != IO_FILTER_NONE) {
+        mod_delayed_work(io_wq, &io_dev->sample_work, 0);
+    }
+
+    return count;
+}
+
+static ssize_t io_sample_max_ms_show(struct device *dev, struct device_attribute *attr, char *buf) {
+    struct io_dev * io_dev = dev_get_drvdata(dev);
+
+    return sprintf(buf, "%u\n", READ_ONCE(io_dev->rate.max_ms));
+}
+
+static ssize_t io_sample_max_ms_set(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
+    int ret;
+
+    struct io_dev * io_dev = dev_get_drvdata(dev);
+
+    ret = io_rate_max_parse(&io_dev->rate, buf);
+    if (ret) {
+        return ret;
+    }
+
+    return count;
+}
+
+// Index selects kp, ki or kd
+static int * io_fan_pid_gain(struct io_dev * io_dev, int index) {
+    switch (index) {
+        case 0:
+            return &io_dev->pid_gains.kp;
+        case 1:
+            return &io_dev->pid_gains.ki;
+        default:
+            return &io_dev->pid_gains.kd;
+    }
+}
+
+static ssize_t io_fan_pid_gain_show(struct device *dev, struct device_attribute *attr, char *buf) {
+    int ret;
+
+    struct io_dev * io_dev = dev_get_drvdata(dev);
+
+    ret = io_cmdq_lock_killable(&io_dev->cmdq);
+    if (ret) {
+        return ret;
+    }
+    ret = sprintf(buf, "%i\n", *io_fan_pid_gain(io_dev, to_sensor_dev_attr(attr)->index));
+    io_cmdq_unlock(&io_dev->cmdq);
+
+    return ret;
+}
+
+static ssize_t io_fan_pid_gain_set(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
+    int gain;
+    int ret;
+
+    struct io_dev * io_dev = dev_get_drvdata(dev);
+
+    ret = io_pid_gain_parse(buf, &gain);
+    if (ret) {
+        return ret;
+    }
+
+    io_cmdq_lock(&io_dev->cmdq, IO_CMDQ_WRITE);
+    *io_fan_pid_gain(io_dev, to_sensor_dev_attr(attr)->index) = gain;
+    io_cmdq_unlock(&io_dev->cmdq);
+
+    return count;
+}
+
+static ssize_t io_fan_pid_windup_show(struct device *dev, struct device_attribute *attr, char *buf) {
+    int ret;
+
+    struct io_dev * io_dev = dev_get_drvdata(dev);
+
+    ret = io_cmdq_lock_killable(&io_dev->cmdq);
+    if (ret) {
+        return ret;
+    }
+    ret = sprintf(buf, "%u\n", io_dev->pid_gains.windup);
+    io_cmdq_unlock(&io_dev->cmdq);
+
+    return ret;
+}
+
+static ssize_t io_fan_pid_windup_set(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
+    unsigned int windup;
+    int ret;
+
+    struct io_dev * io_dev = dev_get_drvdata(dev);
+
+    ret = io_pid_windup_parse(buf, &windup);
+    if (ret) {
+        return ret;
+    }
+
+    io_cmdq_lock(&io_dev->cmdq, IO_CMDQ_WRITE);
+    io_dev->pid_gains.windup = windup;
+    io_cmdq_unlock(&io_dev->cmdq);
+
+    return count;
+}
+
+static DEVICE_ATTR(watchdog, S_IWUSR, NULL, io_watchdog_set);
+static DEVICE_ATTR(watchdog_timeout, S_IRUGO | S_IWUSR, io_watchdog_timeout_show, io_watchdog_timeout_set);
+static DEVICE_ATTR(fan_filter, S_IRUGO | S_IWUSR, io_fan_filter_show, io_fan_filter_set);
+static DEVICE_ATTR(fan_filter_window, S_IRUGO | S_IWUSR, io_fan_filter_window_show, io_fan_filter_window_set);
+static DEVICE_ATTR(sample_min_ms, S_IRUGO | S_IWUSR, io_sample_min_ms_show, io_sample_min_ms_set);
+static DEVICE_ATTR(sample_max_ms, S_IRUGO | S_IWUSR, io_sample_max_ms_show, io_sample_max_ms_set);
+static SENSOR_DEVICE_ATTR(fan_pid_kp, S_IRUGO | S_IWUSR, io_fan_pid_gain_show, io_fan_pid_gain_set, 0);
+static SENSOR_DEVICE_ATTR(fan_pid_ki, S_IRUGO | S_IWUSR, io_fan_pid_gain_show, io_fan_pid_gain_set, 1);
+static SENSOR_DEVICE_ATTR(fan_pid_kd, S_IRUGO | S_IWUSR, io_fan_pid_gain_show, io_fan_pid_gain_set, 2);
+static DEVICE_ATTR(fan_pid_windup, S_IRUGO | S_IWUSR, io_fan_pid_windup_show, io_fan_pid_windup_set);
+
 #undef IO_FAN
 #define IO_FAN(N, I) \
     static SENSOR_DEVICE_ATTR(fan ## I ## _input, S_IRUGO, io_fan_input_show, NULL, I); \
+    static SENSOR_DEVICE_ATTR(fan ## I ## _raw, S_IRUGO, io_fan_raw_show, NULL, I); \
     static SENSOR_DEVICE_ATTR(fan ## I ## _label, S_IRUGO, io_fan_label_show, NULL, I); \
+    static SENSOR_DEVICE_ATTR(fan ## I ## _alarm, S_IRUGO, io_fan_alarm_show, NULL, I); \
+    static SENSOR_DEVICE_ATTR(fan ## I ## _target, S_IRUGO | S_IWUSR, io_fan_target_show, io_fan_target_set, I); \
     static SENSOR_DEVICE_ATTR(pwm ## I, S_IRUGO |  S_IWUSR, io_pwm_show, io_pwm_set, I); \
-    static SENSOR_DEVICE_ATTR(pwm ## I ## _enable, S_IRUGO |  S_IWUSR, io_pwm_enable_show, io_pwm_enable_set, I);
+    static SENSOR_DEVICE_ATTR(pwm ## I ## _enable, S_IRUGO |  S_IWUSR, io_pwm_enable_show, io_pwm_enable_set, I); \
+    static SENSOR_DEVICE_ATTR(pwm ## I ## _ramp_rate, S_IRUGO |  S_IWUSR, io_pwm_ramp_rate_show, io_pwm_ramp_rate_set, I);
 IO_FANS
 
 static struct attribute *io_attrs[] = {
     #undef IO_FAN
     #define IO_FAN(N, I) \
         &sensor_dev_attr_fan ## I ## _input.dev_attr.attr, \
+        &sensor_dev_attr_fan ## I ## _raw.dev_attr.attr, \
         &sensor_dev_attr_fan ## I ## _label.dev_attr.attr, \
+        &sensor_dev_attr_fan ## I ## _alarm.dev_attr.attr, \
+        &sensor_dev_attr_fan ## I ## _target.dev_attr.attr, \
         &sensor_dev_attr_pwm ## I.dev_attr.attr, \
-        &sensor_dev_attr_pwm ## I ## _enable.dev_attr.attr,
+        &sensor_dev_attr_pwm ## I ## _enable.dev_attr.attr, \
+        &sensor_dev_attr_pwm ## I ## _ramp_rate.dev_attr.attr,
 	IO_FANS
+    &dev_attr_fan_filter.attr,
+    &dev_attr_fan_filter_window.attr,
+    &dev_attr_sample_min_ms.attr,
+    &dev_attr_sample_max_ms.attr,
+    &sensor_dev_attr_fan_pid_kp.dev_attr.attr,
+    &sensor_dev_attr_fan_pid_ki.dev_attr.attr,
+    &sensor_dev_attr_fan_pid_kd.dev_attr.attr,
+    &dev_attr_fan_pid_windup.attr,
+    &dev_attr_watchdog.attr,
+    &dev_attr_watchdog_timeout.attr,
 	NULL
 };
 
@@ -0,0 +1,1131 @@
+/*
+ * system76-io_kunit.c
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This program is free software;  you can redistribute it and/or modify
+ * it under the terms of the  GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is  distributed in the hope that it  will be useful, but
+ * WITHOUT  ANY   WARRANTY;  without   even  the  implied   warranty  of
+ * MERCHANTABILITY  or FITNESS FOR  A PARTICULAR  PURPOSE.  See  the GNU
+ * General Public License for more details.
+ *
+ * You should  have received  a copy of  the GNU General  Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// KUnit tests for system76-io, included at the end of system76-io.c when
+// built with make kunit. Each test gets an io_dev whose io_dev_ops are a
+// model of the board, so everything from the hwmon callbacks down to
+// io_dev_transfer runs unchanged without a board or a bound interface.
+
+#include <kunit/test.h>
+#include <linux/delay.h>
+#include <linux/kthread.h>
+
+// A reply later than this still arrives within IO_TIMEOUT
+#define IO_KUNIT_LATENCY_MS 20
+
+// Board model behind io_dev_ops. The OUT transfer takes a command and
+// prepares the reply, IN transfers hand it out a line per packet like the
+// firmware, or chunk bytes at a time if that is shorter.
+struct io_mock {
+    char command[IO_MSG_SIZE + 1];
+    unsigned int commands;
+    // The last command was sent from a workqueue, not the caller's context
+    bool from_work;
+    char reply[4 * IO_MSG_SIZE];
+    size_t reply_len;
+    size_t reply_split;
+    size_t reply_pos;
+    u16 tach[IO_FAN_COUNT];
+    u16 duty[IO_FAN_COUNT];
+    u16 suspend;
+    // Fault injection, latency_ms delays the first packet of every reply
+    unsigned int latency_ms;
+    unsigned int chunk;
+    int write_status;
+    int read_status;
+    bool silent;
+    bool error;
+    bool garbage;
+    // The reply lands as a timed out IN transfer is killed
+    bool kill_completes;
+    // Commands the board ignores before it starts answering, as at power on
+    unsigned int deaf;
+    // IN transfer left pending by a silent or slow board until answered or killed
+    struct urb * pending;
+    struct delayed_work reply_work;
+};
+
+static struct io_mock io_mock;
+
+static int io_mock_fan(const char * name) {
+    int i;
+
+    for (i = 1; i <= IO_FAN_COUNT; i++) {
+        if (io_fan_name(i) && !strncmp(name, io_fan_name(i), 4)) {
+            return i - 1;
+        }
+    }
+
+    return -1;
+}
+
+static void io_mock_answer(struct io_mock * mock) {
+    const char * command = mock->command;
+    const char * end;
+    unsigned int value;
+    int fan;
+    int len;
+
+    fan = io_mock_fan(command + strlen(IO_CMD_TACH));
+
+    if (mock->garbage) {
+        len = snprintf(mock->reply, sizeof(mock->reply), "\r\r\n");
+    } else if (mock->error) {
+        len = snprintf(mock->reply, sizeof(mock->reply), "\r\n" IO_REPLY_ERROR "\r\n\r\n" IO_REPLY_OK "\r\n");
+    } else if (str_has_prefix(command, IO_CMD_TACH) && fan >= 0) {
+        len = snprintf(mock->reply, sizeof(mock->reply), "\r\n%04X\r\n\r\n" IO_REPLY_OK "\r\n", mock->tach[fan]);
+    } else if (str_has_prefix(command, IO_CMD_DUTY) && fan >= 0 && command[10] == '\r') {
+        len = snprintf(mock->reply, sizeof(mock->reply), "\r\n%04X\r\n\r\n" IO_REPLY_OK "\r\n", mock->duty[fan]);
+    } else if (str_has_prefix(command, IO_CMD_DUTY) && fan >= 0 && sscanf(command + 10, "%4x", &value) == 1) {
+        mock->duty[fan] = value;
+        len = snprintf(mock->reply, sizeof(mock->reply), "\r\n" IO_REPLY_OK "\r\n");
+    } else if (str_has_prefix(command, IO_CMD_SUSPEND) && sscanf(command + strlen(IO_CMD_SUSPEND), "%4x", &value) == 1) {
+        mock->suspend = value;
+        len = snprintf(mock->reply, sizeof(mock->reply), "\r\n" IO_REPLY_OK "\r\n");
+    } else if (str_has_prefix(command, IO_CMD_RESET)) {
+        len = snprintf(mock->reply, sizeof(mock->reply), "\r\n" IO_REPLY_OK "\r\n");
+    } else if (str_has_prefix(command, IO_CMD_REVISION)) {
+        len = snprintf(mock->reply, sizeof(mock->reply), "\r\n1.2.3\r\n\r\n" IO_REPLY_OK "\r\n");
+    } else {
+        len = snprintf(mock->reply, sizeof(mock->reply), "\r\n" IO_REPLY_ERROR "\r\n\r\n" IO_REPLY_OK "\r\n");
+    }
+
+    mock->reply_len = len;
+    mock->reply_pos = 0;
+    end = strstr(mock->reply + 2, "\r\n");
+    mock->reply_split = end ? end + 2 - mock->reply : len;
+}
+
+// Hands out the next packet of the reply and completes the IN transfer
+static void io_mock_reply(struct io_mock * mock, struct urb * urb) {
+    size_t end;
+    size_t len;
+
+    len = min_t(size_t, mock->chunk ? mock->chunk : IO_MSG_SIZE, urb->transfer_buffer_length);
+    end = mock->reply_pos < mock->reply_split ? mock->reply_split : mock->reply_len;
+    len = min(len, end - mock->reply_pos);
+    memcpy(urb->transfer_buffer, mock->reply + mock->reply_pos, len);
+    mock->reply_pos += len;
+    urb->status = mock->read_status;
+    urb->actual_length = mock->read_status ? 0 : len;
+    urb->complete(urb);
+}
+
+static void io_mock_reply_work(struct work_struct * work) {
+    struct io_mock * mock = container_of(to_delayed_work(work), struct io_mock, reply_work);
+    struct urb * urb = mock->pending;
+
+    mock->pending = NULL;
+    io_mock_reply(mock, urb);
+}
+
+static void * io_mock_alloc(struct usb_device * dev, size_t size, gfp_t mem_flags, dma_addr_t * dma) {
+    return kzalloc(size, mem_flags);
+}
+
+static void io_mock_free(struct usb_device * dev, size_t size, void * addr, dma_addr_t dma) {
+    kfree(addr);
+}
+
+static int io_mock_submit(struct urb * urb, gfp_t mem_flags) {
+    struct io_mock * mock = &io_mock;
+    size_t len;
+
+    if (usb_pipeout(urb->pipe)) {
+        len = min_t(size_t, urb->transfer_buffer_length, IO_MSG_SIZE);
+        memcpy(mock->command, urb->transfer_buffer, len);
+        mock->command[len] = 0;
+        mock->commands++;
+        mock->from_work = current_work() != NULL;
+        urb->status = mock->write_status;
+        urb->actual_length = mock->write_status ? 0 : len;
+        if (mock->deaf) {
+            mock->deaf--;
+            mock->reply_len = 0;
+            mock->reply_pos = 0;
+        } else if (!mock->write_status) {
+            io_mock_answer(mock);
+        }
+        urb->complete(urb);
+    } else if (mock->silent || mock->reply_pos >= mock->reply_len) {
+        mock->pending = urb;
+    } else if (mock->latency_ms && mock->reply_pos == 0) {
+        mock->pending = urb;
+        schedule_delayed_work(&mock->reply_work, msecs_to_jiffies(mock->latency_ms));
+    } else {
+        io_mock_reply(mock, urb);
+    }
+
+    return 0;
+}
+
+// Like usb_kill_urb, a transfer still pending completes with -ENOENT
+static void io_mock_kill(struct urb * urb) {
+    struct io_mock * mock = &io_mock;
+
+    cancel_delayed_work_sync(&mock->reply_work);
+    if (mock->pending == urb && mock->kill_completes) {
+        mock->pending = NULL;
+        io_mock_reply(mock, urb);
+    } else if (mock->pending == urb) {
+        mock->pending = NULL;
+        urb->status = -ENOENT;
+        urb->actual_length = 0;
+        urb->complete(urb);
+    }
+}
+
+static const struct io_dev_ops io_mock_ops = {
+    .alloc = io_mock_alloc,
+    .free = io_mock_free,
+    .submit = io_mock_submit,
+    .kill = io_mock_kill,
+};
+
+struct io_kunit {
+    struct io_dev * io_dev;
+    struct device * dev;
+    char * buf;
+};
+
+static int io_kunit_init(struct kunit * test) {
+    struct io_kunit * ctx;
+    struct io_dev * io_dev;
+    int i;
+
+    memset(&io_mock, 0, sizeof(io_mock));
+    INIT_DELAYED_WORK(&io_mock.reply_work, io_mock_reply_work);
+
+    ctx = kunit_kzalloc(test, sizeof(*ctx), GFP_KERNEL);
+    KUNIT_ASSERT_NOT_NULL(test, ctx);
+    ctx->io_dev = io_dev = kunit_kzalloc(test, sizeof(*io_dev), GFP_KERNEL);
+    KUNIT_ASSERT_NOT_NULL(test, io_dev);
+    ctx->dev = kunit_kzalloc(test, sizeof(*ctx->dev), GFP_KERNEL);
+    KUNIT_ASSERT_NOT_NULL(test, ctx->dev);
+    ctx->buf = kunit_kzalloc(test, PAGE_SIZE, GFP_KERNEL);
+    KUNIT_ASSERT_NOT_NULL(test, ctx->buf);
+    io_dev->usb_dev = kunit_kzalloc(test, sizeof(*io_dev->usb_dev), GFP_KERNEL);
+    KUNIT_ASSERT_NOT_NULL(test, io_dev->usb_dev);
+    io_dev->usb_dev->dev.init_name = "system76-io-kunit";
+
+    // As io_probe, without the interfaces and hwmon
+    io_cmdq_init(&io_dev->cmdq);
+    spin_lock_init(&io_dev->sample_lock);
+    INIT_DELAYED_WORK(&io_dev->sample_work, io_sample_work);
+    INIT_DELAYED_WORK(&io_dev->watchdog_work, io_watchdog_work);
+    INIT_DELAYED_WORK(&io_dev->duty_work, io_duty_work);
+    io_capture_init(&io_dev->capture);
+    io_latency_init(&io_dev->latency);
+    io_rate_init(&io_dev->rate, sample_interval);
+    io_pid_gains_init(&io_dev->pid_gains);
+    for (i = 0; i < IO_FAN_COUNT; i++) {
+        io_flight_init(&io_dev->tach_flight[i]);
+        io_flight_init(&io_dev->duty_flight[i]);
+    }
+    io_dev->filter_mode = IO_FILTER_NONE;
+    io_dev->filter_window = IO_FILTER_WINDOW;
+    io_dev->ops = &io_mock_ops;
+    KUNIT_ASSERT_EQ(test, io_dev_alloc(io_dev), 0);
+
+    dev_set_drvdata(ctx->dev, io_dev);
+    test->priv = ctx;
+
+    return 0;
+}
+
+static void io_kunit_exit(struct kunit * test) {
+    struct io_kunit * ctx = test->priv;
+
+    cancel_delayed_work_sync(&ctx->io_dev->sample_work);
+    cancel_delayed_work_sync(&ctx->io_dev->watchdog_work);
+    cancel_delayed_work_sync(&ctx->io_dev->duty_work);
+    cancel_delayed_work_sync(&io_mock.reply_work);
+    io_dev_free(ctx->io_dev);
+    io_capture_free(&ctx->io_dev->capture);
+}
+
+static ssize_t io_kunit_show(struct kunit * test, ssize_t (*show)(struct device *, struct device_attribute *, char *), int index) {
+    struct io_kunit * ctx = test->priv;
+    struct sensor_device_attribute attr = { .index = index };
+
+    memset(ctx->buf, 0, PAGE_SIZE);
+    return show(ctx->dev, &attr.dev_attr, ctx->buf);
+}
+
+static ssize_t io_kunit_store(struct kunit * test, ssize_t (*store)(struct device *, struct device_attribute *, const char *, size_t), int index, const char * buf) {
+    struct io_kunit * ctx = test->priv;
+    struct sensor_device_attribute attr = { .index = index };
+
+    return store(ctx->dev, &attr.dev_attr, buf, strlen(buf));
+}
+
+// Every read is one command on the wire
+static void io_kunit_fan_input(struct kunit * test) {
+    struct io_kunit * ctx = test->priv;
+
+    io_mock.tach[0] = 0x50;
+    io_mock.tach[1] = 0x20;
+
+    KUNIT_EXPECT_EQ(test, io_kunit_show(test, io_fan_input_show, 1), 5);
+    KUNIT_EXPECT_STREQ(test, ctx->buf, "2400\n");
+    KUNIT_EXPECT_STREQ(test, io_mock.command, IO_CMD_TACH "CPUF\r");
+
+    KUNIT_EXPECT_EQ(test, io_kunit_show(test, io_fan_input_show, 2), 4);
+    KUNIT_EXPECT_STREQ(test, ctx->buf, "960\n");
+    KUNIT_EXPECT_STREQ(test, io_mock.command, IO_CMD_TACH "INTF\r");
+
+    KUNIT_EXPECT_TRUE(test, io_mock.from_work);
+
+    KUNIT_EXPECT_EQ(test, io_kunit_show(test, io_fan_input_show, 3), -ENOENT);
+    KUNIT_EXPECT_EQ(test, io_mock.commands, 2U);
+    KUNIT_EXPECT_EQ(test, ctx->io_dev->cmdq.grants[IO_CMDQ_READ], 2ULL);
+    KUNIT_EXPECT_EQ(test, ctx->io_dev->cmdq.grants[IO_CMDQ_WRITE], 0ULL);
+}
+
+// Replies split over several IN packets reassemble as on the wire
+static void io_kunit_fan_input_chunked(struct kunit * test) {
+    struct io_kunit * ctx = test->priv;
+    unsigned int chunk;
+
+    io_mock.tach[0] = 0x0A3C;
+    for (chunk = 1; chunk <= 4; chunk++) {
+        io_mock.chunk = chunk;
+        KUNIT_EXPECT_GT(test, io_kunit_show(test, io_fan_input_show, 1), 0);
+        KUNIT_EXPECT_STREQ(test, ctx->buf, "78600\n");
+    }
+    KUNIT_EXPECT_EQ(test, io_mock.commands, 4U);
+}
+
+// A filtered read is served from the sampler's ring without a command
+static void io_kunit_fan_input_filtered(struct kunit * test) {
+    struct io_kunit * ctx = test->priv;
+    struct io_dev * io_dev = ctx->io_dev;
+
+    io_dev->filter_mode = IO_FILTER_MEDIAN;
+    io_dev->filter_window = 3;
+    io_filter_push(&io_dev->filters[0], 40, io_dev->filter_window);
+    io_filter_push(&io_dev->filters[0], 90, io_dev->filter_window);
+    io_filter_push(&io_dev->filters[0], 50, io_dev->filter_window);
+
+    KUNIT_EXPECT_GT(test, io_kunit_show(test, io_fan_input_show, 1), 0);
+    KUNIT_EXPECT_STREQ(test, ctx->buf, "1500\n");
+    KUNIT_EXPECT_EQ(test, io_mock.commands, 0U);
+
+    // Nothing sampled yet for the second fan, it falls back to the board
+    io_mock.tach[1] = 10;
+    KUNIT_EXPECT_GT(test, io_kunit_show(test, io_fan_input_show, 2), 0);
+    KUNIT_EXPECT_STREQ(test, ctx->buf, "300\n");
+    KUNIT_EXPECT_EQ(test, io_mock.commands, 1U);
+}
+
+// A sampler tick is one command per fan, and filtered reads add none
+static void io_kunit_fan_input_sampled(struct kunit * test) {
+    struct io_kunit * ctx = test->priv;
+    struct io_dev * io_dev = ctx->io_dev;
+    int i;
+
+    io_dev->filter_mode = IO_FILTER_MEDIAN;
+    io_mock.tach[0] = 0x50;
+    io_mock.tach[1] = 0x20;
+
+    io_sample_work(&io_dev->sample_work.work);
+    cancel_delayed_work_sync(&io_dev->sample_work);
+    KUNIT_EXPECT_EQ(test, io_mock.commands, (unsigned int)IO_FAN_COUNT);
+
+    for (i = 0; i < 3; i++) {
+        KUNIT_EXPECT_GT(test, io_kunit_show(test, io_fan_input_show, 1), 0);
+        KUNIT_EXPECT_STREQ(test, ctx->buf, "2400\n");
+        KUNIT_EXPECT_GT(test, io_kunit_show(test, io_fan_input_show, 2), 0);
+        KUNIT_EXPECT_STREQ(test, ctx->buf, "960\n");
+    }
+    KUNIT_EXPECT_EQ(test, io_mock.commands, (unsigned int)IO_FAN_COUNT);
+}
+
+static void io_kunit_fan_input_faults(struct kunit * test) {
+    struct io_kunit * ctx = test->priv;
+
+    io_mock.error = true;
+    KUNIT_EXPECT_EQ(test, io_kunit_show(test, io_fan_input_show, 1), -EIO);
+    io_mock.error = false;
+
+    io_mock.garbage = true;
+    KUNIT_EXPECT_EQ(test, io_kunit_show(test, io_fan_input_show, 1), -EINVAL);
+    io_mock.garbage = false;
+
+    io_mock.write_status = -EPIPE;
+    KUNIT_EXPECT_EQ(test, io_kunit_show(test, io_fan_input_show, 1), -EPIPE);
+    io_mock.write_status = 0;
+
+    io_mock.read_status = -EPROTO;
+    KUNIT_EXPECT_EQ(test, io_kunit_show(test, io_fan_input_show, 1), -EPROTO);
+    io_mock.read_status = 0;
+
+    // No retries, and the next command starts clean
+    io_mock.tach[0] = 0x50;
+    KUNIT_EXPECT_GT(test, io_kunit_show(test, io_fan_input_show, 1), 0);
+    KUNIT_EXPECT_STREQ(test, ctx->buf, "2400\n");
+    KUNIT_EXPECT_EQ(test, io_mock.commands, 5U);
+    KUNIT_EXPECT_EQ(test, ctx->io_dev->capture.commands, 5ULL);
+    KUNIT_EXPECT_EQ(test, ctx->io_dev->capture.errors, 4ULL);
+}
+
+// Takes IO_TIMEOUT
+static void io_kunit_fan_input_timeout(struct kunit * test) {
+    io_mock.silent = true;
+    KUNIT_EXPECT_EQ(test, io_kunit_show(test, io_fan_input_show, 1), -ETIMEDOUT);
+    KUNIT_EXPECT_NULL(test, io_mock.pending);
+    KUNIT_EXPECT_EQ(test, io_mock.commands, 1U);
+}
+
+// A slow board costs one command per read, a board slower than IO_TIMEOUT
+// times out and its late reply is not taken for the next one. Takes IO_TIMEOUT.
+static void io_kunit_fan_input_latency(struct kunit * test) {
+    struct io_kunit * ctx = test->priv;
+    int i;
+
+    io_mock.tach[0] = 0x50;
+    io_mock.latency_ms = IO_KUNIT_LATENCY_MS;
+    for (i = 0; i < 5; i++) {
+        KUNIT_EXPECT_EQ(test, io_kunit_show(test, io_fan_input_show, 1), 5);
+        KUNIT_EXPECT_STREQ(test, ctx->buf, "2400\n");
+    }
+    KUNIT_EXPECT_EQ(test, io_mock.commands, 5U);
+
+    io_mock.latency_ms = IO_TIMEOUT + IO_TIMEOUT / 2;
+    KUNIT_EXPECT_EQ(test, io_kunit_show(test, io_fan_input_show, 1), -ETIMEDOUT);
+    KUNIT_EXPECT_NULL(test, io_mock.pending);
+
+    io_mock.latency_ms = 0;
+    io_mock.tach[1] = 0x20;
+    KUNIT_EXPECT_EQ(test, io_kunit_show(test, io_fan_input_show, 2), 4);
+    KUNIT_EXPECT_STREQ(test, ctx->buf, "960\n");
+    KUNIT_EXPECT_EQ(test, io_mock.commands, 7U);
+}
+
+// A reply that lands just as its read times out is kept, takes IO_TIMEOUT
+static void io_kunit_fan_input_kill_race(struct kunit * test) {
+    struct io_kunit * ctx = test->priv;
+
+    io_mock.tach[0] = 0x50;
+    io_mock.latency_ms = IO_TIMEOUT * 2;
+    io_mock.kill_completes = true;
+
+    KUNIT_EXPECT_EQ(test, io_kunit_show(test, io_fan_input_show, 1), 5);
+    KUNIT_EXPECT_STREQ(test, ctx->buf, "2400\n");
+    KUNIT_EXPECT_EQ(test, io_mock.commands, 1U);
+    KUNIT_EXPECT_EQ(test, ctx->io_dev->capture.errors, 0ULL);
+}
+
+static void io_kunit_pwm_set(struct kunit * test) {
+    struct io_kunit * ctx = test->priv;
+    static const struct {
+        const char * pwm;
+        u16 duty;
+        const char * command;
+    } cases[] = {
+        { "0", 0, IO_CMD_DUTY "CPUF0000\r" },
+        { "1", 39, IO_CMD_DUTY "CPUF0027\r" },
+        { "128", 5019, IO_CMD_DUTY "CPUF139B\r" },
+        { "255", 10000, IO_CMD_DUTY "CPUF2710\r" },
+    };
+    size_t i;
+
+    for (i = 0; i < ARRAY_SIZE(cases); i++) {
+        KUNIT_EXPECT_EQ(test, io_kunit_store(test, io_pwm_set, 1, cases[i].pwm), (ssize_t)strlen(cases[i].pwm));
+        KUNIT_EXPECT_EQ(test, io_mock.duty[0], cases[i].duty);
+        KUNIT_EXPECT_STREQ(test, io_mock.command, cases[i].command);
+        KUNIT_EXPECT_EQ(test, ctx->io_dev->duty[0], cases[i].duty);
+    }
+    KUNIT_EXPECT_EQ(test, io_mock.commands, (unsigned int)ARRAY_SIZE(cases));
+    KUNIT_EXPECT_EQ(test, ctx->io_dev->cmdq.grants[IO_CMDQ_WRITE], (u64)ARRAY_SIZE(cases));
+    KUNIT_EXPECT_EQ(test, ctx->io_dev->latency.count, (u64)ARRAY_SIZE(cases));
+
+    // Rejected values never reach the board
+    KUNIT_EXPECT_EQ(test, io_kunit_store(test, io_pwm_set, 1, "256"), -EINVAL);
+    KUNIT_EXPECT_EQ(test, io_kunit_store(test, io_pwm_set, 1, "-1"), -EINVAL);
+    KUNIT_EXPECT_EQ(test, io_kunit_store(test, io_pwm_set, 3, "0"), -ENOENT);
+    KUNIT_EXPECT_EQ(test, io_mock.commands, (unsigned int)ARRAY_SIZE(cases));
+
+    // The value read back is the PWM the duty maps to
+    KUNIT_EXPECT_GT(test, io_kunit_show(test, io_pwm_show, 1), 0);
+    KUNIT_EXPECT_STREQ(test, ctx->buf, "255\n");
+}
+
+// A slow ramp moves by ramp_rate on average, one command per tick
+static void io_kunit_pwm_ramp(struct kunit * test) {
+    struct io_kunit * ctx = test->priv;
+    struct io_dev * io_dev = ctx->io_dev;
+    int i;
+
+    io_dev->ramp_rate[0] = 10;
+    KUNIT_EXPECT_EQ(test, io_kunit_store(test, io_pwm_set, 1, "255"), 3);
+    cancel_delayed_work_sync(&io_dev->duty_work);
+    KUNIT_EXPECT_EQ(test, io_dev->target[0], IO_DUTY_MAX);
+
+    // 10 PWM/s is 19.6 duty units per tick
+    for (i = 0; i < 3; i++) {
+        io_duty_work(&io_dev->duty_work.work);
+        cancel_delayed_work_sync(&io_dev->duty_work);
+    }
+    KUNIT_EXPECT_EQ(test, io_dev->duty[0], 58);
+    KUNIT_EXPECT_EQ(test, io_mock.duty[0], 58);
+    KUNIT_EXPECT_NE(test, io_dev->ramp_carry[0], 0U);
+    KUNIT_EXPECT_EQ(test, io_mock.commands, 3U);
+
+    // Reaching the target drops the remainder
+    io_dev->target[0] = 60;
+    io_duty_work(&io_dev->duty_work.work);
+    KUNIT_EXPECT_EQ(test, io_mock.duty[0], 60);
+    KUNIT_EXPECT_EQ(test, io_dev->ramp_carry[0], 0U);
+    KUNIT_EXPECT_EQ(test, io_mock.commands, 4U);
+}
+
+// A ramp the board keeps refusing stops where it is and raises fanN_alarm
+static void io_kunit_pwm_ramp_faults(struct kunit * test) {
+    struct io_kunit * ctx = test->priv;
+    struct io_dev * io_dev = ctx->io_dev;
+    int i;
+
+    io_dev->ramp_rate[0] = 10;
+    KUNIT_EXPECT_EQ(test, io_kunit_store(test, io_pwm_set, 1, "255"), 3);
+    cancel_delayed_work_sync(&io_dev->duty_work);
+
+    io_mock.write_status = -EPIPE;
+    for (i = 0; i < IO_RAMP_RETRIES; i++) {
+        KUNIT_EXPECT_EQ(test, io_dev->target[0], IO_DUTY_MAX);
+        io_duty_work(&io_dev->duty_work.work);
+        cancel_delayed_work_sync(&io_dev->duty_work);
+    }
+    KUNIT_EXPECT_EQ(test, io_mock.commands, (unsigned int)IO_RAMP_RETRIES);
+    KUNIT_EXPECT_EQ(test, io_dev->target[0], io_dev->duty[0]);
+    KUNIT_EXPECT_EQ(test, io_dev->duty_result[0], -EPIPE);
+
+    // Nothing is left to retry
+    io_duty_work(&io_dev->duty_work.work);
+    KUNIT_EXPECT_FALSE(test, delayed_work_pending(&io_dev->duty_work));
+    KUNIT_EXPECT_EQ(test, io_mock.commands, (unsigned int)IO_RAMP_RETRIES);
+
+    KUNIT_EXPECT_EQ(test, io_kunit_show(test, io_fan_alarm_show, 1), 2);
+    KUNIT_EXPECT_STREQ(test, ctx->buf, "1\n");
+    KUNIT_EXPECT_EQ(test, io_kunit_show(test, io_fan_alarm_show, 2), 2);
+    KUNIT_EXPECT_STREQ(test, ctx->buf, "0\n");
+
+    // The next write clears it
+    io_mock.write_status = 0;
+    io_dev->ramp_rate[0] = 0;
+    KUNIT_EXPECT_EQ(test, io_kunit_store(test, io_pwm_set, 1, "128"), 3);
+    KUNIT_EXPECT_EQ(test, io_kunit_show(test, io_fan_alarm_show, 1), 2);
+    KUNIT_EXPECT_STREQ(test, ctx->buf, "0\n");
+}
+
+// A failed write is reported to the writer and the shadow keeps the old duty
+static void io_kunit_pwm_set_faults(struct kunit * test) {
+    struct io_kunit * ctx = test->priv;
+
+    KUNIT_EXPECT_EQ(test, io_kunit_store(test, io_pwm_set, 2, "51"), 2);
+    KUNIT_EXPECT_EQ(test, ctx->io_dev->duty[1], 2000);
+
+    io_mock.write_status = -EPIPE;
+    KUNIT_EXPECT_EQ(test, io_kunit_store(test, io_pwm_set, 2, "102"), -EPIPE);
+    KUNIT_EXPECT_EQ(test, ctx->io_dev->duty[1], 2000);
+    KUNIT_EXPECT_EQ(test, ctx->io_dev->target[1], 2000);
+    io_mock.write_status = 0;
+
+    io_mock.error = true;
+    KUNIT_EXPECT_EQ(test, io_kunit_store(test, io_pwm_set, 2, "102"), -EIO);
+    KUNIT_EXPECT_EQ(test, io_mock.duty[1], 2000);
+    KUNIT_EXPECT_EQ(test, ctx->io_dev->duty[1], 2000);
+    io_mock.error = false;
+
+    KUNIT_EXPECT_EQ(test, io_kunit_store(test, io_pwm_set, 2, "102"), 3);
+    KUNIT_EXPECT_EQ(test, io_mock.duty[1], 4000);
+    KUNIT_EXPECT_EQ(test, ctx->io_dev->duty[1], 4000);
+}
+
+// Each command is one record, and nothing is kept while capture is off
+static void io_kunit_capture(struct kunit * test) {
+    struct io_kunit * ctx = test->priv;
+    struct io_capture * capture = &ctx->io_dev->capture;
+    struct io_capture_record * record;
+
+    io_mock.tach[0] = 0x50;
+    KUNIT_EXPECT_GT(test, io_kunit_show(test, io_fan_input_show, 1), 0);
+    KUNIT_EXPECT_NULL(test, capture->records);
+
+    KUNIT_ASSERT_EQ(test, io_capture_enable_set(capture, 1), 0);
+    KUNIT_EXPECT_GT(test, io_kunit_show(test, io_fan_input_show, 1), 0);
+    io_mock.error = true;
+    KUNIT_EXPECT_EQ(test, io_kunit_show(test, io_fan_input_show, 1), -EIO);
+    io_mock.error = false;
+    KUNIT_ASSERT_EQ(test, capture->count, 2U);
+
+    record = &capture->records[0];
+    KUNIT_EXPECT_EQ(test, record->result, 0);
+    KUNIT_EXPECT_EQ(test, record->tx_len, strlen(IO_CMD_TACH "CPUF\r"));
+    KUNIT_EXPECT_MEMEQ(test, record->tx, IO_CMD_TACH "CPUF\r", record->tx_len);
+    KUNIT_EXPECT_EQ(test, record->rx_len, 4);
+    KUNIT_EXPECT_MEMEQ(test, record->rx, "0050", 4);
+
+    record = &capture->records[1];
+    KUNIT_EXPECT_EQ(test, record->result, -EIO);
+    KUNIT_EXPECT_EQ(test, record->rx_len, strlen(IO_REPLY_ERROR));
+    KUNIT_EXPECT_MEMEQ(test, record->rx, IO_REPLY_ERROR, record->rx_len);
+
+    KUNIT_ASSERT_EQ(test, io_capture_enable_set(capture, 0), 0);
+    KUNIT_EXPECT_GT(test, io_kunit_show(test, io_fan_input_show, 1), 0);
+    KUNIT_EXPECT_EQ(test, capture->count, 2U);
+    KUNIT_EXPECT_EQ(test, io_mock.commands, 4U);
+}
+
+// A board that comes back on the same port gets its state replayed, once
+static void io_kunit_shadow(struct kunit * test) {
+    struct io_kunit * ctx = test->priv;
+    struct io_dev * io_dev = ctx->io_dev;
+    int i;
+
+    io_shadow_key(io_dev->shadow_key, "kunit-1.2", "kunit");
+    io_dev->duty[0] = 4000;
+    // An unfinished ramp comes back at its target
+    io_dev->target[0] = 6000;
+    io_dev->ramp_rate[0] = 10;
+    io_dev->duty[1] = 2000;
+    io_dev->target[1] = 2000;
+    io_dev->filter_mode = IO_FILTER_EMA;
+    io_dev->filter_window = 4;
+    io_dev->watchdog_timeout = 30;
+    io_dev->suspended = true;
+
+    io_cmdq_lock(&io_dev->cmdq, IO_CMDQ_WRITE);
+    io_shadow_store(io_dev);
+    io_cmdq_unlock(&io_dev->cmdq);
+
+    for (i = 0; i < IO_FAN_COUNT; i++) {
+        io_dev->duty[i] = 0;
+        io_dev->target[i] = 0;
+        io_dev->ramp_rate[i] = 0;
+    }
+    io_dev->filter_mode = IO_FILTER_NONE;
+    io_dev->filter_window = IO_FILTER_WINDOW;
+    io_dev->watchdog_timeout = 0;
+    io_dev->suspended = false;
+
+    io_cmdq_lock(&io_dev->cmdq, IO_CMDQ_WRITE);
+    KUNIT_EXPECT_TRUE(test, io_shadow_load(io_dev));
+    io_cmdq_unlock(&io_dev->cmdq);
+    KUNIT_EXPECT_EQ(test, io_dev->duty[0], 6000);
+    KUNIT_EXPECT_EQ(test, io_dev->target[0], 6000);
+    KUNIT_EXPECT_EQ(test, io_dev->ramp_rate[0], 10U);
+    KUNIT_EXPECT_EQ(test, io_dev->duty[1], 2000);
+    KUNIT_EXPECT_EQ(test, io_dev->filter_mode, IO_FILTER_EMA);
+    KUNIT_EXPECT_EQ(test, io_dev->filter_window, 4U);
+    KUNIT_EXPECT_EQ(test, io_dev->watchdog_timeout, 30U);
+    KUNIT_EXPECT_TRUE(test, io_dev->suspended);
+
+    // One duty per fan and the suspend flag
+    KUNIT_EXPECT_EQ(test, io_mock.duty[0], 6000);
+    KUNIT_EXPECT_EQ(test, io_mock.duty[1], 2000);
+    KUNIT_EXPECT_EQ(test, io_mock.suspend, 1);
+    KUNIT_EXPECT_EQ(test, io_mock.commands, IO_FAN_COUNT + 1U);
+
+    io_cmdq_lock(&io_dev->cmdq, IO_CMDQ_WRITE);
+    KUNIT_EXPECT_FALSE(test, io_shadow_load(io_dev));
+    io_cmdq_unlock(&io_dev->cmdq);
+    KUNIT_EXPECT_EQ(test, io_mock.commands, IO_FAN_COUNT + 1U);
+}
+
+// fanN_target hands a channel to the regulator, each sampler tick then
+// costs one tach per fan and one duty for the channel it moves
+static void io_kunit_fan_target(struct kunit * test) {
+    struct io_kunit * ctx = test->priv;
+    struct io_dev * io_dev = ctx->io_dev;
+
+    io_mock.tach[0] = 0x10;
+    io_mock.tach[1] = 0x20;
+
+    KUNIT_EXPECT_EQ(test, io_kunit_store(test, io_fan_target_set, 1, "1200"), 4);
+    cancel_delayed_work_sync(&io_dev->sample_work);
+    KUNIT_EXPECT_EQ(test, io_dev->pid[0].target, 1200U);
+    KUNIT_EXPECT_EQ(test, io_kunit_show(test, io_fan_target_show, 1), 5);
+    KUNIT_EXPECT_STREQ(test, ctx->buf, "1200\n");
+    KUNIT_EXPECT_EQ(test, io_mock.commands, 0U);
+
+    // 480 RPM is below target, the duty goes up
+    io_sample_work(&io_dev->sample_work.work);
+    cancel_delayed_work_sync(&io_dev->sample_work);
+    flush_delayed_work(&io_dev->duty_work);
+    KUNIT_EXPECT_GT(test, io_dev->target[0], 0);
+    KUNIT_EXPECT_EQ(test, io_mock.duty[0], io_dev->target[0]);
+    KUNIT_EXPECT_EQ(test, io_mock.duty[1], 0);
+    KUNIT_EXPECT_EQ(test, io_mock.commands, IO_FAN_COUNT + 1U);
+
+    KUNIT_EXPECT_EQ(test, io_kunit_store(test, io_fan_target_set, 1, "20001"), -EINVAL);
+    KUNIT_EXPECT_EQ(test, io_dev->pid[0].target, 1200U);
+
+    // A direct duty takes the channel back
+    KUNIT_EXPECT_EQ(test, io_kunit_store(test, io_pwm_set, 1, "128"), 3);
+    KUNIT_EXPECT_EQ(test, io_dev->pid[0].target, 0U);
+    KUNIT_EXPECT_EQ(test, io_mock.commands, IO_FAN_COUNT + 2U);
+}
+
+// Probe drains what the board left queued and retries IoRSET until it
+// answers, takes two IO_TIMEOUT
+static void io_kunit_ready(struct kunit * test) {
+    struct io_kunit * ctx = test->priv;
+    struct io_dev * io_dev = ctx->io_dev;
+
+    // A tach reply nobody read before a rebind
+    strscpy(io_mock.command, IO_CMD_TACH "CPUF\r", sizeof(io_mock.command));
+    io_mock.tach[0] = 0x50;
+    io_mock_answer(&io_mock);
+    io_mock.deaf = 2;
+
+    KUNIT_EXPECT_EQ(test, io_dev_ready(io_dev), 0);
+    KUNIT_EXPECT_STREQ(test, io_mock.command, IO_CMD_RESET "\r");
+    KUNIT_EXPECT_EQ(test, io_mock.commands, 3U);
+    KUNIT_EXPECT_EQ(test, io_dev->capture.errors, 2ULL);
+
+    // Nothing stale is left for the first real command
+    io_mock.tach[0] = 0x20;
+    KUNIT_EXPECT_EQ(test, io_kunit_show(test, io_fan_input_show, 1), 4);
+    KUNIT_EXPECT_STREQ(test, ctx->buf, "960\n");
+    KUNIT_EXPECT_EQ(test, io_mock.commands, 4U);
+}
+
+#ifdef CONFIG_PM_SLEEP
+// The last case takes IO_TIMEOUT
+static void io_kunit_pm(struct kunit * test) {
+    struct io_kunit * ctx = test->priv;
+    struct io_dev * io_dev = ctx->io_dev;
+
+    KUNIT_EXPECT_EQ(test, io_pm(&io_dev->pm_notifier, PM_SUSPEND_PREPARE, NULL), NOTIFY_DONE);
+    KUNIT_EXPECT_TRUE(test, io_dev->suspended);
+    KUNIT_EXPECT_STREQ(test, io_mock.command, IO_CMD_SUSPEND "0001\r");
+    KUNIT_EXPECT_EQ(test, io_mock.suspend, 1);
+    KUNIT_EXPECT_TRUE(test, io_mock.from_work);
+
+    io_dev->watchdog_keepalive = jiffies - HZ;
+    KUNIT_EXPECT_EQ(test, io_pm(&io_dev->pm_notifier, PM_POST_SUSPEND, NULL), NOTIFY_DONE);
+    KUNIT_EXPECT_FALSE(test, io_dev->suspended);
+    KUNIT_EXPECT_STREQ(test, io_mock.command, IO_CMD_SUSPEND "0000\r");
+    KUNIT_EXPECT_EQ(test, io_mock.suspend, 0);
+    KUNIT_EXPECT_TRUE(test, time_after(io_dev->watchdog_keepalive, jiffies - HZ));
+
+    KUNIT_EXPECT_EQ(test, io_pm(&io_dev->pm_notifier, PM_HIBERNATION_PREPARE, NULL), NOTIFY_DONE);
+    KUNIT_EXPECT_TRUE(test, io_dev->suspended);
+    KUNIT_EXPECT_EQ(test, io_mock.suspend, 1);
+    KUNIT_EXPECT_EQ(test, io_pm(&io_dev->pm_notifier, PM_POST_HIBERNATION, NULL), NOTIFY_DONE);
+    KUNIT_EXPECT_FALSE(test, io_dev->suspended);
+    KUNIT_EXPECT_EQ(test, io_mock.suspend, 0);
+    KUNIT_EXPECT_EQ(test, io_mock.commands, 4U);
+
+    // Restore notifications send nothing
+    io_pm(&io_dev->pm_notifier, PM_RESTORE_PREPARE, NULL);
+    io_pm(&io_dev->pm_notifier, PM_POST_RESTORE, NULL);
+    KUNIT_EXPECT_EQ(test, io_mock.commands, 4U);
+
+    // A board that fails to suspend does not stop the system from suspending
+    io_mock.silent = true;
+    KUNIT_EXPECT_EQ(test, io_pm(&io_dev->pm_notifier, PM_SUSPEND_PREPARE, NULL), NOTIFY_DONE);
+    KUNIT_EXPECT_TRUE(test, io_dev->suspended);
+}
+#endif
+
+static struct kunit_case io_kunit_cases[] = {
+    KUNIT_CASE(io_kunit_fan_input),
+    KUNIT_CASE(io_kunit_fan_input_chunked),
+    KUNIT_CASE(io_kunit_fan_input_filtered),
+    KUNIT_CASE(io_kunit_fan_input_sampled),
+    KUNIT_CASE(io_kunit_fan_input_faults),
+    KUNIT_CASE_SLOW(io_kunit_fan_input_timeout),
+    KUNIT_CASE_SLOW(io_kunit_fan_input_latency),
+    KUNIT_CASE_SLOW(io_kunit_fan_input_kill_race),
+    KUNIT_CASE(io_kunit_pwm_set),
+    KUNIT_CASE(io_kunit_pwm_ramp),
+    KUNIT_CASE(io_kunit_pwm_ramp_faults),
+    KUNIT_CASE(io_kunit_pwm_set_faults),
+    KUNIT_CASE(io_kunit_capture),
+    KUNIT_CASE(io_kunit_shadow),
+    KUNIT_CASE(io_kunit_fan_target),
+    KUNIT_CASE_SLOW(io_kunit_ready),
+#ifdef CONFIG_PM_SLEEP
+    KUNIT_CASE_SLOW(io_kunit_pm),
+#endif
+    {}
+};
+
+static struct kunit_suite io_kunit_suite = {
+    .name = "system76-io",
+    .init = io_kunit_init,
+    .exit = io_kunit_exit,
+    .test_cases = io_kunit_cases,
+};
+
+// Device independent fragments, the same code system76-thelio-io builds
+
+static void io_kunit_scaling(struct kunit * test) {
+    u32 pwm;
+    u32 back;
+
+    KUNIT_EXPECT_EQ(test, io_pwm_to_duty(0), 0);
+    KUNIT_EXPECT_EQ(test, io_pwm_to_duty(128), 5019);
+    KUNIT_EXPECT_EQ(test, io_pwm_to_duty(255), IO_DUTY_MAX);
+    KUNIT_EXPECT_EQ(test, io_pwm_to_duty(1000), IO_DUTY_MAX);
+    KUNIT_EXPECT_EQ(test, io_duty_to_pwm(IO_DUTY_MAX), 255U);
+    KUNIT_EXPECT_EQ(test, io_duty_to_pwm(0), 0U);
+
+    // value * 10000 / 255 truncates, so a PWM reads back at most one lower
+    for (pwm = 0; pwm <= 255; pwm++) {
+        back = io_duty_to_pwm(io_pwm_to_duty(pwm));
+        KUNIT_EXPECT_LE(test, back, pwm);
+        KUNIT_EXPECT_GE(test, back + 1, pwm);
+    }
+}
+
+static int io_kunit_feed(struct io_parser * parser, const char * data, size_t chunk, const char ** error) {
+    size_t len = strlen(data);
+    size_t i;
+    int result = 0;
+
+    io_parser_init(parser);
+    for (i = 0; i < len && result == 0; i += chunk) {
+        result = io_parser_feed(parser, data + i, min(chunk, len - i), error);
+    }
+
+    return result;
+}
+
+static void io_kunit_parser(struct kunit * test) {
+    struct io_parser parser;
+    const char * error;
+    size_t chunk;
+
+    for (chunk = 1; chunk <= IO_MSG_SIZE; chunk++) {
+        error = NULL;
+        KUNIT_EXPECT_EQ(test, io_kunit_feed(&parser, "\r\n0A3C\r\n\r\nOK\r\n", chunk, &error), 1);
+        KUNIT_EXPECT_STREQ(test, io_parser_reply(&parser), "0A3C");
+        KUNIT_EXPECT_FALSE(test, parser.error);
+        KUNIT_EXPECT_NULL(test, error);
+    }
+
+    KUNIT_EXPECT_EQ(test, io_kunit_feed(&parser, "\r\nOK\r\n", IO_MSG_SIZE, &error), 1);
+    KUNIT_EXPECT_STREQ(test, io_parser_reply(&parser), "");
+
+    // ERROR counts when it ends a packet, as the board sends it
+    KUNIT_EXPECT_EQ(test, io_kunit_feed(&parser, "\r\nERROR\r\n\r\nOK\r\n", 9, &error), 1);
+    KUNIT_EXPECT_TRUE(test, parser.error);
+    KUNIT_EXPECT_STREQ(test, io_parser_reply(&parser), "ERROR");
+
+    // Incomplete replies ask for more
+    KUNIT_EXPECT_EQ(test, io_kunit_feed(&parser, "\r\n0A3C\r\n\r\nO", IO_MSG_SIZE, &error), 0);
+
+    KUNIT_EXPECT_EQ(test, io_kunit_feed(&parser, "\n", 1, &error), -EINVAL);
+    KUNIT_EXPECT_STREQ(test, error, "Unexpected LF");
+    KUNIT_EXPECT_EQ(test, io_kunit_feed(&parser, "\r\r", 1, &error), -EINVAL);
+    KUNIT_EXPECT_STREQ(test, error, "Unexpected CR");
+    KUNIT_EXPECT_EQ(test, io_kunit_feed(&parser, "OK", 1, &error), -EINVAL);
+    KUNIT_EXPECT_STREQ(test, error, "Unexpected char");
+    KUNIT_EXPECT_EQ(test, io_kunit_feed(&parser, "\r\n0123456789012345678901234567890123\r\n", 8, &error), -EINVAL);
+    KUNIT_EXPECT_STREQ(test, error, "Too many chars");
+    KUNIT_EXPECT_EQ(test, io_kunit_feed(&parser, "\r\nA\r\n\r\nB\r\n\r\nC\r\n", 4, &error), -EINVAL);
+    KUNIT_EXPECT_STREQ(test, error, "Too many lines");
+}
+
+static void io_kunit_filter(struct kunit * test) {
+    struct io_filter filter;
+    u32 value;
+    int i;
+
+    io_filter_reset(&filter);
+    KUNIT_EXPECT_EQ(test, io_filter_value(&filter, IO_FILTER_EMA, 4, 1, &value), -ENODATA);
+
+    io_filter_push(&filter, 100, 4);
+    KUNIT_EXPECT_EQ(test, io_filter_value(&filter, IO_FILTER_EMA, 4, 1, &value), 0);
+    KUNIT_EXPECT_EQ(test, value, 100U);
+    KUNIT_EXPECT_EQ(test, io_filter_value(&filter, IO_FILTER_NONE, 4, IO_TACH_SCALE, &value), 0);
+    KUNIT_EXPECT_EQ(test, value, 100U * IO_TACH_SCALE);
+
+    // The median ignores a single spike, the window picks the newest samples
+    io_filter_push(&filter, 5000, 4);
+    io_filter_push(&filter, 110, 4);
+    KUNIT_EXPECT_EQ(test, io_filter_value(&filter, IO_FILTER_MEDIAN, 3, 1, &value), 0);
+    KUNIT_EXPECT_EQ(test, value, 110U);
+    KUNIT_EXPECT_EQ(test, io_filter_value(&filter, IO_FILTER_MEDIAN, 2, 1, &value), 0);
+    KUNIT_EXPECT_EQ(test, value, 2555U);
+    KUNIT_EXPECT_EQ(test, io_filter_last(&filter), 110);
+
+    // The EMA settles on a steady input
+    for (i = 0; i < 64; i++) {
+        io_filter_push(&filter, 200, 4);
+    }
+    KUNIT_EXPECT_EQ(test, io_filter_value(&filter, IO_FILTER_EMA, 4, 1, &value), 0);
+    KUNIT_EXPECT_EQ(test, value, 200U);
+    KUNIT_EXPECT_EQ(test, filter.count, (unsigned int)IO_FILTER_SAMPLES);
+
+    KUNIT_EXPECT_EQ(test, io_filter_window_parse("0", &value), -EINVAL);
+    KUNIT_EXPECT_EQ(test, io_filter_window_parse("17", &value), -EINVAL);
+}
+
+static void io_kunit_pid(struct kunit * test) {
+    struct io_pid_gains gains;
+    struct io_pid pid;
+    u64 now = NSEC_PER_SEC;
+    u32 out;
+    u32 prev;
+    int i;
+
+    io_pid_gains_init(&gains);
+    io_pid_start(&pid, &gains, 1200, 100000);
+
+    // The first update has no time base, only the proportional term moves
+    out = io_pid_update(&pid, &gains, 1200, now);
+    KUNIT_EXPECT_EQ(test, out, 100000U);
+
+    // Below target the output rises and keeps rising while the error holds
+    prev = out;
+    for (i = 0; i < 5; i++) {
+        now += 250 * NSEC_PER_MSEC;
+        out = io_pid_update(&pid, &gains, 1000, now);
+        KUNIT_EXPECT_GT(test, out, prev);
+        prev = out;
+    }
+
+    // Saturated, the integral stops growing and unwinds as soon as the error flips
+    for (i = 0; i < 100; i++) {
+        now += 250 * NSEC_PER_MSEC;
+        out = io_pid_update(&pid, &gains, 0, now);
+    }
+    KUNIT_EXPECT_EQ(test, out, (u32)IO_PID_OUT_MAX);
+    KUNIT_EXPECT_LE(test, pid.integral, (s64)gains.windup * 1000);
+    now += 250 * NSEC_PER_MSEC;
+    out = io_pid_update(&pid, &gains, 1300, now);
+    KUNIT_EXPECT_LT(test, out, (u32)IO_PID_OUT_MAX);
+
+    // Far above target the output bottoms out at 0
+    now += 250 * NSEC_PER_MSEC;
+    KUNIT_EXPECT_EQ(test, io_pid_update(&pid, &gains, 20000, now), 0U);
+
+    io_pid_stop(&pid);
+    KUNIT_EXPECT_EQ(test, pid.target, 0U);
+
+    // A start from a duty above the windup clamp seeds only up to it
+    gains.windup = 50;
+    io_pid_start(&pid, &gains, 1200, 200000);
+    KUNIT_EXPECT_EQ(test, pid.integral, 50000LL);
+}
+
+static void io_kunit_rate(struct kunit * test) {
+    struct io_rate rate;
+
+    io_rate_init(&rate, 1);
+    KUNIT_EXPECT_EQ(test, rate.min_ms, (unsigned int)IO_RATE_MIN_MS);
+
+    io_rate_init(&rate, 250);
+    rate.max_ms = 1000;
+    KUNIT_EXPECT_EQ(test, io_rate_next(&rate, true), msecs_to_jiffies(250));
+
+    // Without a recent reader the period doubles up to max_ms
+    rate.read_at = jiffies - msecs_to_jiffies(2000);
+    KUNIT_EXPECT_EQ(test, io_rate_next(&rate, false), msecs_to_jiffies(500));
+    KUNIT_EXPECT_EQ(test, io_rate_next(&rate, false), msecs_to_jiffies(1000));
+    KUNIT_EXPECT_EQ(test, io_rate_next(&rate, false), msecs_to_jiffies(1000));
+
+    // A read drops it back to min_ms
+    io_rate_touch(&rate);
+    KUNIT_EXPECT_EQ(test, io_rate_next(&rate, false), msecs_to_jiffies(250));
+
+    KUNIT_EXPECT_FALSE(test, io_rate_changed(3200, 3300));
+    KUNIT_EXPECT_TRUE(test, io_rate_changed(3200, 3301));
+    KUNIT_EXPECT_TRUE(test, io_rate_changed(0, 1));
+
+    KUNIT_EXPECT_EQ(test, io_rate_min_parse(&rate, "2000"), -EINVAL);
+    KUNIT_EXPECT_EQ(test, io_rate_max_parse(&rate, "100"), -EINVAL);
+    KUNIT_EXPECT_EQ(test, io_rate_max_parse(&rate, "60001"), -EINVAL);
+}
+
+static void io_kunit_cmdq(struct kunit * test) {
+    struct io_cmdq cmdq;
+
+    io_cmdq_init(&cmdq);
+    io_cmdq_lock(&cmdq, IO_CMDQ_READ);
+    KUNIT_EXPECT_TRUE(test, cmdq.busy);
+    KUNIT_EXPECT_FALSE(test, io_cmdq_may_run(&cmdq, IO_CMDQ_WRITE));
+    io_cmdq_unlock(&cmdq);
+    KUNIT_EXPECT_EQ(test, cmdq.grants[IO_CMDQ_READ], 1ULL);
+
+    // Writes go first
+    cmdq.waiting[IO_CMDQ_WRITE] = 1;
+    KUNIT_EXPECT_FALSE(test, io_cmdq_may_run(&cmdq, IO_CMDQ_READ));
+    KUNIT_EXPECT_TRUE(test, io_cmdq_may_run(&cmdq, IO_CMDQ_WRITE));
+
+    // Until a read has waited out IO_CMDQ_STARVE_LIMIT writes
+    cmdq.waiting[IO_CMDQ_READ] = 1;
+    cmdq.streak = IO_CMDQ_STARVE_LIMIT;
+    KUNIT_EXPECT_TRUE(test, io_cmdq_may_run(&cmdq, IO_CMDQ_READ));
+    KUNIT_EXPECT_FALSE(test, io_cmdq_may_run(&cmdq, IO_CMDQ_WRITE));
+    cmdq.waiting[IO_CMDQ_WRITE] = 0;
+    cmdq.waiting[IO_CMDQ_READ] = 0;
+
+    // A write granted while a read waits counts towards the streak
+    cmdq.streak = 0;
+    cmdq.waiting[IO_CMDQ_READ] = 1;
+    io_cmdq_lock(&cmdq, IO_CMDQ_WRITE);
+    io_cmdq_unlock(&cmdq);
+    KUNIT_EXPECT_EQ(test, cmdq.streak, 1U);
+    cmdq.waiting[IO_CMDQ_READ] = 0;
+    io_cmdq_lock(&cmdq, IO_CMDQ_WRITE);
+    io_cmdq_unlock(&cmdq);
+    KUNIT_EXPECT_EQ(test, cmdq.streak, 0U);
+}
+
+struct io_kunit_cmdq_reader {
+    struct io_cmdq cmdq;
+    struct completion done;
+    int result;
+};
+
+static int io_kunit_cmdq_read(void * data) {
+    struct io_kunit_cmdq_reader * r = data;
+
+    allow_signal(SIGKILL);
+    r->result = io_cmdq_lock_killable(&r->cmdq);
+    complete(&r->done);
+
+    for (;;) {
+        set_current_state(TASK_UNINTERRUPTIBLE);
+        if (kthread_should_stop()) {
+            break;
+        }
+        schedule();
+    }
+    __set_current_state(TASK_RUNNING);
+
+    return 0;
+}
+
+static void io_kunit_cmdq_killable(struct kunit * test) {
+    struct io_kunit_cmdq_reader r = {};
+    struct task_struct * task;
+
+    io_cmdq_init(&r.cmdq);
+    init_completion(&r.done);
+
+    KUNIT_ASSERT_EQ(test, io_cmdq_lock_killable(&r.cmdq), 0);
+    io_cmdq_unlock(&r.cmdq);
+
+    // A reader killed while queued leaves without the lock
+    io_cmdq_lock(&r.cmdq, IO_CMDQ_WRITE);
+    task = kthread_run(io_kunit_cmdq_read, &r, "io-kunit-cmdq");
+    KUNIT_ASSERT_FALSE(test, IS_ERR(task));
+    while (!READ_ONCE(r.cmdq.waiting[IO_CMDQ_READ])) {
+        msleep(1);
+    }
+    send_sig(SIGKILL, task, 1);
+    wait_for_completion(&r.done);
+    kthread_stop(task);
+
+    KUNIT_EXPECT_EQ(test, r.result, -EINTR);
+    KUNIT_EXPECT_EQ(test, r.cmdq.waiting[IO_CMDQ_READ], 0U);
+    KUNIT_EXPECT_EQ(test, r.cmdq.grants[IO_CMDQ_READ], 1ULL);
+    KUNIT_EXPECT_TRUE(test, r.cmdq.busy);
+    io_cmdq_unlock(&r.cmdq);
+}
+
+struct io_kunit_flight {
+    struct io_flight flight;
+    struct work_struct joiner;
+    unsigned int calls;
+    int leader_result;
+    int joiner_result;
+    long joiner_value;
+};
+
+static int io_kunit_flight_fn(void * data, int channel, long * value) {
+    struct io_kunit_flight * f = data;
+
+    // The first flight stays in progress until a second reader has joined it
+    if (++f->calls == 1) {
+        queue_work(system_unbound_wq, &f->joiner);
+        while (!wq_has_sleeper(&f->flight.wait)) {
+            msleep(1);
+        }
+        if (f->leader_result) {
+            return f->leader_result;
+        }
+    }
+
+    *value = 1000 * f->calls + channel;
+    return 0;
+}
+
+static void io_kunit_flight_join(struct work_struct * work) {
+    struct io_kunit_flight * f = container_of(work, struct io_kunit_flight, joiner);
+
+    f->joiner_result = io_flight_do(&f->flight, io_kunit_flight_fn, f, 1, &f->joiner_value);
+}
+
+static void io_kunit_flight(struct kunit * test) {
+    struct io_kunit_flight f = {};
+    long value;
+
+    io_flight_init(&f.flight);
+    INIT_WORK_ONSTACK(&f.joiner, io_kunit_flight_join);
+
+    // A reader arriving during a flight shares its result
+    KUNIT_EXPECT_EQ(test, io_flight_do(&f.flight, io_kunit_flight_fn, &f, 1, &value), 0);
+    flush_work(&f.joiner);
+    KUNIT_EXPECT_EQ(test, f.calls, 1U);
+    KUNIT_EXPECT_EQ(test, value, 1001L);
+    KUNIT_EXPECT_EQ(test, f.joiner_result, 0);
+    KUNIT_EXPECT_EQ(test, f.joiner_value, 1001L);
+
+    // The result is not kept past the flight
+    KUNIT_EXPECT_EQ(test, io_flight_do(&f.flight, io_kunit_flight_fn, &f, 1, &value), 0);
+    KUNIT_EXPECT_EQ(test, f.calls, 2U);
+    KUNIT_EXPECT_EQ(test, value, 2001L);
+
+    // A leader killed in the queue does not fail the readers that joined it
+    f.calls = 0;
+    f.leader_result = -EINTR;
+    KUNIT_EXPECT_EQ(test, io_flight_do(&f.flight, io_kunit_flight_fn, &f, 1, &value), -EINTR);
+    flush_work(&f.joiner);
+    KUNIT_EXPECT_EQ(test, f.calls, 2U);
+    KUNIT_EXPECT_EQ(test, f.joiner_result, 0);
+    KUNIT_EXPECT_EQ(test, f.joiner_value, 2001L);
+
+    destroy_work_on_stack(&f.joiner);
+}
+
+static struct kunit_case io_kunit_shared_cases[] = {
+    KUNIT_CASE(io_kunit_scaling),
+    KUNIT_CASE(io_kunit_parser),
+    KUNIT_CASE(io_kunit_filter),
+    KUNIT_CASE(io_kunit_pid),
+    KUNIT_CASE(io_kunit_rate),
+    KUNIT_CASE(io_kunit_cmdq),
+    KUNIT_CASE(io_kunit_cmdq_killable),
+    KUNIT_CASE(io_kunit_flight),
+    {}
+};
+
+static struct kunit_suite io_kunit_shared_suite = {
+    .name = "system76-io-shared",
+    .test_cases = io_kunit_shared_cases,
+};
+
+kunit_test_suites(&io_kunit_suite, &io_kunit_shared_suite);
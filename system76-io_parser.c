@@ -0,0 +1,109 @@
+/*
+ * system76-io_parser.c
+ *
+ * Copyright (C) 2018 Jeremy Soller <jeremy@system76.com>
+ *
+ * This program is free software;  you can redistribute it and/or modify
+ * it under the terms of the  GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is  distributed in the hope that it  will be useful, but
+ * WITHOUT  ANY   WARRANTY;  without   even  the  implied   warranty  of
+ * MERCHANTABILITY  or FITNESS FOR  A PARTICULAR  PURPOSE.  See  the GNU
+ * General Public License for more details.
+ *
+ * You should  have received  a copy of  the GNU General  Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Io line protocol response parser. Kept free of USB and device state, it
+// only needs IO_MSG_SIZE, the reply tokens, bool, strcmp and EINVAL.
+
+struct io_parser {
+    bool cr;
+    bool lf;
+    bool error;
+    int lines_i;
+    int line_i;
+    char lines[2][IO_MSG_SIZE];
+};
+
+static void io_parser_init(struct io_parser * parser) {
+    parser->cr = 0;
+    parser->lf = 0;
+    parser->error = 0;
+    parser->lines_i = 0;
+    parser->line_i = 0;
+}
+
+// Returns 1 once OK was received, 0 if more data is needed, or -EINVAL with
+// a description of the framing error in error
+static int io_parser_feed(struct io_parser * parser, const char * data, size_t len, const char ** error) {
+    size_t i;
+    char c;
+
+    for (i = 0; i < len; i++) {
+        c = data[i];
+        if (c == '\r') {
+            if (!parser->cr) {
+                parser->cr = 1;
+            } else {
+                // Unexpected \r, return error
+                *error = "Unexpected CR";
+                return -EINVAL;
+            }
+        } else if (c == '\n') {
+            if (parser->cr) {
+                parser->cr = 0;
+                if (parser->lf) {
+                    // Received a response in full
+                    if (parser->lines_i < 2 && parser->line_i < IO_MSG_SIZE) {
+                        parser->lines[parser->lines_i++][parser->line_i] = 0;
+                        parser->line_i = 0;
+                    } else {
+                        *error = "Too many lines";
+                        return -EINVAL;
+                    }
+                }
+                parser->lf = !parser->lf;
+            } else {
+                // Unexpected \n, return error
+                *error = "Unexpected LF";
+                return -EINVAL;
+            }
+        } else if (!parser->cr && parser->lf) {
+            // Received a response byte
+            if (parser->lines_i < 2 && parser->line_i < IO_MSG_SIZE) {
+                parser->lines[parser->lines_i][parser->line_i++] = c;
+            } else {
+                // Response too long
+                *error = "Too many chars";
+                return -EINVAL;
+            }
+        } else {
+            // Unexpected data, return error
+            *error = "Unexpected char";
+            return -EINVAL;
+        }
+    }
+
+    if (parser->lines_i > 0) {
+        if (strcmp(parser->lines[parser->lines_i - 1], IO_REPLY_OK) == 0) {
+            return 1;
+        } else if (strcmp(parser->lines[parser->lines_i - 1], IO_REPLY_ERROR) == 0) {
+            parser->error = 1;
+        }
+    }
+
+    return 0;
+}
+
+// The line before the final OK or ERROR, empty if there was none
+static const char * io_parser_reply(const struct io_parser * parser) {
+    if (parser->lines_i > 1) {
+        return parser->lines[parser->lines_i - 2];
+    }
+
+    return "";
+}
@@ -0,0 +1,150 @@
+/*
+ * system76-io_pid.c
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This program is free software;  you can redistribute it and/or modify
+ * it under the terms of the  GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is  distributed in the hope that it  will be useful, but
+ * WITHOUT  ANY   WARRANTY;  without   even  the  implied   warranty  of
+ * MERCHANTABILITY  or FITNESS FOR  A PARTICULAR  PURPOSE.  See  the GNU
+ * General Public License for more details.
+ *
+ * You should  have received  a copy of  the GNU General  Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Fan speed regulator behind fanN_target, shared by both drivers. It runs
+// once per background sample and outputs PWM in thousandths (0-255000), so
+// each driver converts to its own duty range. Gains are in thousandths of a
+// PWM unit: kp per RPM of error, ki per RPM second, kd per RPM per second
+// of tach change. The derivative acts on the measurement so a new target
+// does not kick the output.
+
+#define IO_PID_OUT_MAX 255000
+#define IO_PID_KP 40
+#define IO_PID_KI 100
+#define IO_PID_KD 0
+#define IO_PID_GAIN_MAX 1000000
+#define IO_PID_TARGET_MAX 20000
+
+struct io_pid_gains {
+    int kp;
+    int ki;
+    int kd;
+    // Anti-windup clamp on the integral term, in PWM units
+    unsigned int windup;
+};
+
+struct io_pid {
+    // RPM, 0 when the channel is not regulated
+    u32 target;
+    // Integral term in thousandths of a PWM unit
+    s64 integral;
+    u32 prev_rpm;
+    u64 prev_ns;
+};
+
+static void io_pid_gains_init(struct io_pid_gains * gains) {
+    gains->kp = IO_PID_KP;
+    gains->ki = IO_PID_KI;
+    gains->kd = IO_PID_KD;
+    gains->windup = 255;
+}
+
+// Bound on the integral term, in thousandths of a PWM unit
+static s64 io_pid_limit(const struct io_pid_gains * gains) {
+    return (s64)min(gains->windup, 255U) * 1000;
+}
+
+// Starts regulating from the current output so the fan does not jump, as
+// far as the anti-windup clamp allows
+static void io_pid_start(struct io_pid * pid, const struct io_pid_gains * gains, u32 target, u32 out) {
+    s64 limit;
+
+    limit = io_pid_limit(gains);
+
+    pid->target = target;
+    pid->integral = clamp((s64)out, -limit, limit);
+    pid->prev_rpm = 0;
+    pid->prev_ns = 0;
+}
+
+static void io_pid_stop(struct io_pid * pid) {
+    pid->target = 0;
+}
+
+// Returns the new output in thousandths of a PWM unit
+static u32 io_pid_update(struct io_pid * pid, const struct io_pid_gains * gains, u32 rpm, u64 now_ns) {
+    s64 error;
+    s64 limit;
+    s64 integral;
+    s64 d;
+    s64 out;
+    u64 dt_ms;
+
+    error = (s64)pid->target - rpm;
+    limit = io_pid_limit(gains);
+    dt_ms = pid->prev_ns ? div_u64(now_ns - pid->prev_ns, NSEC_PER_MSEC) : 0;
+
+    integral = pid->integral;
+    d = 0;
+    if (dt_ms) {
+        integral += div_s64((s64)gains->ki * error * (s64)dt_ms, 1000);
+        integral = clamp(integral, -limit, limit);
+        d = -div_s64((s64)gains->kd * ((s64)rpm - pid->prev_rpm) * 1000, (s32)min_t(u64, dt_ms, S32_MAX));
+    }
+
+    out = (s64)gains->kp * error + integral + d;
+
+    // Conditional integration: while saturated, only let the integral unwind
+    if ((out > IO_PID_OUT_MAX && error > 0) || (out < 0 && error < 0)) {
+        out = (s64)gains->kp * error + pid->integral + d;
+    } else {
+        pid->integral = integral;
+    }
+
+    pid->prev_rpm = rpm;
+    pid->prev_ns = now_ns;
+
+    return (u32)clamp(out, (s64)0, (s64)IO_PID_OUT_MAX);
+}
+
+static int io_pid_gain_parse(const char * buf, int * gain) {
+    int value;
+    int ret;
+
+    ret = kstrtoint(buf, 10, &value);
+    if (ret) {
+        return ret;
+    }
+
+    if (value < 0 || value > IO_PID_GAIN_MAX) {
+        return -EINVAL;
+    }
+
+    *gain = value;
+
+    return 0;
+}
+
+static int io_pid_windup_parse(const char * buf, unsigned int * windup) {
+    unsigned int value;
+    int ret;
+
+    ret = kstrtouint(buf, 10, &value);
+    if (ret) {
+        return ret;
+    }
+
+    if (value > 255) {
+        return -EINVAL;
+    }
+
+    *windup = value;
+
+    return 0;
+}
@@ -0,0 +1,70 @@
+/*
+ * system76-io_proto.h
+ *
+ * Copyright (C) 2018 Jeremy Soller <jeremy@system76.com>
+ * Copyright (C) 2023 System76
+ *
+ * This program is free software;  you can redistribute it and/or modify
+ * it under the terms of the  GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is  distributed in the hope that it  will be useful, but
+ * WITHOUT  ANY   WARRANTY;  without   even  the  implied   warranty  of
+ * MERCHANTABILITY  or FITNESS FOR  A PARTICULAR  PURPOSE.  See  the GNU
+ * General Public License for more details.
+ *
+ * You should  have received  a copy of  the GNU General  Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Wire protocol of both Io boards. This header only contains constants so
+// that userspace tools talking to the boards over hidraw or ttyACM can
+// include it directly and stay in sync with the drivers.
+
+#ifndef SYSTEM76_IO_PROTO_H
+#define SYSTEM76_IO_PROTO_H
+
+// Io (system76-io): CDC ACM line protocol
+#define IO_VENDOR 0x1209
+#define IO_DEVICE 0x1776
+#define IO_INTF_CTRL 0
+#define IO_EP_CTRL 0x00
+#define IO_INTF_DATA 1
+#define IO_EP_IN 0x83
+#define IO_EP_OUT 0x04
+#define IO_MSG_SIZE 32
+
+// Commands are the name followed by arguments and a CR, for example
+// IO_CMD_TACH "CPUF\r". Replies are CRLF framed lines ending in OK or ERROR.
+#define IO_CMD_BOOT "IoBOOT"
+#define IO_CMD_RESET "IoRSET"
+#define IO_CMD_TACH "IoTACH"
+#define IO_CMD_DUTY "IoDUTY"
+#define IO_CMD_SUSPEND "IoSUSP"
+#define IO_CMD_REVISION "IoREVISION"
+#define IO_REPLY_OK "OK"
+#define IO_REPLY_ERROR "ERROR"
+
+// IoTACH replies in counts of this many RPM, IoDUTY in hundredths of a percent
+#define IO_TACH_SCALE 30
+#define IO_DUTY_MAX 10000
+
+// Thelio Io (system76-thelio-io): 32 byte HID reports without report ids
+#define THELIO_IO_VENDOR 0x3384
+#define THELIO_IO_DEVICE 0x000B
+#define THELIO_IO_USAGE 0xFF600061
+
+#define THELIO_IO_REPORT_SIZE 32
+
+// Byte offsets in a report: command, result (0 on success) and arguments
+#define THELIO_IO_REPORT_CMD 0
+#define THELIO_IO_REPORT_RES 1
+#define THELIO_IO_REPORT_DATA 2
+
+#define THELIO_IO_CMD_FAN_GET 7
+#define THELIO_IO_CMD_FAN_SET 8
+#define THELIO_IO_CMD_LED_SET_MODE 16
+#define THELIO_IO_CMD_FAN_TACH 22
+
+#endif // SYSTEM76_IO_PROTO_H
@@ -0,0 +1,143 @@
+/*
+ * system76-io_rate.c
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This program is free software;  you can redistribute it and/or modify
+ * it under the terms of the  GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is  distributed in the hope that it  will be useful, but
+ * WITHOUT  ANY   WARRANTY;  without   even  the  implied   warranty  of
+ * MERCHANTABILITY  or FITNESS FOR  A PARTICULAR  PURPOSE.  See  the GNU
+ * General Public License for more details.
+ *
+ * You should  have received  a copy of  the GNU General  Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Pacing for the background tach sampler, shared by both drivers. The period
+// drops to min_ms while readings move, a duty is ramping, userspace is reading
+// or the system runs hot, and doubles with every quiet sample up to max_ms.
+
+#define IO_RATE_MIN_MS 10
+#define IO_RATE_MAX_MS 60000
+#define IO_RATE_MAX_DEFAULT 4000
+// A tach reading that moves by more than 1/32 of the previous one is a change
+#define IO_RATE_CHANGE_SHIFT 5
+
+struct io_rate {
+    unsigned int min_ms;
+    unsigned int max_ms;
+    // Only touched by the sample work
+    unsigned int period_ms;
+    // jiffies of the last userspace read
+    unsigned long read_at;
+};
+
+static void io_rate_init(struct io_rate * rate, unsigned int min_ms) {
+    rate->min_ms = clamp(min_ms, (unsigned int)IO_RATE_MIN_MS, (unsigned int)IO_RATE_MAX_DEFAULT);
+    rate->max_ms = IO_RATE_MAX_DEFAULT;
+    rate->period_ms = rate->min_ms;
+    rate->read_at = jiffies;
+}
+
+// Called whenever userspace reads a fan value
+static void io_rate_touch(struct io_rate * rate) {
+    WRITE_ONCE(rate->read_at, jiffies);
+}
+
+static bool io_rate_changed(u16 prev, u16 value) {
+    return (u32)abs((int)value - (int)prev) > ((u32)prev >> IO_RATE_CHANGE_SHIFT);
+}
+
+// Returns true if the named thermal zone is at or above threshold millidegrees
+static bool io_rate_thermal(const char * zone, int threshold) {
+    struct thermal_zone_device * tz;
+    int temp;
+
+    if (!zone || !zone[0]) {
+        return false;
+    }
+
+    tz = thermal_zone_get_zone_by_name(zone);
+    if (IS_ERR(tz)) {
+        return false;
+    }
+
+    if (thermal_zone_get_temp(tz, &temp)) {
+        return false;
+    }
+
+    return temp >= threshold;
+}
+
+// Returns the delay in jiffies until the next sample
+static unsigned long io_rate_next(struct io_rate * rate, bool active) {
+    unsigned int min_ms;
+    unsigned int max_ms;
+
+    min_ms = READ_ONCE(rate->min_ms);
+    max_ms = READ_ONCE(rate->max_ms);
+
+    // A reader within the last max_ms keeps the sampler at full rate
+    if (active || time_before(jiffies, READ_ONCE(rate->read_at) + msecs_to_jiffies(max_ms))) {
+        rate->period_ms = min_ms;
+    } else {
+        rate->period_ms = clamp(rate->period_ms * 2, min_ms, max_ms);
+    }
+
+    return msecs_to_jiffies(rate->period_ms);
+}
+
+static int io_rate_bound_parse(const char * buf, unsigned int * value) {
+    int ret;
+
+    ret = kstrtouint(buf, 10, value);
+    if (ret) {
+        return ret;
+    }
+
+    if (*value < IO_RATE_MIN_MS || *value > IO_RATE_MAX_MS) {
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+static int io_rate_min_parse(struct io_rate * rate, const char * buf) {
+    unsigned int value;
+    int ret;
+
+    ret = io_rate_bound_parse(buf, &value);
+    if (ret) {
+        return ret;
+    }
+
+    if (value > READ_ONCE(rate->max_ms)) {
+        return -EINVAL;
+    }
+
+    WRITE_ONCE(rate->min_ms, value);
+
+    return 0;
+}
+
+static int io_rate_max_parse(struct io_rate * rate, const char * buf) {
+    unsigned int value;
+    int ret;
+
+    ret = io_rate_bound_parse(buf, &value);
+    if (ret) {
+        return ret;
+    }
+
+    if (value < READ_ONCE(rate->min_ms)) {
+        return -EINVAL;
+    }
+
+    WRITE_ONCE(rate->max_ms, value);
+
+    return 0;
+}
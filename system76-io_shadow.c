@@ -0,0 +1,119 @@
+/*
+ * system76-io_shadow.c
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This program is free software;  you can redistribute it and/or modify
+ * it under the terms of the  GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is  distributed in the hope that it  will be useful, but
+ * WITHOUT  ANY   WARRANTY;  without   even  the  implied   warranty  of
+ * MERCHANTABILITY  or FITNESS FOR  A PARTICULAR  PURPOSE.  See  the GNU
+ * General Public License for more details.
+ *
+ * You should  have received  a copy of  the GNU General  Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Commanded state of disconnected boards, shared by both drivers. A board
+// that drops off the bus (hub glitch, re-enumeration after a failed reset)
+// is matched on its USB path and serial number when it comes back, and gets
+// its last configuration replayed instead of firmware defaults.
+
+#define IO_SHADOW_CHANNELS 4
+#define IO_SHADOW_KEY 96
+// Boards remembered at once, the oldest is forgotten first
+#define IO_SHADOW_MAX 8
+
+struct io_shadow {
+    struct list_head list;
+    char key[IO_SHADOW_KEY];
+    u16 duty[IO_SHADOW_CHANNELS];
+    unsigned int ramp_rate[IO_SHADOW_CHANNELS];
+    enum io_filter_mode filter_mode;
+    unsigned int filter_window;
+    unsigned int sample_min_ms;
+    unsigned int sample_max_ms;
+    unsigned int watchdog_timeout;
+    bool suspended;
+};
+
+static LIST_HEAD(io_shadows);
+static DEFINE_MUTEX(io_shadows_lock);
+static unsigned int io_shadows_count;
+
+static void io_shadow_key(char * key, const char * path, const char * serial) {
+    snprintf(key, IO_SHADOW_KEY, "%s/%s", path, serial ? serial : "");
+}
+
+static void io_shadow_save(const struct io_shadow * state) {
+    struct io_shadow * shadow;
+    struct io_shadow * next;
+
+    mutex_lock(&io_shadows_lock);
+
+    list_for_each_entry_safe(shadow, next, &io_shadows, list) {
+        if (strcmp(shadow->key, state->key) == 0) {
+            list_del(&shadow->list);
+            io_shadows_count--;
+            kfree(shadow);
+        }
+    }
+
+    if (io_shadows_count >= IO_SHADOW_MAX) {
+        shadow = list_first_entry(&io_shadows, struct io_shadow, list);
+        list_del(&shadow->list);
+        io_shadows_count--;
+        kfree(shadow);
+    }
+
+    shadow = kmemdup(state, sizeof(*state), GFP_KERNEL);
+    if (shadow) {
+        list_add_tail(&shadow->list, &io_shadows);
+        io_shadows_count++;
+    }
+
+    mutex_unlock(&io_shadows_lock);
+}
+
+// Removes the saved state for key into state, returns false if there is none
+static bool io_shadow_take(const char * key, struct io_shadow * state) {
+    struct io_shadow * shadow;
+    bool found;
+
+    found = false;
+
+    mutex_lock(&io_shadows_lock);
+
+    list_for_each_entry(shadow, &io_shadows, list) {
+        if (strcmp(shadow->key, key) == 0) {
+            list_del(&shadow->list);
+            io_shadows_count--;
+            *state = *shadow;
+            kfree(shadow);
+            found = true;
+            break;
+        }
+    }
+
+    mutex_unlock(&io_shadows_lock);
+
+    return found;
+}
+
+static void io_shadow_clear(void) {
+    struct io_shadow * shadow;
+    struct io_shadow * next;
+
+    mutex_lock(&io_shadows_lock);
+
+    list_for_each_entry_safe(shadow, next, &io_shadows, list) {
+        list_del(&shadow->list);
+        kfree(shadow);
+    }
+    io_shadows_count = 0;
+
+    mutex_unlock(&io_shadows_lock);
+}
@@ -15,42 +15,136 @@
 
 #include <linux/bitops.h>
 #include <linux/completion.h>
+#include <linux/debugfs.h>
 #include <linux/hid.h>
 #include <linux/hwmon.h>
+#include <linux/hwmon-sysfs.h>
 #include <linux/kernel.h>
+#include <linux/ktime.h>
 #include <linux/module.h>
-#include <linux/mutex.h>
+#include <linux/sched/signal.h>
+#include <linux/seq_file.h>
 #include <linux/slab.h>
 #include <linux/suspend.h>
+#include <linux/thermal.h>
 #include <linux/types.h>
+#include <linux/uaccess.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
 
-#define BUFFER_SIZE	32
-#define REQ_TIMEOUT	300
+#include "system76-io_proto.h"
 
-#define HID_CMD		0
-#define HID_RES		1
-#define HID_DATA	2
+#define REQ_TIMEOUT	300
 
-#define CMD_FAN_GET		7
-#define CMD_FAN_SET		8
-#define CMD_LED_SET_MODE	16
-#define CMD_FAN_TACH		22
+#define NUM_FANS	4
+
+#define ALARM_WATCHDOG	BIT(0)
+#define ALARM_STALL	BIT(1)
+/* the board kept refusing the steps of a ramp, cleared by the next pwm or target written */
+#define ALARM_DUTY	BIT(2)
+/* alarms that make the watchdog force watchdog_pwm */
+#define ALARM_FORCED	(ALARM_WATCHDOG | ALARM_STALL)
+/* consecutive zero tach readings at non-zero duty before a fan counts as stalled */
+#define STALL_COUNT	2
+
+#define RAMP_TICK_MS	50
+/* consecutive failed ramp steps before the ramp is abandoned */
+#define RAMP_RETRIES	3
+
+static unsigned int sample_interval = 250;
+module_param(sample_interval, uint, 0644);
+MODULE_PARM_DESC(sample_interval, "Initial shortest background tach sampling interval in ms while a fan filter is selected");
+
+static char *sample_thermal_zone = "";
+module_param(sample_thermal_zone, charp, 0644);
+MODULE_PARM_DESC(sample_thermal_zone, "Thermal zone type that keeps the sampler at its shortest interval while hot, empty to ignore");
+
+static int sample_thermal_temp = 80000;
+module_param(sample_thermal_temp, int, 0644);
+MODULE_PARM_DESC(sample_thermal_temp, "Temperature in millidegrees Celsius at which sample_thermal_zone counts as hot");
+
+static char *workqueue = "highpri";
+module_param(workqueue, charp, 0444);
+MODULE_PARM_DESC(workqueue, "Workqueue for device I/O: highpri (per-CPU) or unbound, both high priority");
+
+static unsigned int watchdog_timeout;
+module_param(watchdog_timeout, uint, 0644);
+MODULE_PARM_DESC(watchdog_timeout, "Initial fan watchdog timeout in seconds for new devices, 0 to disable");
+
+static unsigned int watchdog_pwm = 255;
+module_param(watchdog_pwm, uint, 0644);
+MODULE_PARM_DESC(watchdog_pwm, "PWM value (0-255) forced by the fan watchdog");
+
+static struct dentry *thelio_io_debugfs;
+static struct workqueue_struct *thelio_io_wq;
+/* commands sent for hwmon readers and PM notifications, see io_exec_call */
+static struct workqueue_struct *thelio_io_exec_wq;
+
+#include "system76-io_capture.c"
+#include "system76-io_cmdq.c"
+#include "system76-io_exec.c"
+#include "system76-io_filter.c"
+#include "system76-io_flight.c"
+#include "system76-io_pid.c"
+#include "system76-io_rate.c"
+#include "system76-io_shadow.c"
 
 struct thelio_io_device {
 	struct hid_device *hdev;
+	/* hid_hw_output_report unless a test model replaces it */
+	int (*output_report)(struct hid_device *hdev, __u8 *buf, size_t len);
 	struct device *hwmon_dev;
 #ifdef CONFIG_PM_SLEEP
 	struct notifier_block pm_notifier;
 #endif
 	struct completion wait_input_report;
-	struct mutex mutex; /* whenever buffer is used, lock before send_usb_cmd */
-	u8 *buffer;
+	spinlock_t report_lock; /* protects the pending request, taken from raw_event */
+	bool pending;
+	u8 pending_cmd;
+	u8 pending_channel;
+	struct io_cmdq cmdq; /* whenever a buffer is used, lock before send_usb_cmd */
+	u8 *tx_buffer; /* handed to the transport as is, only command bytes change */
+	u8 *rx_buffer;
+	struct dentry *debugfs;
+	struct io_capture capture;
+	struct delayed_work sample_work;
+	struct io_rate rate;
+	spinlock_t sample_lock; /* protects filter state, never held across a command */
+	enum io_filter_mode filter_mode;
+	unsigned int filter_window;
+	struct io_filter filters[NUM_FANS];
+	u64 pushed_ns[NUM_FANS]; /* last unsolicited tach report, 0 for none */
+	u64 unsolicited;
+	/* coalesces concurrent FAN_TACH and FAN_GET reads per channel */
+	struct io_flight tach_flight[NUM_FANS];
+	struct io_flight pwm_flight[NUM_FANS];
+	/* watchdog state, protected by cmdq */
+	struct delayed_work watchdog_work;
+	unsigned int watchdog_timeout;
+	unsigned long watchdog_keepalive;
+	u8 duty[NUM_FANS];
+	u8 alarm[NUM_FANS];
+	u8 stall[NUM_FANS];
+	bool suspended; /* set between PM_SUSPEND_PREPARE and PM_POST_SUSPEND */
+	char shadow_key[IO_SHADOW_KEY]; /* hdev->phys and hdev->uniq */
+	/* commanded duty and slew rate limiter state, protected by cmdq */
+	struct delayed_work duty_work;
+	u8 target[NUM_FANS];
+	unsigned int ramp_rate[NUM_FANS]; /* pwm units per second, 0 for no limit */
+	unsigned int ramp_carry[NUM_FANS]; /* milli-pwm left over from the last tick */
+	u64 request_ns[NUM_FANS];
+	int duty_result[NUM_FANS];
+	u8 ramp_errors[NUM_FANS]; /* consecutive failed ramp steps */
+	struct io_latency latency;
+	/* fanN_target regulators, run from the sample work, protected by cmdq */
+	struct io_pid pid[NUM_FANS];
+	struct io_pid_gains pid_gains;
 };
 
-/* converts response error in buffer to errno */
+/* converts response error in rx_buffer to errno */
 static int thelio_io_get_errno(struct thelio_io_device *thelio_io)
 {
-	switch (thelio_io->buffer[HID_RES]) {
+	switch (thelio_io->rx_buffer[THELIO_IO_REPORT_RES]) {
 	case 0x00: /* success */
 		return 0;
 	default:
@@ -58,79 +152,531 @@ static int thelio_io_get_errno(struct thelio_io_device *thelio_io)
 	}
 }
 
-/* send command, check for error in response, response in thelio_io->buffer */
-static int send_usb_cmd(struct thelio_io_device *thelio_io, u8 command,
-			u8 byte1, u8 byte2, u8 byte3)
+static int __send_usb_cmd(struct thelio_io_device *thelio_io, u8 command,
+			  u8 byte1, u8 byte2, u8 byte3)
 {
 	int ret;
 
-	memset(thelio_io->buffer, 0x00, BUFFER_SIZE);
-	thelio_io->buffer[HID_CMD] = command;
-	thelio_io->buffer[HID_DATA] = byte1;
-	thelio_io->buffer[HID_DATA + 1] = byte2;
-	thelio_io->buffer[HID_DATA + 2] = byte3;
+	/* the remaining bytes were zeroed at probe and are never written */
+	thelio_io->tx_buffer[THELIO_IO_REPORT_CMD] = command;
+	thelio_io->tx_buffer[THELIO_IO_REPORT_DATA] = byte1;
+	thelio_io->tx_buffer[THELIO_IO_REPORT_DATA + 1] = byte2;
+	thelio_io->tx_buffer[THELIO_IO_REPORT_DATA + 2] = byte3;
 
 	reinit_completion(&thelio_io->wait_input_report);
 
-	ret = hid_hw_output_report(thelio_io->hdev, thelio_io->buffer, BUFFER_SIZE);
+	spin_lock_irq(&thelio_io->report_lock);
+	thelio_io->pending = true;
+	thelio_io->pending_cmd = command;
+	thelio_io->pending_channel = byte1;
+	spin_unlock_irq(&thelio_io->report_lock);
+
+	ret = thelio_io->output_report(thelio_io->hdev, thelio_io->tx_buffer, THELIO_IO_REPORT_SIZE);
+	if (ret >= 0 && !wait_for_completion_timeout(&thelio_io->wait_input_report,
+						     msecs_to_jiffies(REQ_TIMEOUT)))
+		ret = -ETIMEDOUT;
+
+	/* a late reply must not land in rx_buffer once the caller has moved on */
+	spin_lock_irq(&thelio_io->report_lock);
+	thelio_io->pending = false;
+	spin_unlock_irq(&thelio_io->report_lock);
+
 	if (ret < 0)
 		return ret;
 
-	if (!wait_for_completion_timeout(&thelio_io->wait_input_report,
-					 msecs_to_jiffies(REQ_TIMEOUT)))
-		return -ETIMEDOUT;
-
 	return thelio_io_get_errno(thelio_io);
 }
 
+/* send command, check for error in response, response in thelio_io->rx_buffer */
+static int send_usb_cmd(struct thelio_io_device *thelio_io, u8 command,
+			u8 byte1, u8 byte2, u8 byte3)
+{
+	u64 start = ktime_get_ns();
+	int ret;
+
+	ret = __send_usb_cmd(thelio_io, command, byte1, byte2, byte3);
+	io_capture_add(&thelio_io->capture, start, ret, thelio_io->tx_buffer, THELIO_IO_REPORT_SIZE,
+		       thelio_io->rx_buffer, ret == 0 || ret == -EIO ? THELIO_IO_REPORT_SIZE : 0);
+
+	return ret;
+}
+
+/* called with report_lock held, replies echo the command and the channel of fan commands */
+static bool thelio_io_is_reply(struct thelio_io_device *thelio_io, const u8 *data)
+{
+	if (!thelio_io->pending || data[THELIO_IO_REPORT_CMD] != thelio_io->pending_cmd)
+		return false;
+
+	switch (data[THELIO_IO_REPORT_CMD]) {
+	case THELIO_IO_CMD_FAN_GET:
+	case THELIO_IO_CMD_FAN_SET:
+	case THELIO_IO_CMD_FAN_TACH:
+		return data[THELIO_IO_REPORT_DATA] == thelio_io->pending_channel;
+	default:
+		return true;
+	}
+}
+
+/* feeds a report nobody asked for into the sample ring */
+static void thelio_io_push_report(struct thelio_io_device *thelio_io, const u8 *data)
+{
+	unsigned long flags;
+	int channel = data[THELIO_IO_REPORT_DATA];
+
+	spin_lock_irqsave(&thelio_io->sample_lock, flags);
+
+	thelio_io->unsolicited++;
+	if (data[THELIO_IO_REPORT_CMD] == THELIO_IO_CMD_FAN_TACH &&
+	    data[THELIO_IO_REPORT_RES] == 0 && channel < NUM_FANS) {
+		io_filter_push(&thelio_io->filters[channel],
+			       data[THELIO_IO_REPORT_DATA + 1] |
+			       data[THELIO_IO_REPORT_DATA + 2] << 8,
+			       thelio_io->filter_window);
+		thelio_io->pushed_ns[channel] = ktime_get_ns();
+	}
+
+	spin_unlock_irqrestore(&thelio_io->sample_lock, flags);
+}
+
+/* called with sample_lock held, true if a pushed reading can stand in for a poll */
+static bool thelio_io_pushed(struct thelio_io_device *thelio_io, int channel)
+{
+	u64 pushed_ns = thelio_io->pushed_ns[channel];
+
+	return pushed_ns &&
+	       ktime_get_ns() - pushed_ns < (u64)READ_ONCE(thelio_io->rate.min_ms) * NSEC_PER_MSEC;
+}
+
 static int thelio_io_raw_event(struct hid_device *hdev, struct hid_report *report,
 			       u8 *data, int size)
 {
 	struct thelio_io_device *thelio_io = hid_get_drvdata(hdev);
+	unsigned long flags;
+	bool reply;
 
-	/* only copy buffer when requested */
-	if (completion_done(&thelio_io->wait_input_report))
+	if (size < THELIO_IO_REPORT_DATA + 3)
 		return 0;
 
-	memcpy(thelio_io->buffer, data, min(BUFFER_SIZE, size));
-	complete(&thelio_io->wait_input_report);
+	spin_lock_irqsave(&thelio_io->report_lock, flags);
+	reply = thelio_io_is_reply(thelio_io, data);
+	if (reply) {
+		memcpy(thelio_io->rx_buffer, data, min(THELIO_IO_REPORT_SIZE, size));
+		thelio_io->pending = false;
+	}
+	spin_unlock_irqrestore(&thelio_io->report_lock, flags);
+
+	if (reply)
+		complete(&thelio_io->wait_input_report);
+	else
+		thelio_io_push_report(thelio_io, data);
 
 	return 0;
 }
 
-/* requests and returns single data values depending on channel */
-static int get_data(struct thelio_io_device *thelio_io, int command, int channel,
-		    bool two_byte_data)
+/* like get_data, for callers already holding cmdq */
+static int get_data_locked(struct thelio_io_device *thelio_io, int command, int channel,
+			   bool two_byte_data)
 {
 	int ret;
 
-	mutex_lock(&thelio_io->mutex);
-
 	ret = send_usb_cmd(thelio_io, command, channel, 0, 0);
 	if (ret)
-		goto out_unlock;
+		return ret;
 
-	ret = thelio_io->buffer[HID_DATA + 1];
+	ret = thelio_io->rx_buffer[THELIO_IO_REPORT_DATA + 1];
 	if (two_byte_data)
-		ret |= thelio_io->buffer[HID_DATA + 2] << 8;
+		ret |= thelio_io->rx_buffer[THELIO_IO_REPORT_DATA + 2] << 8;
 
-out_unlock:
-	mutex_unlock(&thelio_io->mutex);
 	return ret;
 }
 
-static int set_pwm(struct thelio_io_device *thelio_io, int channel, long val)
+static int exec_tach(struct io_exec *exec)
+{
+	return get_data_locked(exec->data, THELIO_IO_CMD_FAN_TACH, exec->arg, true);
+}
+
+static int exec_pwm(struct io_exec *exec)
+{
+	return get_data_locked(exec->data, THELIO_IO_CMD_FAN_GET, exec->arg, false);
+}
+
+/* requests and returns single data values depending on channel, from thelio_io_exec_wq */
+static int get_data(struct thelio_io_device *thelio_io, int (*exec)(struct io_exec *),
+		    int channel)
 {
 	int ret;
 
+	ret = io_cmdq_lock_killable(&thelio_io->cmdq);
+	if (ret)
+		return ret;
+	ret = io_exec_call(thelio_io_exec_wq, exec, thelio_io, channel, NULL);
+	io_cmdq_unlock(&thelio_io->cmdq);
+
+	return ret;
+}
+
+static int fetch_tach(void *data, int channel, long *val)
+{
+	int ret;
+
+	ret = get_data(data, exec_tach, channel);
+	if (ret < 0)
+		return ret;
+
+	*val = ret;
+	return 0;
+}
+
+static int fetch_pwm(void *data, int channel, long *val)
+{
+	int ret;
+
+	ret = get_data(data, exec_pwm, channel);
+	if (ret < 0)
+		return ret;
+
+	*val = ret;
+	return 0;
+}
+
+static int set_pwm(struct thelio_io_device *thelio_io, int channel, long val)
+{
+	bool ramp;
+
 	if (val < 0 || val > 255)
 		return -EINVAL;
 
-	mutex_lock(&thelio_io->mutex);
+	io_cmdq_lock(&thelio_io->cmdq, IO_CMDQ_WRITE);
+
+	/* a direct duty takes the channel back from fanN_target */
+	io_pid_stop(&thelio_io->pid[channel]);
+	thelio_io->target[channel] = val;
+	thelio_io->request_ns[channel] = ktime_get_ns();
+	thelio_io->duty_result[channel] = 0;
+	ramp = thelio_io->ramp_rate[channel] != 0;
+
+	/* userspace is in control of this channel again */
+	thelio_io->alarm[channel] &= ~(ALARM_WATCHDOG | ALARM_DUTY);
+	thelio_io->stall[channel] = 0;
+	thelio_io->watchdog_keepalive = jiffies;
+
+	io_cmdq_unlock(&thelio_io->cmdq);
+
+	/* the duty work sends the command from the dedicated workqueue */
+	mod_delayed_work(thelio_io_wq, &thelio_io->duty_work, 0);
+	if (ramp)
+		return 0;
+
+	flush_delayed_work(&thelio_io->duty_work);
+
+	return READ_ONCE(thelio_io->duty_result[channel]);
+}
+
+/* non-zero RPM starts the regulator, 0 stops it and keeps the current duty */
+static int set_target(struct thelio_io_device *thelio_io, int channel, long val)
+{
+	struct io_pid *pid = &thelio_io->pid[channel];
+
+	if (val < 0 || val > IO_PID_TARGET_MAX)
+		return -EINVAL;
+
+	io_cmdq_lock(&thelio_io->cmdq, IO_CMDQ_WRITE);
+
+	if (!val)
+		io_pid_stop(pid);
+	else if (!pid->target)
+		io_pid_start(pid, &thelio_io->pid_gains, val,
+			     thelio_io->target[channel] * 1000);
+	else
+		pid->target = val;
+
+	if (val) {
+		thelio_io->alarm[channel] &= ~(ALARM_WATCHDOG | ALARM_DUTY);
+		thelio_io->stall[channel] = 0;
+		thelio_io->watchdog_keepalive = jiffies;
+	}
+
+	io_cmdq_unlock(&thelio_io->cmdq);
+
+	/* starts the sampler if no filter kept it running */
+	if (val)
+		mod_delayed_work(thelio_io_wq, &thelio_io->sample_work, 0);
+
+	return 0;
+}
+
+/* applies commanded duties, stepping by ramp_rate every tick where one is set */
+static void thelio_io_duty_work(struct work_struct *work)
+{
+	struct thelio_io_device *thelio_io = container_of(to_delayed_work(work),
+							  struct thelio_io_device, duty_work);
+	bool pending = false;
+	unsigned int step;
+	int channel;
+	int duty;
+	int target;
+	int ret;
+
+	io_cmdq_lock(&thelio_io->cmdq, IO_CMDQ_WRITE);
+
+	for (channel = 0; channel < NUM_FANS; channel++) {
+		duty = thelio_io->duty[channel];
+		target = thelio_io->target[channel];
+		/* a fresh request is always sent, even if the shadow already matches */
+		if (duty == target && !thelio_io->request_ns[channel])
+			continue;
+
+		/*
+		 * ramp_rate * RAMP_TICK_MS is in milli-pwm, the remainder carries
+		 * over so rates that are not a multiple of 1000 / RAMP_TICK_MS
+		 * are honoured on average
+		 */
+		step = thelio_io->ramp_rate[channel] * RAMP_TICK_MS +
+		       thelio_io->ramp_carry[channel];
+		thelio_io->ramp_carry[channel] = step % 1000;
+		step /= 1000;
+		if (!thelio_io->ramp_rate[channel] || (unsigned int)abs(target - duty) <= step)
+			duty = target;
+		else if (duty < target)
+			duty += step;
+		else
+			duty -= step;
+		if (duty == target)
+			thelio_io->ramp_carry[channel] = 0;
+
+		if (thelio_io->request_ns[channel]) {
+			io_latency_add(&thelio_io->latency, thelio_io->request_ns[channel]);
+			thelio_io->request_ns[channel] = 0;
+		}
+
+		ret = send_usb_cmd(thelio_io, THELIO_IO_CMD_FAN_SET, channel, duty, 0);
+		if (!ret) {
+			thelio_io->duty[channel] = duty;
+			thelio_io->ramp_errors[channel] = 0;
+		} else if (!thelio_io->ramp_rate[channel]) {
+			/* report the failure to the writer instead of retrying */
+			thelio_io->duty_result[channel] = ret;
+			thelio_io->target[channel] = thelio_io->duty[channel];
+		} else if (++thelio_io->ramp_errors[channel] >= RAMP_RETRIES) {
+			/* nobody waits on a ramp, so stop it where it is and raise fanN_alarm */
+			hid_warn(thelio_io->hdev, "fan %d: ramp abandoned after %d failures: %d\n",
+				 channel + 1, RAMP_RETRIES, ret);
+			thelio_io->duty_result[channel] = ret;
+			thelio_io->target[channel] = thelio_io->duty[channel];
+			thelio_io->ramp_errors[channel] = 0;
+			thelio_io->ramp_carry[channel] = 0;
+			thelio_io->alarm[channel] |= ALARM_DUTY;
+		}
+
+		if (thelio_io->duty[channel] != thelio_io->target[channel])
+			pending = true;
+	}
+
+	io_cmdq_unlock(&thelio_io->cmdq);
+
+	if (pending)
+		queue_delayed_work(thelio_io_wq, &thelio_io->duty_work,
+				   msecs_to_jiffies(RAMP_TICK_MS));
+}
+
+static void thelio_io_watchdog_schedule(struct thelio_io_device *thelio_io)
+{
+	if (READ_ONCE(thelio_io->watchdog_timeout))
+		mod_delayed_work(thelio_io_wq, &thelio_io->watchdog_work, HZ);
+}
+
+static void thelio_io_watchdog_work(struct work_struct *work)
+{
+	struct thelio_io_device *thelio_io = container_of(to_delayed_work(work),
+							  struct thelio_io_device, watchdog_work);
+	u8 safe = min(watchdog_pwm, 255U);
+	bool expired;
+	int channel;
+	u8 alarm;
+	int ret;
+
+	io_cmdq_lock(&thelio_io->cmdq, IO_CMDQ_WRITE);
+
+	if (!thelio_io->watchdog_timeout) {
+		io_cmdq_unlock(&thelio_io->cmdq);
+		return;
+	}
+
+	expired = time_after(jiffies, thelio_io->watchdog_keepalive +
+				      thelio_io->watchdog_timeout * HZ);
+
+	for (channel = 0; channel < NUM_FANS; channel++) {
+		if (thelio_io->duty[channel]) {
+			ret = get_data_locked(thelio_io, THELIO_IO_CMD_FAN_TACH, channel, true);
+			if (ret == 0 && thelio_io->stall[channel] < STALL_COUNT)
+				thelio_io->stall[channel]++;
+			else if (ret > 0)
+				thelio_io->stall[channel] = 0;
+		}
+
+		alarm = thelio_io->alarm[channel];
+		if (thelio_io->stall[channel] >= STALL_COUNT)
+			alarm |= ALARM_STALL;
+		else
+			alarm &= ~ALARM_STALL;
+		/* a regulated channel is driven by the sample work, only stalls count */
+		if (expired && !thelio_io->pid[channel].target)
+			alarm |= ALARM_WATCHDOG;
+
+		if ((alarm & ALARM_FORCED) && !(thelio_io->alarm[channel] & ALARM_FORCED))
+			hid_warn(thelio_io->hdev, "watchdog: fan %d %s, forcing pwm %d\n",
+				 channel + 1, (alarm & ALARM_WATCHDOG) ? "timed out" : "stalled",
+				 safe);
+		if ((alarm & ALARM_FORCED) && thelio_io->duty[channel] != safe &&
+		    !send_usb_cmd(thelio_io, THELIO_IO_CMD_FAN_SET, channel, safe, 0))
+			thelio_io->duty[channel] = safe;
+		if (alarm & ALARM_FORCED) /* stop any ramp from walking the duty back down */
+			thelio_io->target[channel] = thelio_io->duty[channel];
+		thelio_io->alarm[channel] = alarm;
+	}
+
+	io_cmdq_unlock(&thelio_io->cmdq);
+
+	thelio_io_watchdog_schedule(thelio_io);
+}
+
+/* seeds the duty shadow from the device */
+static void thelio_io_watchdog_init(struct thelio_io_device *thelio_io)
+{
+	int channel;
+	int ret;
+
+	io_cmdq_lock(&thelio_io->cmdq, IO_CMDQ_WRITE);
+
+	thelio_io->watchdog_timeout = watchdog_timeout;
+	thelio_io->watchdog_keepalive = jiffies;
+
+	for (channel = 0; channel < NUM_FANS; channel++) {
+		ret = get_data_locked(thelio_io, THELIO_IO_CMD_FAN_GET, channel, false);
+		thelio_io->duty[channel] = ret < 0 ? 0 : ret;
+		thelio_io->target[channel] = thelio_io->duty[channel];
+	}
+
+	io_cmdq_unlock(&thelio_io->cmdq);
+}
+
+static void thelio_io_sample_schedule(struct thelio_io_device *thelio_io, unsigned long delay)
+{
+	queue_delayed_work(thelio_io_wq, &thelio_io->sample_work, delay);
+}
+
+/*
+ * moves regulated channels toward their fanN_target from fresh tach readings,
+ * returns true while any channel is regulated
+ */
+static bool thelio_io_pid_run(struct thelio_io_device *thelio_io, const u16 *tach,
+			      const bool *valid)
+{
+	bool regulating = false;
+	bool queue = false;
+	u64 now = ktime_get_ns();
+	u32 out;
+	int channel;
+
+	io_cmdq_lock(&thelio_io->cmdq, IO_CMDQ_WRITE);
+
+	for (channel = 0; channel < NUM_FANS; channel++) {
+		if (!thelio_io->pid[channel].target)
+			continue;
+
+		regulating = true;
+
+		/* leave the channel to the watchdog, or alone after a failed ramp, while alarmed */
+		if (!valid[channel] || thelio_io->alarm[channel])
+			continue;
+
+		out = io_pid_update(&thelio_io->pid[channel], &thelio_io->pid_gains,
+				    tach[channel], now);
+		thelio_io->target[channel] = DIV_ROUND_CLOSEST(out, 1000);
+		if (thelio_io->target[channel] != thelio_io->duty[channel])
+			queue = true;
+	}
+
+	io_cmdq_unlock(&thelio_io->cmdq);
+
+	if (queue)
+		mod_delayed_work(thelio_io_wq, &thelio_io->duty_work, 0);
+
+	return regulating;
+}
+
+static void thelio_io_sample_work(struct work_struct *work)
+{
+	struct thelio_io_device *thelio_io = container_of(to_delayed_work(work),
+							  struct thelio_io_device, sample_work);
+	struct io_filter *filter;
+	bool valid[NUM_FANS] = {};
+	u16 tach[NUM_FANS];
+	bool active = false;
+	bool regulating;
+	bool pushed;
+	int channel;
+	int ret;
+
+	io_cmdq_lock(&thelio_io->cmdq, IO_CMDQ_READ);
 
-	ret = send_usb_cmd(thelio_io, CMD_FAN_SET, channel, val, 0);
+	for (channel = 0; channel < NUM_FANS; channel++) {
+		/* a ramp in progress is about to move the tach */
+		if (thelio_io->duty[channel] != thelio_io->target[channel])
+			active = true;
 
-	mutex_unlock(&thelio_io->mutex);
+		spin_lock_irq(&thelio_io->sample_lock);
+		pushed = thelio_io_pushed(thelio_io, channel);
+		if (pushed) {
+			tach[channel] = io_filter_last(&thelio_io->filters[channel]);
+			valid[channel] = true;
+		}
+		spin_unlock_irq(&thelio_io->sample_lock);
+		if (pushed)
+			continue;
+
+		ret = get_data_locked(thelio_io, THELIO_IO_CMD_FAN_TACH, channel, true);
+		if (ret < 0)
+			continue;
+
+		tach[channel] = ret;
+		valid[channel] = true;
+		filter = &thelio_io->filters[channel];
+		spin_lock_irq(&thelio_io->sample_lock);
+		if (filter->count && io_rate_changed(io_filter_last(filter), ret))
+			active = true;
+		io_filter_push(filter, ret, thelio_io->filter_window);
+		spin_unlock_irq(&thelio_io->sample_lock);
+	}
+
+	io_cmdq_unlock(&thelio_io->cmdq);
+
+	/* regulation runs at the shortest period for a steady loop rate */
+	regulating = thelio_io_pid_run(thelio_io, tach, valid);
+	if (regulating || io_rate_thermal(sample_thermal_zone, sample_thermal_temp))
+		active = true;
+
+	if (regulating || READ_ONCE(thelio_io->filter_mode) != IO_FILTER_NONE)
+		thelio_io_sample_schedule(thelio_io, io_rate_next(&thelio_io->rate, active));
+}
+
+/* returns the smoothed tach, or -ENODATA when unfiltered or not yet sampled */
+static int get_filtered_tach(struct thelio_io_device *thelio_io, int channel, long *val)
+{
+	u32 value;
+	int ret = -ENODATA;
+
+	spin_lock_irq(&thelio_io->sample_lock);
+	if (thelio_io->filter_mode != IO_FILTER_NONE)
+		ret = io_filter_value(&thelio_io->filters[channel], thelio_io->filter_mode,
+				      thelio_io->filter_window, 1, &value);
+	else if (thelio_io_pushed(thelio_io, channel))
+		ret = io_filter_value(&thelio_io->filters[channel], IO_FILTER_NONE,
+				      thelio_io->filter_window, 1, &value);
+	spin_unlock_irq(&thelio_io->sample_lock);
+
+	if (!ret)
+		*val = value;
 	return ret;
 }
 
@@ -178,10 +724,24 @@ static int thelio_io_read(struct device *dev, enum hwmon_sensor_types type,
 	case hwmon_fan:
 		switch (attr) {
 		case hwmon_fan_input:
-			ret = get_data(thelio_io, CMD_FAN_TACH, channel, true);
-			if (ret < 0)
+			io_rate_touch(&thelio_io->rate);
+			if (!get_filtered_tach(thelio_io, channel, val))
+				return 0;
+			return io_flight_do(&thelio_io->tach_flight[channel], fetch_tach,
+					    thelio_io, channel, val);
+		case hwmon_fan_alarm:
+			ret = io_cmdq_lock_killable(&thelio_io->cmdq);
+			if (ret)
+				return ret;
+			*val = thelio_io->alarm[channel] ? 1 : 0;
+			io_cmdq_unlock(&thelio_io->cmdq);
+			return 0;
+		case hwmon_fan_target:
+			ret = io_cmdq_lock_killable(&thelio_io->cmdq);
+			if (ret)
 				return ret;
-			*val = ret;
+			*val = thelio_io->pid[channel].target;
+			io_cmdq_unlock(&thelio_io->cmdq);
 			return 0;
 		default:
 			break;
@@ -190,11 +750,8 @@ static int thelio_io_read(struct device *dev, enum hwmon_sensor_types type,
 	case hwmon_pwm:
 		switch (attr) {
 		case hwmon_pwm_input:
-			ret = get_data(thelio_io, CMD_FAN_GET, channel, false);
-			if (ret < 0)
-				return ret;
-			*val = ret;
-			return 0;
+			return io_flight_do(&thelio_io->pwm_flight[channel], fetch_pwm,
+					    thelio_io, channel, val);
 		default:
 			break;
 		}
@@ -212,6 +769,14 @@ static int thelio_io_write(struct device *dev, enum hwmon_sensor_types type,
 	struct thelio_io_device *thelio_io = dev_get_drvdata(dev);
 
 	switch (type) {
+	case hwmon_fan:
+		switch (attr) {
+		case hwmon_fan_target:
+			return set_target(thelio_io, channel, val);
+		default:
+			break;
+		}
+		break;
 	case hwmon_pwm:
 		switch (attr) {
 		case hwmon_pwm_input:
@@ -237,6 +802,10 @@ static umode_t thelio_io_is_visible(const void *data, enum hwmon_sensor_types ty
 			return 0444;
 		case hwmon_fan_label:
 			return 0444;
+		case hwmon_fan_alarm:
+			return 0444;
+		case hwmon_fan_target:
+			return 0644;
 		default:
 			break;
 		}
@@ -267,10 +836,10 @@ static const struct hwmon_channel_info *thelio_io_info[] = {
 	HWMON_CHANNEL_INFO(chip,
 			   HWMON_C_REGISTER_TZ),
 	HWMON_CHANNEL_INFO(fan,
-			   HWMON_F_INPUT | HWMON_F_LABEL,
-			   HWMON_F_INPUT | HWMON_F_LABEL,
-			   HWMON_F_INPUT | HWMON_F_LABEL,
-			   HWMON_F_INPUT | HWMON_F_LABEL
+			   HWMON_F_INPUT | HWMON_F_LABEL | HWMON_F_ALARM | HWMON_F_TARGET,
+			   HWMON_F_INPUT | HWMON_F_LABEL | HWMON_F_ALARM | HWMON_F_TARGET,
+			   HWMON_F_INPUT | HWMON_F_LABEL | HWMON_F_ALARM | HWMON_F_TARGET,
+			   HWMON_F_INPUT | HWMON_F_LABEL | HWMON_F_ALARM | HWMON_F_TARGET
 			   ),
 	HWMON_CHANNEL_INFO(pwm,
 			   HWMON_PWM_INPUT,
@@ -286,7 +855,406 @@ static const struct hwmon_chip_info thelio_io_chip_info = {
 	.info = thelio_io_info,
 };
 
+static ssize_t fan_raw_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct thelio_io_device *thelio_io = dev_get_drvdata(dev);
+	int channel = to_sensor_dev_attr(attr)->index;
+	long val;
+	int ret;
+
+	ret = io_flight_do(&thelio_io->tach_flight[channel], fetch_tach, thelio_io, channel, &val);
+	if (ret)
+		return ret;
+
+	return sprintf(buf, "%ld\n", val);
+}
+
+static ssize_t fan_filter_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct thelio_io_device *thelio_io = dev_get_drvdata(dev);
+
+	return io_filter_mode_show(READ_ONCE(thelio_io->filter_mode), buf);
+}
+
+static ssize_t fan_filter_store(struct device *dev, struct device_attribute *attr,
+				const char *buf, size_t count)
+{
+	struct thelio_io_device *thelio_io = dev_get_drvdata(dev);
+	enum io_filter_mode mode;
+	bool start;
+	int ret;
+	int i;
+
+	ret = io_filter_mode_parse(buf, &mode);
+	if (ret)
+		return ret;
+
+	spin_lock_irq(&thelio_io->sample_lock);
+	start = thelio_io->filter_mode == IO_FILTER_NONE && mode != IO_FILTER_NONE;
+	if (start) {
+		for (i = 0; i < NUM_FANS; i++)
+			io_filter_reset(&thelio_io->filters[i]);
+	}
+	thelio_io->filter_mode = mode;
+	spin_unlock_irq(&thelio_io->sample_lock);
+
+	if (start)
+		mod_delayed_work(thelio_io_wq, &thelio_io->sample_work, 0);
+
+	return count;
+}
+
+static ssize_t fan_filter_window_show(struct device *dev, struct device_attribute *attr,
+				      char *buf)
+{
+	struct thelio_io_device *thelio_io = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%u\n", READ_ONCE(thelio_io->filter_window));
+}
+
+static ssize_t fan_filter_window_store(struct device *dev, struct device_attribute *attr,
+				       const char *buf, size_t count)
+{
+	struct thelio_io_device *thelio_io = dev_get_drvdata(dev);
+	unsigned int window;
+	int ret;
+
+	ret = io_filter_window_parse(buf, &window);
+	if (ret)
+		return ret;
+
+	spin_lock_irq(&thelio_io->sample_lock);
+	thelio_io->filter_window = window;
+	spin_unlock_irq(&thelio_io->sample_lock);
+
+	return count;
+}
+
+static ssize_t watchdog_store(struct device *dev, struct device_attribute *attr,
+			      const char *buf, size_t count)
+{
+	struct thelio_io_device *thelio_io = dev_get_drvdata(dev);
+
+	io_cmdq_lock(&thelio_io->cmdq, IO_CMDQ_WRITE);
+	thelio_io->watchdog_keepalive = jiffies;
+	io_cmdq_unlock(&thelio_io->cmdq);
+
+	return count;
+}
+
+static ssize_t watchdog_timeout_show(struct device *dev, struct device_attribute *attr,
+				     char *buf)
+{
+	struct thelio_io_device *thelio_io = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%u\n", READ_ONCE(thelio_io->watchdog_timeout));
+}
+
+static ssize_t watchdog_timeout_store(struct device *dev, struct device_attribute *attr,
+				      const char *buf, size_t count)
+{
+	struct thelio_io_device *thelio_io = dev_get_drvdata(dev);
+	unsigned int val;
+	int ret;
+
+	ret = kstrtouint(buf, 10, &val);
+	if (ret)
+		return ret;
+
+	if (val > 3600)
+		return -EINVAL;
+
+	io_cmdq_lock(&thelio_io->cmdq, IO_CMDQ_WRITE);
+	thelio_io->watchdog_timeout = val;
+	thelio_io->watchdog_keepalive = jiffies;
+	io_cmdq_unlock(&thelio_io->cmdq);
+
+	thelio_io_watchdog_schedule(thelio_io);
+
+	return count;
+}
+
+static ssize_t pwm_ramp_rate_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct thelio_io_device *thelio_io = dev_get_drvdata(dev);
+	int ret;
+
+	ret = io_cmdq_lock_killable(&thelio_io->cmdq);
+	if (ret)
+		return ret;
+	ret = sprintf(buf, "%u\n", thelio_io->ramp_rate[to_sensor_dev_attr(attr)->index]);
+	io_cmdq_unlock(&thelio_io->cmdq);
+
+	return ret;
+}
+
+static ssize_t pwm_ramp_rate_store(struct device *dev, struct device_attribute *attr,
+				   const char *buf, size_t count)
+{
+	struct thelio_io_device *thelio_io = dev_get_drvdata(dev);
+	unsigned int val;
+	int ret;
+
+	ret = kstrtouint(buf, 10, &val);
+	if (ret)
+		return ret;
+
+	/* anything above a full sweep per tick is the same as no limit */
+	if (val > 255 * 1000 / RAMP_TICK_MS)
+		return -EINVAL;
+
+	io_cmdq_lock(&thelio_io->cmdq, IO_CMDQ_WRITE);
+	thelio_io->ramp_rate[to_sensor_dev_attr(attr)->index] = val;
+	io_cmdq_unlock(&thelio_io->cmdq);
+
+	return count;
+}
+
+static SENSOR_DEVICE_ATTR_RO(fan1_raw, fan_raw, 0);
+static SENSOR_DEVICE_ATTR_RO(fan2_raw, fan_raw, 1);
+static SENSOR_DEVICE_ATTR_RO(fan3_raw, fan_raw, 2);
+static SENSOR_DEVICE_ATTR_RO(fan4_raw, fan_raw, 3);
+/* index selects kp, ki or kd */
+static int *fan_pid_gain(struct thelio_io_device *thelio_io, int index)
+{
+	switch (index) {
+	case 0:
+		return &thelio_io->pid_gains.kp;
+	case 1:
+		return &thelio_io->pid_gains.ki;
+	default:
+		return &thelio_io->pid_gains.kd;
+	}
+}
+
+static ssize_t fan_pid_gain_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct thelio_io_device *thelio_io = dev_get_drvdata(dev);
+	int ret;
+
+	ret = io_cmdq_lock_killable(&thelio_io->cmdq);
+	if (ret)
+		return ret;
+	ret = sprintf(buf, "%d\n", *fan_pid_gain(thelio_io, to_sensor_dev_attr(attr)->index));
+	io_cmdq_unlock(&thelio_io->cmdq);
+
+	return ret;
+}
+
+static ssize_t fan_pid_gain_store(struct device *dev, struct device_attribute *attr,
+				  const char *buf, size_t count)
+{
+	struct thelio_io_device *thelio_io = dev_get_drvdata(dev);
+	int gain;
+	int ret;
+
+	ret = io_pid_gain_parse(buf, &gain);
+	if (ret)
+		return ret;
+
+	io_cmdq_lock(&thelio_io->cmdq, IO_CMDQ_WRITE);
+	*fan_pid_gain(thelio_io, to_sensor_dev_attr(attr)->index) = gain;
+	io_cmdq_unlock(&thelio_io->cmdq);
+
+	return count;
+}
+
+static ssize_t fan_pid_windup_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct thelio_io_device *thelio_io = dev_get_drvdata(dev);
+	int ret;
+
+	ret = io_cmdq_lock_killable(&thelio_io->cmdq);
+	if (ret)
+		return ret;
+	ret = sprintf(buf, "%u\n", thelio_io->pid_gains.windup);
+	io_cmdq_unlock(&thelio_io->cmdq);
+
+	return ret;
+}
+
+static ssize_t fan_pid_windup_store(struct device *dev, struct device_attribute *attr,
+				    const char *buf, size_t count)
+{
+	struct thelio_io_device *thelio_io = dev_get_drvdata(dev);
+	unsigned int windup;
+	int ret;
+
+	ret = io_pid_windup_parse(buf, &windup);
+	if (ret)
+		return ret;
+
+	io_cmdq_lock(&thelio_io->cmdq, IO_CMDQ_WRITE);
+	thelio_io->pid_gains.windup = windup;
+	io_cmdq_unlock(&thelio_io->cmdq);
+
+	return count;
+}
+
+static SENSOR_DEVICE_ATTR_RW(pwm1_ramp_rate, pwm_ramp_rate, 0);
+static SENSOR_DEVICE_ATTR_RW(pwm2_ramp_rate, pwm_ramp_rate, 1);
+static SENSOR_DEVICE_ATTR_RW(pwm3_ramp_rate, pwm_ramp_rate, 2);
+static SENSOR_DEVICE_ATTR_RW(pwm4_ramp_rate, pwm_ramp_rate, 3);
+static ssize_t sample_min_ms_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct thelio_io_device *thelio_io = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%u\n", READ_ONCE(thelio_io->rate.min_ms));
+}
+
+static ssize_t sample_min_ms_store(struct device *dev, struct device_attribute *attr,
+				   const char *buf, size_t count)
+{
+	struct thelio_io_device *thelio_io = dev_get_drvdata(dev);
+	int ret;
+
+	ret = io_rate_min_parse(&thelio_io->rate, buf);
+	if (ret)
+		return ret;
+
+	/* do not leave a backed off sampler waiting out its old period */
+	if (READ_ONCE(thelio_io->filter_mode) != IO_FILTER_NONE)
+		mod_delayed_work(thelio_io_wq, &thelio_io->sample_work, 0);
+
+	return count;
+}
+
+static ssize_t sample_max_ms_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct thelio_io_device *thelio_io = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%u\n", READ_ONCE(thelio_io->rate.max_ms));
+}
+
+static ssize_t sample_max_ms_store(struct device *dev, struct device_attribute *attr,
+				   const char *buf, size_t count)
+{
+	struct thelio_io_device *thelio_io = dev_get_drvdata(dev);
+	int ret;
+
+	ret = io_rate_max_parse(&thelio_io->rate, buf);
+	if (ret)
+		return ret;
+
+	return count;
+}
+
+static DEVICE_ATTR_RW(fan_filter);
+static DEVICE_ATTR_RW(fan_filter_window);
+static DEVICE_ATTR_RW(sample_min_ms);
+static DEVICE_ATTR_RW(sample_max_ms);
+static SENSOR_DEVICE_ATTR_RW(fan_pid_kp, fan_pid_gain, 0);
+static SENSOR_DEVICE_ATTR_RW(fan_pid_ki, fan_pid_gain, 1);
+static SENSOR_DEVICE_ATTR_RW(fan_pid_kd, fan_pid_gain, 2);
+static DEVICE_ATTR_RW(fan_pid_windup);
+static DEVICE_ATTR_WO(watchdog);
+static DEVICE_ATTR_RW(watchdog_timeout);
+
+static struct attribute *thelio_io_attrs[] = {
+	&sensor_dev_attr_fan1_raw.dev_attr.attr,
+	&sensor_dev_attr_fan2_raw.dev_attr.attr,
+	&sensor_dev_attr_fan3_raw.dev_attr.attr,
+	&sensor_dev_attr_fan4_raw.dev_attr.attr,
+	&sensor_dev_attr_pwm1_ramp_rate.dev_attr.attr,
+	&sensor_dev_attr_pwm2_ramp_rate.dev_attr.attr,
+	&sensor_dev_attr_pwm3_ramp_rate.dev_attr.attr,
+	&sensor_dev_attr_pwm4_ramp_rate.dev_attr.attr,
+	&dev_attr_fan_filter.attr,
+	&dev_attr_fan_filter_window.attr,
+	&dev_attr_sample_min_ms.attr,
+	&dev_attr_sample_max_ms.attr,
+	&sensor_dev_attr_fan_pid_kp.dev_attr.attr,
+	&sensor_dev_attr_fan_pid_ki.dev_attr.attr,
+	&sensor_dev_attr_fan_pid_kd.dev_attr.attr,
+	&dev_attr_fan_pid_windup.attr,
+	&dev_attr_watchdog.attr,
+	&dev_attr_watchdog_timeout.attr,
+	NULL
+};
+
+ATTRIBUTE_GROUPS(thelio_io);
+
+/* called with cmdq held, sends the commanded state back after the board lost it */
+static void thelio_io_restore(struct thelio_io_device *thelio_io)
+{
+	int channel;
+
+	for (channel = 0; channel < NUM_FANS; channel++)
+		send_usb_cmd(thelio_io, THELIO_IO_CMD_FAN_SET, channel,
+			     thelio_io->duty[channel], 0);
+
+	if (thelio_io->suspended)
+		send_usb_cmd(thelio_io, THELIO_IO_CMD_LED_SET_MODE, 0, 1, 0);
+}
+
+static void thelio_io_shadow_store(struct thelio_io_device *thelio_io)
+{
+	struct io_shadow shadow = {};
+	int channel;
+
+	io_cmdq_lock(&thelio_io->cmdq, IO_CMDQ_WRITE);
+
+	strscpy(shadow.key, thelio_io->shadow_key, IO_SHADOW_KEY);
+	for (channel = 0; channel < NUM_FANS; channel++) {
+		/* an unfinished ramp resumes at its target */
+		shadow.duty[channel] = thelio_io->target[channel];
+		shadow.ramp_rate[channel] = thelio_io->ramp_rate[channel];
+	}
+	shadow.filter_mode = thelio_io->filter_mode;
+	shadow.filter_window = thelio_io->filter_window;
+	shadow.sample_min_ms = thelio_io->rate.min_ms;
+	shadow.sample_max_ms = thelio_io->rate.max_ms;
+	shadow.watchdog_timeout = thelio_io->watchdog_timeout;
+	shadow.suspended = thelio_io->suspended;
+
+	io_cmdq_unlock(&thelio_io->cmdq);
+
+	io_shadow_save(&shadow);
+}
+
+/*
+ * replays the state saved when this board was last removed, returns true if
+ * there was one
+ */
+static bool thelio_io_shadow_load(struct thelio_io_device *thelio_io)
+{
+	struct io_shadow shadow;
+	int channel;
+
+	BUILD_BUG_ON(NUM_FANS > IO_SHADOW_CHANNELS);
+
+	if (!io_shadow_take(thelio_io->shadow_key, &shadow))
+		return false;
+
+	io_cmdq_lock(&thelio_io->cmdq, IO_CMDQ_WRITE);
+
+	for (channel = 0; channel < NUM_FANS; channel++) {
+		thelio_io->duty[channel] = shadow.duty[channel];
+		thelio_io->target[channel] = thelio_io->duty[channel];
+		thelio_io->ramp_rate[channel] = shadow.ramp_rate[channel];
+	}
+	thelio_io->filter_mode = shadow.filter_mode;
+	thelio_io->filter_window = shadow.filter_window;
+	thelio_io->rate.min_ms = shadow.sample_min_ms;
+	thelio_io->rate.max_ms = shadow.sample_max_ms;
+	thelio_io->rate.period_ms = shadow.sample_min_ms;
+	thelio_io->watchdog_timeout = shadow.watchdog_timeout;
+	thelio_io->suspended = shadow.suspended;
+
+	thelio_io_restore(thelio_io);
+
+	io_cmdq_unlock(&thelio_io->cmdq);
+
+	return true;
+}
+
 #ifdef CONFIG_PM_SLEEP
+static int exec_led_suspend(struct io_exec *exec)
+{
+	return send_usb_cmd(exec->data, THELIO_IO_CMD_LED_SET_MODE, 0, exec->arg, 0);
+}
+
+/* thelio_io_exec_wq is freezable, these notifications come before the freeze and after the thaw */
 static int thelio_io_pm(struct notifier_block *nb, unsigned long action, void *data)
 {
 	struct thelio_io_device *thelio_io = container_of(nb, struct thelio_io_device, pm_notifier);
@@ -294,16 +1262,20 @@ static int thelio_io_pm(struct notifier_block *nb, unsigned long action, void *d
 	switch (action) {
 	case PM_HIBERNATION_PREPARE:
 	case PM_SUSPEND_PREPARE:
-		mutex_lock(&thelio_io->mutex);
-		send_usb_cmd(thelio_io, CMD_LED_SET_MODE, 0, 1, 0);
-		mutex_unlock(&thelio_io->mutex);
+		io_cmdq_lock(&thelio_io->cmdq, IO_CMDQ_WRITE);
+		thelio_io->suspended = true;
+		io_exec_call(thelio_io_exec_wq, exec_led_suspend, thelio_io, 1, NULL);
+		io_cmdq_unlock(&thelio_io->cmdq);
 		break;
 
 	case PM_POST_HIBERNATION:
 	case PM_POST_SUSPEND:
-		mutex_lock(&thelio_io->mutex);
-		send_usb_cmd(thelio_io, CMD_LED_SET_MODE, 0, 0, 0);
-		mutex_unlock(&thelio_io->mutex);
+		io_cmdq_lock(&thelio_io->cmdq, IO_CMDQ_WRITE);
+		thelio_io->suspended = false;
+		io_exec_call(thelio_io_exec_wq, exec_led_suspend, thelio_io, 0, NULL);
+		/* give userspace a full period to come back before the watchdog fires */
+		thelio_io->watchdog_keepalive = jiffies;
+		io_cmdq_unlock(&thelio_io->cmdq);
 		break;
 
 	case PM_POST_RESTORE:
@@ -316,17 +1288,43 @@ static int thelio_io_pm(struct notifier_block *nb, unsigned long action, void *d
 }
 #endif
 
+#ifdef CONFIG_PM
+/* the board lost power or was reset during suspend, replay the last state */
+static int thelio_io_reset_resume(struct hid_device *hdev)
+{
+	struct thelio_io_device *thelio_io = hid_get_drvdata(hdev);
+
+	if (thelio_io->hwmon_dev) {
+		io_cmdq_lock(&thelio_io->cmdq, IO_CMDQ_WRITE);
+		thelio_io_restore(thelio_io);
+		io_cmdq_unlock(&thelio_io->cmdq);
+	}
+
+	return 0;
+}
+#endif
+
 static int thelio_io_probe(struct hid_device *hdev, const struct hid_device_id *id)
 {
 	struct thelio_io_device *thelio_io;
+	bool restored;
 	int ret;
+	int i;
 
 	thelio_io = devm_kzalloc(&hdev->dev, sizeof(*thelio_io), GFP_KERNEL);
 	if (!thelio_io)
 		return -ENOMEM;
 
-	thelio_io->buffer = devm_kmalloc(&hdev->dev, BUFFER_SIZE, GFP_KERNEL);
-	if (!thelio_io->buffer)
+	/*
+	 * usbhid maps the output report buffer for DMA on every transfer, so it
+	 * needs its own allocation rather than living inside thelio_io.
+	 */
+	thelio_io->tx_buffer = devm_kzalloc(&hdev->dev, THELIO_IO_REPORT_SIZE, GFP_KERNEL);
+	if (!thelio_io->tx_buffer)
+		return -ENOMEM;
+
+	thelio_io->rx_buffer = devm_kzalloc(&hdev->dev, THELIO_IO_REPORT_SIZE, GFP_KERNEL);
+	if (!thelio_io->rx_buffer)
 		return -ENOMEM;
 
 	ret = hid_parse(hdev);
@@ -342,32 +1340,67 @@ static int thelio_io_probe(struct hid_device *hdev, const struct hid_device_id *
 		goto out_hw_stop;
 
 	thelio_io->hdev = hdev;
+	thelio_io->output_report = hid_hw_output_report;
 	hid_set_drvdata(hdev, thelio_io);
-	mutex_init(&thelio_io->mutex);
+	io_cmdq_init(&thelio_io->cmdq);
 	init_completion(&thelio_io->wait_input_report);
+	spin_lock_init(&thelio_io->report_lock);
+	spin_lock_init(&thelio_io->sample_lock);
+	INIT_DELAYED_WORK(&thelio_io->sample_work, thelio_io_sample_work);
+	INIT_DELAYED_WORK(&thelio_io->watchdog_work, thelio_io_watchdog_work);
+	INIT_DELAYED_WORK(&thelio_io->duty_work, thelio_io_duty_work);
+	io_capture_init(&thelio_io->capture);
+	io_latency_init(&thelio_io->latency);
+	io_rate_init(&thelio_io->rate, sample_interval);
+	io_pid_gains_init(&thelio_io->pid_gains);
+	for (i = 0; i < NUM_FANS; i++) {
+		io_flight_init(&thelio_io->tach_flight[i]);
+		io_flight_init(&thelio_io->pwm_flight[i]);
+	}
+	thelio_io->filter_mode = IO_FILTER_NONE;
+	thelio_io->filter_window = IO_FILTER_WINDOW;
 
 	hid_device_io_start(hdev);
 
-	if (hdev->maxcollection == 1 && hdev->collection[0].usage == 0xFF600061) {
+	if (hdev->maxcollection == 1 && hdev->collection[0].usage == THELIO_IO_USAGE) {
+		io_shadow_key(thelio_io->shadow_key, hdev->phys, hdev->uniq);
+		thelio_io_watchdog_init(thelio_io);
+		restored = thelio_io_shadow_load(thelio_io);
+		if (restored)
+			hid_info(hdev, "restored previous state\n");
+
 		thelio_io->hwmon_dev = hwmon_device_register_with_info(&hdev->dev,
 								       "system76_thelio_io",
 								       thelio_io,
 								       &thelio_io_chip_info,
-								       0);
+								       thelio_io_groups);
 		if (IS_ERR(thelio_io->hwmon_dev)) {
 			ret = PTR_ERR(thelio_io->hwmon_dev);
-			goto out_hw_close;
+			goto out_shadow;
 		}
 
 	#ifdef CONFIG_PM_SLEEP
 		thelio_io->pm_notifier.notifier_call = thelio_io_pm;
 		register_pm_notifier(&thelio_io->pm_notifier);
 	#endif
+
+		thelio_io->debugfs = debugfs_create_dir(dev_name(&hdev->dev), thelio_io_debugfs);
+		io_capture_debugfs(&thelio_io->capture, thelio_io->debugfs);
+		io_cmdq_debugfs(&thelio_io->cmdq, thelio_io->debugfs);
+		io_latency_debugfs(&thelio_io->latency, thelio_io->debugfs);
+		debugfs_create_u64("unsolicited", 0400, thelio_io->debugfs, &thelio_io->unsolicited);
+
+		thelio_io_watchdog_schedule(thelio_io);
+		if (thelio_io->filter_mode != IO_FILTER_NONE)
+			thelio_io_sample_schedule(thelio_io, 0);
 	}
 
 	return 0;
 
-out_hw_close:
+out_shadow:
+	/* keep the saved state for the next probe of this board */
+	if (restored)
+		thelio_io_shadow_store(thelio_io);
 	hid_hw_close(hdev);
 out_hw_stop:
 	hid_hw_stop(hdev);
@@ -380,6 +1413,11 @@ static void thelio_io_remove(struct hid_device *hdev)
 
 	if (thelio_io->hwmon_dev) {
 		hwmon_device_unregister(thelio_io->hwmon_dev);
+		debugfs_remove_recursive(thelio_io->debugfs);
+		cancel_delayed_work_sync(&thelio_io->sample_work);
+		cancel_delayed_work_sync(&thelio_io->watchdog_work);
+		cancel_delayed_work_sync(&thelio_io->duty_work);
+		thelio_io_shadow_store(thelio_io);
 
 	#ifdef CONFIG_PM_SLEEP
 		unregister_pm_notifier(&thelio_io->pm_notifier);
@@ -388,10 +1426,12 @@ static void thelio_io_remove(struct hid_device *hdev)
 
 	hid_hw_close(hdev);
 	hid_hw_stop(hdev);
+
+	io_capture_free(&thelio_io->capture);
 }
 
 static const struct hid_device_id thelio_io_devices[] = {
-	{ HID_USB_DEVICE(0x3384, 0x000B) }, /* thelio_io_2 */
+	{ HID_USB_DEVICE(THELIO_IO_VENDOR, THELIO_IO_DEVICE) }, /* thelio_io_2 */
 	{ }
 };
 
@@ -401,6 +1441,9 @@ static struct hid_driver thelio_io_driver = {
 	.probe = thelio_io_probe,
 	.remove = thelio_io_remove,
 	.raw_event = thelio_io_raw_event,
+#ifdef CONFIG_PM
+	.reset_resume = thelio_io_reset_resume,
+#endif
 };
 
 MODULE_DEVICE_TABLE(hid, thelio_io_devices);
@@ -408,12 +1451,37 @@ MODULE_LICENSE("GPL");
 
 static int __init thelio_io_init(void)
 {
-	return hid_register_driver(&thelio_io_driver);
+	int ret;
+
+	thelio_io_wq = io_wq_alloc("system76-thelio-io", workqueue, true);
+	if (!thelio_io_wq)
+		return -ENOMEM;
+
+	thelio_io_exec_wq = io_wq_alloc("system76-thelio-io-exec", workqueue, false);
+	if (!thelio_io_exec_wq) {
+		destroy_workqueue(thelio_io_wq);
+		return -ENOMEM;
+	}
+
+	thelio_io_debugfs = debugfs_create_dir("system76-thelio-io", NULL);
+
+	ret = hid_register_driver(&thelio_io_driver);
+	if (ret) {
+		debugfs_remove_recursive(thelio_io_debugfs);
+		destroy_workqueue(thelio_io_exec_wq);
+		destroy_workqueue(thelio_io_wq);
+	}
+
+	return ret;
 }
 
 static void __exit thelio_io_exit(void)
 {
 	hid_unregister_driver(&thelio_io_driver);
+	debugfs_remove_recursive(thelio_io_debugfs);
+	destroy_workqueue(thelio_io_exec_wq);
+	destroy_workqueue(thelio_io_wq);
+	io_shadow_clear();
 }
 
 /*
@@ -422,3 +1490,7 @@ static void __exit thelio_io_exit(void)
  */
 late_initcall(thelio_io_init);
 module_exit(thelio_io_exit);
+
+#ifdef SYSTEM76_IO_KUNIT
+#include "system76-thelio-io_kunit.c"
+#endif
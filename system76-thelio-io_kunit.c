@@ -0,0 +1,647 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ *
+ * system76-thelio-io_kunit.c - KUnit tests for system76-thelio-io
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * Included at the end of system76-thelio-io.c when built with make kunit.
+ * Each test gets a thelio_io_device whose output_report is a model of the
+ * board, answering through thelio_io_raw_event the way usbhid does when a
+ * reply arrives, so every path from the hwmon callbacks down to the report
+ * buffers runs unchanged without a board or a bound hid_device.
+ * The fragments shared with system76-io are tested by system76-io_kunit.c.
+ */
+
+#include <kunit/test.h>
+
+/* a reply later than this still arrives within REQ_TIMEOUT */
+#define THELIO_KUNIT_LATENCY_MS	20
+
+/* board model behind the output report, answers every report it is sent */
+struct thelio_mock {
+	u8 command[THELIO_IO_REPORT_SIZE];
+	unsigned int commands;
+	bool from_work;		/* the last report was sent from a workqueue */
+	u8 duty[NUM_FANS];
+	u16 tach[NUM_FANS];
+	u8 led_mode;
+	/* fault injection, latency_ms delays every reply */
+	unsigned int latency_ms;
+	int output_error;	/* returned by the transport, nothing reaches the board */
+	bool silent;		/* the board never answers */
+	u8 res;			/* result byte of every reply */
+	bool wrong_channel;	/* replies carry the next channel */
+	/* reply held back by a slow board */
+	struct hid_device *hdev;
+	u8 reply[THELIO_IO_REPORT_SIZE];
+	struct delayed_work reply_work;
+};
+
+static struct thelio_mock thelio_mock;
+
+static void thelio_mock_reply_work(struct work_struct *work)
+{
+	struct thelio_mock *mock = container_of(to_delayed_work(work), struct thelio_mock,
+						reply_work);
+
+	thelio_io_raw_event(mock->hdev, NULL, mock->reply, sizeof(mock->reply));
+}
+
+static int thelio_mock_output_report(struct hid_device *hdev, u8 *buf, size_t len)
+{
+	struct thelio_mock *mock = &thelio_mock;
+	u8 *reply = mock->reply;
+	int channel;
+
+	if (mock->output_error)
+		return mock->output_error;
+
+	memcpy(mock->command, buf, min_t(size_t, len, THELIO_IO_REPORT_SIZE));
+	mock->commands++;
+	mock->from_work = current_work() != NULL;
+
+	if (mock->silent)
+		return len;
+
+	memcpy(reply, mock->command, sizeof(mock->reply));
+	reply[THELIO_IO_REPORT_RES] = mock->res;
+	channel = reply[THELIO_IO_REPORT_DATA];
+
+	switch (reply[THELIO_IO_REPORT_CMD]) {
+	case THELIO_IO_CMD_FAN_GET:
+		if (channel < NUM_FANS)
+			reply[THELIO_IO_REPORT_DATA + 1] = mock->duty[channel];
+		break;
+	case THELIO_IO_CMD_FAN_SET:
+		if (channel < NUM_FANS && !mock->res)
+			mock->duty[channel] = reply[THELIO_IO_REPORT_DATA + 1];
+		break;
+	case THELIO_IO_CMD_FAN_TACH:
+		if (channel < NUM_FANS) {
+			reply[THELIO_IO_REPORT_DATA + 1] = mock->tach[channel] & 0xff;
+			reply[THELIO_IO_REPORT_DATA + 2] = mock->tach[channel] >> 8;
+		}
+		break;
+	case THELIO_IO_CMD_LED_SET_MODE:
+		if (!mock->res)
+			mock->led_mode = reply[THELIO_IO_REPORT_DATA + 1];
+		break;
+	default:
+		reply[THELIO_IO_REPORT_RES] = 1;
+		break;
+	}
+
+	if (mock->wrong_channel)
+		reply[THELIO_IO_REPORT_DATA] = (channel + 1) % NUM_FANS;
+
+	mock->hdev = hdev;
+	if (mock->latency_ms)
+		schedule_delayed_work(&mock->reply_work, msecs_to_jiffies(mock->latency_ms));
+	else
+		thelio_io_raw_event(hdev, NULL, reply, THELIO_IO_REPORT_SIZE);
+
+	return len;
+}
+
+struct thelio_kunit {
+	struct thelio_io_device *thelio_io;
+	struct device *dev;
+};
+
+static int thelio_kunit_init(struct kunit *test)
+{
+	struct thelio_io_device *thelio_io;
+	struct thelio_kunit *ctx;
+	struct hid_device *hdev;
+	int i;
+
+	memset(&thelio_mock, 0, sizeof(thelio_mock));
+	INIT_DELAYED_WORK(&thelio_mock.reply_work, thelio_mock_reply_work);
+
+	ctx = kunit_kzalloc(test, sizeof(*ctx), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, ctx);
+	ctx->dev = kunit_kzalloc(test, sizeof(*ctx->dev), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, ctx->dev);
+	hdev = kunit_kzalloc(test, sizeof(*hdev), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, hdev);
+	hdev->dev.init_name = "system76-thelio-io-kunit";
+	ctx->thelio_io = thelio_io = kunit_kzalloc(test, sizeof(*thelio_io), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, thelio_io);
+	thelio_io->tx_buffer = kunit_kzalloc(test, THELIO_IO_REPORT_SIZE, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, thelio_io->tx_buffer);
+	thelio_io->rx_buffer = kunit_kzalloc(test, THELIO_IO_REPORT_SIZE, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, thelio_io->rx_buffer);
+
+	/* as thelio_io_probe, without the transport and hwmon */
+	thelio_io->hdev = hdev;
+	thelio_io->output_report = thelio_mock_output_report;
+	hid_set_drvdata(hdev, thelio_io);
+	io_cmdq_init(&thelio_io->cmdq);
+	init_completion(&thelio_io->wait_input_report);
+	spin_lock_init(&thelio_io->report_lock);
+	spin_lock_init(&thelio_io->sample_lock);
+	INIT_DELAYED_WORK(&thelio_io->sample_work, thelio_io_sample_work);
+	INIT_DELAYED_WORK(&thelio_io->watchdog_work, thelio_io_watchdog_work);
+	INIT_DELAYED_WORK(&thelio_io->duty_work, thelio_io_duty_work);
+	io_capture_init(&thelio_io->capture);
+	io_latency_init(&thelio_io->latency);
+	io_rate_init(&thelio_io->rate, sample_interval);
+	io_pid_gains_init(&thelio_io->pid_gains);
+	for (i = 0; i < NUM_FANS; i++) {
+		io_flight_init(&thelio_io->tach_flight[i]);
+		io_flight_init(&thelio_io->pwm_flight[i]);
+	}
+	thelio_io->filter_mode = IO_FILTER_NONE;
+	thelio_io->filter_window = IO_FILTER_WINDOW;
+
+	dev_set_drvdata(ctx->dev, thelio_io);
+	test->priv = ctx;
+
+	return 0;
+}
+
+static void thelio_kunit_exit(struct kunit *test)
+{
+	struct thelio_kunit *ctx = test->priv;
+
+	cancel_delayed_work_sync(&ctx->thelio_io->sample_work);
+	cancel_delayed_work_sync(&ctx->thelio_io->watchdog_work);
+	cancel_delayed_work_sync(&ctx->thelio_io->duty_work);
+	cancel_delayed_work_sync(&thelio_mock.reply_work);
+	io_capture_free(&ctx->thelio_io->capture);
+}
+
+static int thelio_kunit_read(struct kunit *test, enum hwmon_sensor_types type, u32 attr,
+			     int channel, long *val)
+{
+	struct thelio_kunit *ctx = test->priv;
+
+	*val = -1;
+	return thelio_io_read(ctx->dev, type, attr, channel, val);
+}
+
+/* every read is one report on the wire */
+static void thelio_kunit_fan_input(struct kunit *test)
+{
+	struct thelio_kunit *ctx = test->priv;
+	long val;
+
+	thelio_mock.tach[0] = 1200;
+	thelio_mock.tach[3] = 0x1234;
+
+	KUNIT_EXPECT_EQ(test, thelio_kunit_read(test, hwmon_fan, hwmon_fan_input, 0, &val), 0);
+	KUNIT_EXPECT_EQ(test, val, 1200L);
+	KUNIT_EXPECT_EQ(test, thelio_mock.command[THELIO_IO_REPORT_CMD], THELIO_IO_CMD_FAN_TACH);
+	KUNIT_EXPECT_EQ(test, thelio_mock.command[THELIO_IO_REPORT_DATA], 0);
+	KUNIT_EXPECT_TRUE(test, thelio_mock.from_work);
+
+	/* both tach bytes, low byte first */
+	KUNIT_EXPECT_EQ(test, thelio_kunit_read(test, hwmon_fan, hwmon_fan_input, 3, &val), 0);
+	KUNIT_EXPECT_EQ(test, val, 0x1234L);
+	KUNIT_EXPECT_EQ(test, thelio_mock.command[THELIO_IO_REPORT_DATA], 3);
+	KUNIT_EXPECT_EQ(test, thelio_mock.commands, 2U);
+	KUNIT_EXPECT_EQ(test, ctx->thelio_io->cmdq.grants[IO_CMDQ_READ], 2ULL);
+	KUNIT_EXPECT_EQ(test, ctx->thelio_io->cmdq.grants[IO_CMDQ_WRITE], 0ULL);
+}
+
+static void thelio_kunit_read_other(struct kunit *test)
+{
+	struct thelio_kunit *ctx = test->priv;
+	long val;
+
+	thelio_mock.duty[1] = 128;
+	KUNIT_EXPECT_EQ(test, thelio_kunit_read(test, hwmon_pwm, hwmon_pwm_input, 1, &val), 0);
+	KUNIT_EXPECT_EQ(test, val, 128L);
+	KUNIT_EXPECT_EQ(test, thelio_mock.command[THELIO_IO_REPORT_CMD], THELIO_IO_CMD_FAN_GET);
+	KUNIT_EXPECT_EQ(test, thelio_mock.command[THELIO_IO_REPORT_DATA], 1);
+
+	/* served from driver state, nothing is sent */
+	thelio_mock.commands = 0;
+	ctx->thelio_io->alarm[2] = ALARM_STALL;
+	KUNIT_EXPECT_EQ(test, thelio_kunit_read(test, hwmon_fan, hwmon_fan_alarm, 2, &val), 0);
+	KUNIT_EXPECT_EQ(test, val, 1L);
+	KUNIT_EXPECT_EQ(test, thelio_kunit_read(test, hwmon_fan, hwmon_fan_alarm, 0, &val), 0);
+	KUNIT_EXPECT_EQ(test, val, 0L);
+	ctx->thelio_io->pid[0].target = 1500;
+	KUNIT_EXPECT_EQ(test, thelio_kunit_read(test, hwmon_fan, hwmon_fan_target, 0, &val), 0);
+	KUNIT_EXPECT_EQ(test, val, 1500L);
+
+	KUNIT_EXPECT_EQ(test, thelio_kunit_read(test, hwmon_fan, hwmon_fan_label, 0, &val),
+			-EOPNOTSUPP);
+	KUNIT_EXPECT_EQ(test, thelio_kunit_read(test, hwmon_pwm, hwmon_pwm_enable, 0, &val),
+			-EOPNOTSUPP);
+	KUNIT_EXPECT_EQ(test, thelio_kunit_read(test, hwmon_temp, hwmon_temp_input, 0, &val),
+			-EOPNOTSUPP);
+	KUNIT_EXPECT_EQ(test, thelio_mock.commands, 0U);
+}
+
+/* a tach report the board pushed stands in for a poll while it is fresh */
+static void thelio_kunit_fan_input_pushed(struct kunit *test)
+{
+	struct thelio_kunit *ctx = test->priv;
+	u8 report[THELIO_IO_REPORT_SIZE] = {
+		[THELIO_IO_REPORT_CMD] = THELIO_IO_CMD_FAN_TACH,
+		[THELIO_IO_REPORT_DATA] = 2,
+		[THELIO_IO_REPORT_DATA + 1] = 0x34,
+		[THELIO_IO_REPORT_DATA + 2] = 0x12,
+	};
+	long val;
+
+	thelio_io_raw_event(ctx->thelio_io->hdev, NULL, report, sizeof(report));
+	KUNIT_EXPECT_EQ(test, ctx->thelio_io->unsolicited, 1ULL);
+
+	KUNIT_EXPECT_EQ(test, thelio_kunit_read(test, hwmon_fan, hwmon_fan_input, 2, &val), 0);
+	KUNIT_EXPECT_EQ(test, val, 0x1234L);
+	KUNIT_EXPECT_EQ(test, thelio_mock.commands, 0U);
+
+	/* other channels still ask the board */
+	thelio_mock.tach[1] = 900;
+	KUNIT_EXPECT_EQ(test, thelio_kunit_read(test, hwmon_fan, hwmon_fan_input, 1, &val), 0);
+	KUNIT_EXPECT_EQ(test, val, 900L);
+	KUNIT_EXPECT_EQ(test, thelio_mock.commands, 1U);
+
+	/* too short to carry a tach, ignored */
+	thelio_io_raw_event(ctx->thelio_io->hdev, NULL, report, THELIO_IO_REPORT_DATA + 2);
+	KUNIT_EXPECT_EQ(test, ctx->thelio_io->unsolicited, 1ULL);
+}
+
+static void thelio_kunit_set_pwm(struct kunit *test)
+{
+	struct thelio_kunit *ctx = test->priv;
+	struct thelio_io_device *thelio_io = ctx->thelio_io;
+
+	KUNIT_EXPECT_EQ(test, set_pwm(thelio_io, 0, 200), 0);
+	KUNIT_EXPECT_EQ(test, thelio_mock.duty[0], 200);
+	KUNIT_EXPECT_EQ(test, thelio_mock.command[THELIO_IO_REPORT_CMD], THELIO_IO_CMD_FAN_SET);
+	KUNIT_EXPECT_EQ(test, thelio_mock.command[THELIO_IO_REPORT_DATA], 0);
+	KUNIT_EXPECT_EQ(test, thelio_mock.command[THELIO_IO_REPORT_DATA + 1], 200);
+	KUNIT_EXPECT_EQ(test, thelio_io->duty[0], 200);
+
+	KUNIT_EXPECT_EQ(test, set_pwm(thelio_io, 3, 255), 0);
+	KUNIT_EXPECT_EQ(test, thelio_mock.duty[3], 255);
+	KUNIT_EXPECT_EQ(test, set_pwm(thelio_io, 3, 0), 0);
+	KUNIT_EXPECT_EQ(test, thelio_mock.duty[3], 0);
+
+	/* the same value again is still sent */
+	thelio_mock.commands = 0;
+	KUNIT_EXPECT_EQ(test, set_pwm(thelio_io, 3, 0), 0);
+	KUNIT_EXPECT_EQ(test, thelio_mock.commands, 1U);
+	KUNIT_EXPECT_EQ(test, thelio_io->latency.count, 4ULL);
+
+	/* rejected values never reach the board */
+	KUNIT_EXPECT_EQ(test, set_pwm(thelio_io, 0, 256), -EINVAL);
+	KUNIT_EXPECT_EQ(test, set_pwm(thelio_io, 0, -1), -EINVAL);
+	KUNIT_EXPECT_EQ(test, thelio_mock.commands, 1U);
+}
+
+/* a slow ramp moves by ramp_rate on average, one report per tick */
+static void thelio_kunit_ramp(struct kunit *test)
+{
+	struct thelio_kunit *ctx = test->priv;
+	struct thelio_io_device *thelio_io = ctx->thelio_io;
+	int i;
+
+	thelio_io->ramp_rate[0] = 10;
+	KUNIT_EXPECT_EQ(test, set_pwm(thelio_io, 0, 100), 0);
+	cancel_delayed_work_sync(&thelio_io->duty_work);
+	KUNIT_EXPECT_EQ(test, thelio_io->target[0], 100);
+
+	/* 10 PWM/s is half a step per tick */
+	for (i = 0; i < 3; i++) {
+		thelio_io_duty_work(&thelio_io->duty_work.work);
+		cancel_delayed_work_sync(&thelio_io->duty_work);
+	}
+	KUNIT_EXPECT_EQ(test, thelio_io->duty[0], 1);
+	KUNIT_EXPECT_EQ(test, thelio_mock.duty[0], 1);
+	KUNIT_EXPECT_EQ(test, thelio_io->ramp_carry[0], 500U);
+	KUNIT_EXPECT_EQ(test, thelio_mock.commands, 3U);
+
+	/* reaching the target drops the remainder */
+	KUNIT_EXPECT_EQ(test, set_pwm(thelio_io, 0, 1), 0);
+	cancel_delayed_work_sync(&thelio_io->duty_work);
+	thelio_io_duty_work(&thelio_io->duty_work.work);
+	KUNIT_EXPECT_EQ(test, thelio_io->ramp_carry[0], 0U);
+	KUNIT_EXPECT_EQ(test, thelio_mock.commands, 4U);
+}
+
+/* a ramp the board keeps refusing stops where it is and raises fanN_alarm */
+static void thelio_kunit_ramp_faults(struct kunit *test)
+{
+	struct thelio_kunit *ctx = test->priv;
+	struct thelio_io_device *thelio_io = ctx->thelio_io;
+	long val;
+	int i;
+
+	thelio_io->ramp_rate[0] = 10;
+	KUNIT_EXPECT_EQ(test, set_pwm(thelio_io, 0, 100), 0);
+	cancel_delayed_work_sync(&thelio_io->duty_work);
+
+	thelio_mock.output_error = -EPIPE;
+	for (i = 0; i < RAMP_RETRIES; i++) {
+		KUNIT_EXPECT_EQ(test, thelio_io->target[0], 100);
+		thelio_io_duty_work(&thelio_io->duty_work.work);
+		cancel_delayed_work_sync(&thelio_io->duty_work);
+	}
+	KUNIT_EXPECT_EQ(test, thelio_io->target[0], thelio_io->duty[0]);
+	KUNIT_EXPECT_EQ(test, thelio_io->duty_result[0], -EPIPE);
+	KUNIT_EXPECT_EQ(test, thelio_io->capture.errors, (u64)RAMP_RETRIES);
+
+	/* nothing is left to retry */
+	thelio_io_duty_work(&thelio_io->duty_work.work);
+	KUNIT_EXPECT_FALSE(test, delayed_work_pending(&thelio_io->duty_work));
+	KUNIT_EXPECT_EQ(test, thelio_io->capture.commands, (u64)RAMP_RETRIES);
+
+	KUNIT_EXPECT_EQ(test, thelio_kunit_read(test, hwmon_fan, hwmon_fan_alarm, 0, &val), 0);
+	KUNIT_EXPECT_EQ(test, val, 1L);
+
+	/* the next write clears it */
+	thelio_mock.output_error = 0;
+	thelio_io->ramp_rate[0] = 0;
+	KUNIT_EXPECT_EQ(test, set_pwm(thelio_io, 0, 50), 0);
+	KUNIT_EXPECT_EQ(test, thelio_kunit_read(test, hwmon_fan, hwmon_fan_alarm, 0, &val), 0);
+	KUNIT_EXPECT_EQ(test, val, 0L);
+}
+
+/*
+ * fanN_target hands a channel to the regulator, each sampler tick then costs
+ * one tach per fan and one duty for the channel it moves
+ */
+static void thelio_kunit_fan_target(struct kunit *test)
+{
+	struct thelio_kunit *ctx = test->priv;
+	struct thelio_io_device *thelio_io = ctx->thelio_io;
+	int i;
+
+	for (i = 0; i < NUM_FANS; i++)
+		thelio_mock.tach[i] = 2000;
+	thelio_mock.tach[1] = 500;
+
+	KUNIT_EXPECT_EQ(test, set_target(thelio_io, 1, 1200), 0);
+	cancel_delayed_work_sync(&thelio_io->sample_work);
+	KUNIT_EXPECT_EQ(test, thelio_io->pid[1].target, 1200U);
+	KUNIT_EXPECT_EQ(test, thelio_mock.commands, 0U);
+
+	/* 500 RPM is below target, the duty goes up */
+	thelio_io_sample_work(&thelio_io->sample_work.work);
+	cancel_delayed_work_sync(&thelio_io->sample_work);
+	flush_delayed_work(&thelio_io->duty_work);
+	KUNIT_EXPECT_GT(test, thelio_io->target[1], 0);
+	KUNIT_EXPECT_EQ(test, thelio_mock.duty[1], thelio_io->target[1]);
+	KUNIT_EXPECT_EQ(test, thelio_mock.commands, NUM_FANS + 1U);
+
+	KUNIT_EXPECT_EQ(test, set_target(thelio_io, 1, IO_PID_TARGET_MAX + 1), -EINVAL);
+	KUNIT_EXPECT_EQ(test, thelio_io->pid[1].target, 1200U);
+
+	/* a direct duty takes the channel back */
+	KUNIT_EXPECT_EQ(test, set_pwm(thelio_io, 1, 128), 0);
+	KUNIT_EXPECT_EQ(test, thelio_io->pid[1].target, 0U);
+	KUNIT_EXPECT_EQ(test, thelio_mock.commands, NUM_FANS + 2U);
+}
+
+/* a failed write is reported to the writer and the shadow keeps the old duty, takes REQ_TIMEOUT */
+static void thelio_kunit_set_pwm_faults(struct kunit *test)
+{
+	struct thelio_kunit *ctx = test->priv;
+	struct thelio_io_device *thelio_io = ctx->thelio_io;
+
+	KUNIT_EXPECT_EQ(test, set_pwm(thelio_io, 1, 100), 0);
+
+	thelio_mock.output_error = -EPIPE;
+	KUNIT_EXPECT_EQ(test, set_pwm(thelio_io, 1, 150), -EPIPE);
+	KUNIT_EXPECT_EQ(test, thelio_io->duty[1], 100);
+	KUNIT_EXPECT_EQ(test, thelio_io->target[1], 100);
+	thelio_mock.output_error = 0;
+
+	thelio_mock.res = 1;
+	KUNIT_EXPECT_EQ(test, set_pwm(thelio_io, 1, 150), -EIO);
+	KUNIT_EXPECT_EQ(test, thelio_mock.duty[1], 100);
+	KUNIT_EXPECT_EQ(test, thelio_io->duty[1], 100);
+	thelio_mock.res = 0;
+
+	thelio_mock.silent = true;
+	KUNIT_EXPECT_EQ(test, set_pwm(thelio_io, 1, 150), -ETIMEDOUT);
+	KUNIT_EXPECT_EQ(test, thelio_io->duty[1], 100);
+	thelio_mock.silent = false;
+
+	KUNIT_EXPECT_EQ(test, set_pwm(thelio_io, 1, 150), 0);
+	KUNIT_EXPECT_EQ(test, thelio_mock.duty[1], 150);
+	KUNIT_EXPECT_EQ(test, thelio_io->duty[1], 150);
+
+	/* no retries, the failed report never reached the board */
+	KUNIT_EXPECT_EQ(test, thelio_mock.commands, 4U);
+	KUNIT_EXPECT_EQ(test, thelio_io->capture.commands, 5ULL);
+	KUNIT_EXPECT_EQ(test, thelio_io->capture.errors, 3ULL);
+}
+
+static void thelio_kunit_get_errno(struct kunit *test)
+{
+	struct thelio_kunit *ctx = test->priv;
+	struct thelio_io_device *thelio_io = ctx->thelio_io;
+	long val;
+
+	thelio_io->rx_buffer[THELIO_IO_REPORT_RES] = 0x00;
+	KUNIT_EXPECT_EQ(test, thelio_io_get_errno(thelio_io), 0);
+	thelio_io->rx_buffer[THELIO_IO_REPORT_RES] = 0x01;
+	KUNIT_EXPECT_EQ(test, thelio_io_get_errno(thelio_io), -EIO);
+	thelio_io->rx_buffer[THELIO_IO_REPORT_RES] = 0xff;
+	KUNIT_EXPECT_EQ(test, thelio_io_get_errno(thelio_io), -EIO);
+
+	/* through the read path */
+	thelio_mock.res = 2;
+	KUNIT_EXPECT_EQ(test, thelio_kunit_read(test, hwmon_fan, hwmon_fan_input, 0, &val), -EIO);
+	KUNIT_EXPECT_EQ(test, thelio_kunit_read(test, hwmon_pwm, hwmon_pwm_input, 0, &val), -EIO);
+}
+
+/* takes REQ_TIMEOUT per case */
+static void thelio_kunit_timeout(struct kunit *test)
+{
+	struct thelio_kunit *ctx = test->priv;
+	long val;
+
+	thelio_mock.silent = true;
+	KUNIT_EXPECT_EQ(test, thelio_kunit_read(test, hwmon_fan, hwmon_fan_input, 0, &val),
+			-ETIMEDOUT);
+	thelio_mock.silent = false;
+
+	/* a report for another channel is not the reply, it counts as pushed */
+	thelio_mock.wrong_channel = true;
+	KUNIT_EXPECT_EQ(test, thelio_kunit_read(test, hwmon_pwm, hwmon_pwm_input, 0, &val),
+			-ETIMEDOUT);
+	KUNIT_EXPECT_EQ(test, ctx->thelio_io->unsolicited, 1ULL);
+	thelio_mock.wrong_channel = false;
+
+	/* nothing pending is left behind for the next command */
+	thelio_mock.duty[0] = 42;
+	KUNIT_EXPECT_EQ(test, thelio_kunit_read(test, hwmon_pwm, hwmon_pwm_input, 0, &val), 0);
+	KUNIT_EXPECT_EQ(test, val, 42L);
+	KUNIT_EXPECT_FALSE(test, ctx->thelio_io->pending);
+	KUNIT_EXPECT_EQ(test, thelio_mock.commands, 3U);
+}
+
+/*
+ * a slow board costs one report per read, a board slower than REQ_TIMEOUT
+ * times out and its late reply is not taken for the next one, takes REQ_TIMEOUT
+ */
+static void thelio_kunit_latency(struct kunit *test)
+{
+	struct thelio_kunit *ctx = test->priv;
+	long val;
+	int i;
+
+	thelio_mock.tach[0] = 1200;
+	thelio_mock.latency_ms = THELIO_KUNIT_LATENCY_MS;
+	for (i = 0; i < 5; i++) {
+		KUNIT_EXPECT_EQ(test, thelio_kunit_read(test, hwmon_fan, hwmon_fan_input, 0, &val), 0);
+		KUNIT_EXPECT_EQ(test, val, 1200L);
+	}
+	KUNIT_EXPECT_EQ(test, thelio_mock.commands, 5U);
+
+	thelio_mock.latency_ms = REQ_TIMEOUT + REQ_TIMEOUT / 2;
+	KUNIT_EXPECT_EQ(test, thelio_kunit_read(test, hwmon_fan, hwmon_fan_input, 0, &val),
+			-ETIMEDOUT);
+	flush_delayed_work(&thelio_mock.reply_work);
+	KUNIT_EXPECT_EQ(test, ctx->thelio_io->unsolicited, 1ULL);
+
+	thelio_mock.latency_ms = 0;
+	thelio_mock.duty[2] = 77;
+	KUNIT_EXPECT_EQ(test, thelio_kunit_read(test, hwmon_pwm, hwmon_pwm_input, 2, &val), 0);
+	KUNIT_EXPECT_EQ(test, val, 77L);
+	KUNIT_EXPECT_EQ(test, thelio_mock.commands, 7U);
+}
+
+/* each report is one record, a failed one without a reply */
+static void thelio_kunit_capture(struct kunit *test)
+{
+	struct thelio_kunit *ctx = test->priv;
+	struct io_capture *capture = &ctx->thelio_io->capture;
+	struct io_capture_record *record;
+	long val;
+
+	KUNIT_ASSERT_EQ(test, io_capture_enable_set(capture, 1), 0);
+	thelio_mock.tach[1] = 0x0456;
+	KUNIT_EXPECT_EQ(test, thelio_kunit_read(test, hwmon_fan, hwmon_fan_input, 1, &val), 0);
+	thelio_mock.output_error = -EPIPE;
+	KUNIT_EXPECT_EQ(test, set_pwm(ctx->thelio_io, 1, 10), -EPIPE);
+	thelio_mock.output_error = 0;
+	KUNIT_ASSERT_EQ(test, capture->count, 2U);
+
+	record = &capture->records[0];
+	KUNIT_EXPECT_EQ(test, record->result, 0);
+	KUNIT_EXPECT_EQ(test, record->tx[THELIO_IO_REPORT_CMD], THELIO_IO_CMD_FAN_TACH);
+	KUNIT_EXPECT_EQ(test, record->rx_len, THELIO_IO_REPORT_SIZE);
+	KUNIT_EXPECT_EQ(test, record->rx[THELIO_IO_REPORT_DATA + 1], 0x56);
+	KUNIT_EXPECT_EQ(test, record->rx[THELIO_IO_REPORT_DATA + 2], 0x04);
+
+	record = &capture->records[1];
+	KUNIT_EXPECT_EQ(test, record->result, -EPIPE);
+	KUNIT_EXPECT_EQ(test, record->tx[THELIO_IO_REPORT_CMD], THELIO_IO_CMD_FAN_SET);
+	KUNIT_EXPECT_EQ(test, record->rx_len, 0);
+}
+
+/* a board that comes back on the same port gets its state replayed, once */
+static void thelio_kunit_shadow(struct kunit *test)
+{
+	struct thelio_kunit *ctx = test->priv;
+	struct thelio_io_device *thelio_io = ctx->thelio_io;
+	int channel;
+
+	io_shadow_key(thelio_io->shadow_key, "kunit-1.2/input0", "kunit");
+	for (channel = 0; channel < NUM_FANS; channel++) {
+		thelio_io->duty[channel] = 50 + channel;
+		thelio_io->target[channel] = 50 + channel;
+	}
+	/* an unfinished ramp comes back at its target */
+	thelio_io->target[0] = 200;
+	thelio_io->ramp_rate[0] = 10;
+	thelio_io->suspended = true;
+	thelio_io_shadow_store(thelio_io);
+
+	memset(thelio_io->duty, 0, sizeof(thelio_io->duty));
+	memset(thelio_io->target, 0, sizeof(thelio_io->target));
+	memset(thelio_io->ramp_rate, 0, sizeof(thelio_io->ramp_rate));
+	thelio_io->suspended = false;
+
+	KUNIT_EXPECT_TRUE(test, thelio_io_shadow_load(thelio_io));
+	KUNIT_EXPECT_EQ(test, thelio_io->duty[0], 200);
+	KUNIT_EXPECT_EQ(test, thelio_io->target[0], 200);
+	KUNIT_EXPECT_EQ(test, thelio_io->ramp_rate[0], 10U);
+	KUNIT_EXPECT_TRUE(test, thelio_io->suspended);
+
+	/* one duty per channel and the suspend mode */
+	KUNIT_EXPECT_EQ(test, thelio_mock.duty[0], 200);
+	for (channel = 1; channel < NUM_FANS; channel++)
+		KUNIT_EXPECT_EQ(test, thelio_mock.duty[channel], 50 + channel);
+	KUNIT_EXPECT_EQ(test, thelio_mock.led_mode, 1);
+	KUNIT_EXPECT_EQ(test, thelio_mock.commands, NUM_FANS + 1U);
+
+	KUNIT_EXPECT_FALSE(test, thelio_io_shadow_load(thelio_io));
+	KUNIT_EXPECT_EQ(test, thelio_mock.commands, NUM_FANS + 1U);
+}
+
+#ifdef CONFIG_PM_SLEEP
+static void thelio_kunit_pm(struct kunit *test)
+{
+	struct thelio_kunit *ctx = test->priv;
+	struct thelio_io_device *thelio_io = ctx->thelio_io;
+	struct notifier_block *nb = &thelio_io->pm_notifier;
+
+	KUNIT_EXPECT_EQ(test, thelio_io_pm(nb, PM_SUSPEND_PREPARE, NULL), NOTIFY_DONE);
+	KUNIT_EXPECT_TRUE(test, thelio_io->suspended);
+	KUNIT_EXPECT_EQ(test, thelio_mock.command[THELIO_IO_REPORT_CMD], THELIO_IO_CMD_LED_SET_MODE);
+	KUNIT_EXPECT_EQ(test, thelio_mock.led_mode, 1);
+	KUNIT_EXPECT_TRUE(test, thelio_mock.from_work);
+
+	thelio_io->watchdog_keepalive = jiffies - HZ;
+	KUNIT_EXPECT_EQ(test, thelio_io_pm(nb, PM_POST_SUSPEND, NULL), NOTIFY_DONE);
+	KUNIT_EXPECT_FALSE(test, thelio_io->suspended);
+	KUNIT_EXPECT_EQ(test, thelio_mock.led_mode, 0);
+	KUNIT_EXPECT_TRUE(test, time_after(thelio_io->watchdog_keepalive, jiffies - HZ));
+
+	KUNIT_EXPECT_EQ(test, thelio_io_pm(nb, PM_HIBERNATION_PREPARE, NULL), NOTIFY_DONE);
+	KUNIT_EXPECT_TRUE(test, thelio_io->suspended);
+	KUNIT_EXPECT_EQ(test, thelio_mock.led_mode, 1);
+	KUNIT_EXPECT_EQ(test, thelio_io_pm(nb, PM_POST_HIBERNATION, NULL), NOTIFY_DONE);
+	KUNIT_EXPECT_FALSE(test, thelio_io->suspended);
+	KUNIT_EXPECT_EQ(test, thelio_mock.led_mode, 0);
+	KUNIT_EXPECT_EQ(test, thelio_mock.commands, 4U);
+
+	/* restore notifications send nothing */
+	thelio_io_pm(nb, PM_RESTORE_PREPARE, NULL);
+	thelio_io_pm(nb, PM_POST_RESTORE, NULL);
+	KUNIT_EXPECT_EQ(test, thelio_mock.commands, 4U);
+
+	/* a board that fails to suspend does not stop the system from suspending */
+	thelio_mock.output_error = -ENODEV;
+	KUNIT_EXPECT_EQ(test, thelio_io_pm(nb, PM_SUSPEND_PREPARE, NULL), NOTIFY_DONE);
+	KUNIT_EXPECT_TRUE(test, thelio_io->suspended);
+}
+#endif
+
+static struct kunit_case thelio_kunit_cases[] = {
+	KUNIT_CASE(thelio_kunit_fan_input),
+	KUNIT_CASE(thelio_kunit_read_other),
+	KUNIT_CASE(thelio_kunit_fan_input_pushed),
+	KUNIT_CASE(thelio_kunit_set_pwm),
+	KUNIT_CASE(thelio_kunit_set_pwm_faults),
+	KUNIT_CASE(thelio_kunit_ramp),
+	KUNIT_CASE(thelio_kunit_ramp_faults),
+	KUNIT_CASE(thelio_kunit_fan_target),
+	KUNIT_CASE(thelio_kunit_get_errno),
+	KUNIT_CASE(thelio_kunit_timeout),
+	KUNIT_CASE(thelio_kunit_latency),
+	KUNIT_CASE(thelio_kunit_capture),
+	KUNIT_CASE(thelio_kunit_shadow),
+#ifdef CONFIG_PM_SLEEP
+	KUNIT_CASE(thelio_kunit_pm),
+#endif
+	{}
+};
+
+static struct kunit_suite thelio_kunit_suite = {
+	.name = "system76-thelio-io",
+	.init = thelio_kunit_init,
+	.exit = thelio_kunit_exit,
+	.test_cases = thelio_kunit_cases,
+};
+
+kunit_test_suite(thelio_kunit_suite);
@@ -0,0 +1,189 @@
+/*
+ * bench-parser.c
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This program is free software;  you can redistribute it and/or modify
+ * it under the terms of the  GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is  distributed in the hope that it  will be useful, but
+ * WITHOUT  ANY   WARRANTY;  without   even  the  implied   warranty  of
+ * MERCHANTABILITY  or FITNESS FOR  A PARTICULAR  PURPOSE.  See  the GNU
+ * General Public License for more details.
+ *
+ * You should  have received  a copy of  the GNU General  Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Throughput of the Io line protocol parser in system76-io_parser.c. A
+ * stream of typical replies (IoTACH and IoDUTY values, bare OK, revision,
+ * ERROR) is cut into bulk IN packets of IO_MSG_SIZE bytes, or of the size
+ * given with -c, and fed through io_parser_feed as io_dev_exchange does.
+ * Prints ns/byte and responses/sec over the best of -r runs.
+ */
+
+#include <time.h>
+#include <unistd.h>
+
+#include "kshim.h"
+
+#include "../system76-io_proto.h"
+#include "../system76-io_parser.c"
+
+#define REPLIES		4096
+
+static const char * const replies[] = {
+	"\r\n0A3C\r\n\r\n" IO_REPLY_OK "\r\n",
+	"\r\n1F40\r\n\r\n" IO_REPLY_OK "\r\n",
+	"\r\n" IO_REPLY_OK "\r\n",
+	"\r\n0A41\r\n\r\n" IO_REPLY_OK "\r\n",
+	"\r\n" IO_REPLY_OK "\r\n",
+	"\r\n1.2.3\r\n\r\n" IO_REPLY_OK "\r\n",
+	"\r\n" IO_REPLY_ERROR "\r\n\r\n" IO_REPLY_OK "\r\n",
+	"\r\n0000\r\n\r\n" IO_REPLY_OK "\r\n",
+};
+
+struct packet {
+	const char *data;
+	size_t len;
+	bool last; /* final packet of a reply */
+};
+
+static volatile char sink;
+
+static double now(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* one reply never shares a packet with the next, as on the wire */
+static size_t build(char *stream, struct packet *packets, size_t chunk, size_t *bytes)
+{
+	size_t count = 0;
+	size_t off = 0;
+	size_t len;
+	size_t pos;
+	int i;
+
+	for (i = 0; i < REPLIES; i++) {
+		len = strlen(replies[i % ARRAY_SIZE(replies)]);
+		memcpy(stream + off, replies[i % ARRAY_SIZE(replies)], len);
+		for (pos = 0; pos < len; pos += chunk) {
+			packets[count].data = stream + off + pos;
+			packets[count].len = min(chunk, len - pos);
+			packets[count].last = pos + chunk >= len;
+			count++;
+		}
+		off += len;
+	}
+
+	*bytes = off;
+	return count;
+}
+
+static unsigned long run(const struct packet *packets, size_t count)
+{
+	struct io_parser parser;
+	unsigned long done = 0;
+	const char *error;
+	size_t i;
+	int result;
+
+	io_parser_init(&parser);
+	for (i = 0; i < count; i++) {
+		result = io_parser_feed(&parser, packets[i].data, packets[i].len, &error);
+		if (result < 0) {
+			fprintf(stderr, "parse error: %s\n", error);
+			exit(1);
+		}
+		if (result == 1) {
+			/* keep the reply lookup in the measured path */
+			sink = io_parser_reply(&parser)[0];
+			done++;
+			io_parser_init(&parser);
+		} else if (packets[i].last) {
+			fprintf(stderr, "reply did not complete\n");
+			exit(1);
+		}
+	}
+
+	return done;
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr, "usage: %s [-c packet_size] [-n passes] [-r runs]\n", argv0);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	static char stream[REPLIES * 32];
+	static struct packet packets[REPLIES * 32];
+	unsigned long passes = 2000;
+	unsigned long responses;
+	unsigned long runs = 5;
+	unsigned long pass;
+	unsigned long r;
+	size_t chunk = IO_MSG_SIZE;
+	size_t count;
+	size_t bytes;
+	double best = 0;
+	double cpu = 0;
+	double start;
+	double t;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "c:n:r:")) != -1) {
+		switch (opt) {
+		case 'c':
+			chunk = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			passes = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			runs = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (chunk < 1 || chunk > IO_MSG_SIZE || !passes || !runs)
+		usage(argv[0]);
+
+	count = build(stream, packets, chunk, &bytes);
+
+	for (r = 0; r < runs; r++) {
+		responses = 0;
+		start = now(CLOCK_PROCESS_CPUTIME_ID);
+		t = now(CLOCK_MONOTONIC);
+		for (pass = 0; pass < passes; pass++)
+			responses += run(packets, count);
+		t = now(CLOCK_MONOTONIC) - t;
+		if (responses != (unsigned long)REPLIES * passes) {
+			fprintf(stderr, "%lu of %lu replies parsed\n", responses,
+				(unsigned long)REPLIES * passes);
+			return 1;
+		}
+		if (!r || t < best) {
+			best = t;
+			cpu = now(CLOCK_PROCESS_CPUTIME_ID) - start;
+		}
+	}
+
+	printf("packet size     %zu bytes\n", chunk);
+	printf("stream          %zu bytes, %d replies, %zu packets\n", bytes, REPLIES, count);
+	printf("ns/byte         %.3f\n", best * 1e9 / ((double)bytes * passes));
+	printf("ns/response     %.1f\n", best * 1e9 / ((double)REPLIES * passes));
+	printf("responses/sec   %.0f\n", (double)REPLIES * passes / best);
+	printf("cpu/wall        %.2f\n", cpu / best);
+
+	return 0;
+}
@@ -0,0 +1,149 @@
+/*
+ * fuzz-parser.c
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This program is free software;  you can redistribute it and/or modify
+ * it under the terms of the  GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is  distributed in the hope that it  will be useful, but
+ * WITHOUT  ANY   WARRANTY;  without   even  the  implied   warranty  of
+ * MERCHANTABILITY  or FITNESS FOR  A PARTICULAR  PURPOSE.  See  the GNU
+ * General Public License for more details.
+ *
+ * You should  have received  a copy of  the GNU General  Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Fuzz target for the Io line protocol parser in system76-io_parser.c.
+ *
+ * The first input byte selects how the rest is cut into bulk IN packets:
+ * byte % IO_MSG_SIZE bytes per packet, or the whole input in one feed when
+ * that is 0. The packets are fed the way io_dev_exchange feeds them, with
+ * the parser restarted after every complete reply or framing error, and
+ * any broken invariant aborts.
+ *
+ * Built with -DIO_FUZZ_LIBFUZZER this is a libFuzzer target. Otherwise it
+ * has a main that runs each file named on the command line, or stdin when
+ * there are none, which suits afl-fuzz in either input mode and replaying
+ * a corpus by hand.
+ */
+
+#include "kshim.h"
+
+#include "../system76-io_proto.h"
+#include "../system76-io_parser.c"
+
+#define CHECK(cond)							\
+	do {								\
+		if (!(cond)) {						\
+			fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+			abort();					\
+		}							\
+	} while (0)
+
+static void check_state(const struct io_parser *parser)
+{
+	CHECK(parser->lines_i >= 0 && parser->lines_i <= 2);
+	CHECK(parser->line_i >= 0 && parser->line_i <= IO_MSG_SIZE);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	struct io_parser parser;
+	const char *error;
+	const char *reply;
+	size_t chunk;
+	size_t len;
+	int result;
+
+	if (size < 1)
+		return 0;
+
+	chunk = data[0] % IO_MSG_SIZE;
+	data++;
+	size--;
+	if (!chunk)
+		chunk = size ? size : 1;
+
+	io_parser_init(&parser);
+	while (size) {
+		len = min(chunk, size);
+		error = NULL;
+		result = io_parser_feed(&parser, (const char *)data, len, &error);
+		data += len;
+		size -= len;
+
+		CHECK(result == 1 || result == 0 || result == -EINVAL);
+		check_state(&parser);
+
+		if (result < 0) {
+			CHECK(error && error[0]);
+			io_parser_init(&parser);
+			continue;
+		}
+
+		/* only framing errors report through error */
+		CHECK(!error);
+
+		if (parser.error)
+			CHECK(parser.lines_i > 0);
+
+		if (result == 1) {
+			CHECK(parser.lines_i > 0);
+			CHECK(!strcmp(parser.lines[parser.lines_i - 1], IO_REPLY_OK));
+			reply = io_parser_reply(&parser);
+			CHECK(strlen(reply) < IO_MSG_SIZE);
+			io_parser_init(&parser);
+		}
+	}
+
+	return 0;
+}
+
+#ifndef IO_FUZZ_LIBFUZZER
+
+#define MAX_INPUT	(1 << 20)
+
+static int run_file(FILE *file, const char *name)
+{
+	static uint8_t buf[MAX_INPUT];
+	size_t len;
+
+	len = fread(buf, 1, sizeof(buf), file);
+	if (ferror(file)) {
+		perror(name);
+		return 1;
+	}
+
+	LLVMFuzzerTestOneInput(buf, len);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	FILE *file;
+	int ret = 0;
+	int i;
+
+	if (argc < 2)
+		return run_file(stdin, "stdin");
+
+	for (i = 1; i < argc; i++) {
+		file = fopen(argv[i], "rb");
+		if (!file) {
+			perror(argv[i]);
+			ret = 1;
+			continue;
+		}
+		ret |= run_file(file, argv[i]);
+		fclose(file);
+	}
+
+	return ret;
+}
+
+#endif /* IO_FUZZ_LIBFUZZER */
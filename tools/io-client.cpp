@@ -0,0 +1,695 @@
+/*
+ * io-client.cpp
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This program is free software;  you can redistribute it and/or modify
+ * it under the terms of the  GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is  distributed in the hope that it  will be useful, but
+ * WITHOUT  ANY   WARRANTY;  without   even  the  implied   warranty  of
+ * MERCHANTABILITY  or FITNESS FOR  A PARTICULAR  PURPOSE.  See  the GNU
+ * General Public License for more details.
+ *
+ * You should  have received  a copy of  the GNU General  Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "io-client.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <iterator>
+
+#include <fcntl.h>
+#include <linux/hidraw.h>
+#include <sys/ioctl.h>
+#include <sys/timerfd.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "../system76-io_proto.h"
+
+namespace system76_io {
+
+namespace {
+
+#include "../system76-io_parser.c"
+
+/* IO_TIMEOUT in system76-io.c and REQ_TIMEOUT in system76-thelio-io.c */
+constexpr unsigned int io_timeout_ms = 1000;
+constexpr unsigned int thelio_io_timeout_ms = 300;
+
+/*
+ * After a timeout or a reply that does not parse, an Io's late output would
+ * be taken for the next reply. Input is dropped for this long before the
+ * next request goes out, like the drain in io_dev_ready.
+ */
+constexpr unsigned int io_drain_ms = 50;
+
+const char *const io_fans[] = { "CPUF", "INTF" };
+const char *const thelio_io_fans[] = { "CPU Fan", "Intake Fan", "GPU Fan", "Aux Fan" };
+
+uint64_t now_ns()
+{
+	timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* io_pwm_to_duty and io_duty_to_pwm in system76-io_hwmon.c */
+uint16_t io_pwm_to_duty(unsigned int pwm)
+{
+	return (uint16_t)((std::min(pwm, 255U) * IO_DUTY_MAX) / 255);
+}
+
+unsigned int io_duty_to_pwm(unsigned int duty)
+{
+	return (std::min(duty, (unsigned int)IO_DUTY_MAX) * 255) / IO_DUTY_MAX;
+}
+
+uint8_t thelio_io_cmd(op kind)
+{
+	switch (kind) {
+	case op::tach:
+		return THELIO_IO_CMD_FAN_TACH;
+	case op::pwm_get:
+		return THELIO_IO_CMD_FAN_GET;
+	default:
+		return THELIO_IO_CMD_FAN_SET;
+	}
+}
+
+} // namespace
+
+struct device::slot {
+	request req;
+	uint64_t deadline_ns;
+	bool done;
+};
+
+struct device::io_state {
+	std::unique_ptr<char[]> out;	/* commands of in flight requests not yet written */
+	size_t out_size;
+	size_t out_len;
+	io_parser parser;
+	uint64_t drain_until_ns;	/* input is dropped and nothing sent before this */
+};
+
+event_loop::~event_loop()
+{
+	if (epfd >= 0)
+		::close(epfd);
+}
+
+int event_loop::open()
+{
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	return epfd < 0 ? -errno : 0;
+}
+
+int event_loop::add(int fd, uint32_t events, handler *h)
+{
+	epoll_event ev = {};
+
+	ev.events = events;
+	ev.data.ptr = h;
+	return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) ? -errno : 0;
+}
+
+int event_loop::modify(int fd, uint32_t events, handler *h)
+{
+	epoll_event ev = {};
+
+	ev.events = events;
+	ev.data.ptr = h;
+	return epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev) ? -errno : 0;
+}
+
+void event_loop::remove(int fd)
+{
+	epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr);
+}
+
+int event_loop::run_once(int timeout_ms)
+{
+	int count;
+	int i;
+
+	count = epoll_wait(epfd, events, max_events, timeout_ms);
+	if (count < 0)
+		return errno == EINTR ? 0 : -errno;
+
+	for (i = 0; i < count; i++)
+		static_cast<handler *>(events[i].data.ptr)->handle(events[i].events);
+
+	return count;
+}
+
+void device::timer::handle(uint32_t events)
+{
+	dev->on_timer();
+}
+
+void device::port::handle(uint32_t events)
+{
+	if (events & (EPOLLERR | EPOLLHUP)) {
+		dev->loop->remove(dev->fd);
+		dev->gone = true;
+		dev->fail_in_flight(-ENODEV);
+		return;
+	}
+	if (events & EPOLLOUT)
+		dev->on_writable();
+	if (events & EPOLLIN)
+		dev->on_readable();
+}
+
+device::device()
+{
+	timer_handler.dev = this;
+	port_handler.dev = this;
+}
+
+device::~device()
+{
+	close();
+}
+
+unsigned int device::fan_count(board type)
+{
+	return type == board::io ? std::size(io_fans) : std::size(thelio_io_fans);
+}
+
+const char *device::fan_name(board type, unsigned int fan)
+{
+	if (fan >= fan_count(type))
+		return nullptr;
+	return type == board::io ? io_fans[fan] : thelio_io_fans[fan];
+}
+
+int device::open(event_loop &loop, const char *path, board type, const options &opts)
+{
+	hidraw_devinfo info;
+	termios tio;
+	int ret;
+
+	if (fd >= 0)
+		return -EBUSY;
+	if (!opts.queue_depth || !opts.pipeline || opts.pipeline > opts.queue_depth)
+		return -EINVAL;
+
+	this->loop = &loop;
+	this->kind = type;
+	this->opts = opts;
+	if (!this->opts.timeout_ms)
+		this->opts.timeout_ms = type == board::io ? io_timeout_ms : thelio_io_timeout_ms;
+
+	fd = ::open(path, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	if (type == board::io) {
+		/* no echo, no CR/LF translation: the parser sees the bytes the board sent */
+		if (tcgetattr(fd, &tio)) {
+			ret = -errno;
+			goto fail;
+		}
+		cfmakeraw(&tio);
+		if (tcsetattr(fd, TCSANOW, &tio)) {
+			ret = -errno;
+			goto fail;
+		}
+		tcflush(fd, TCIOFLUSH);
+
+		io.reset(new io_state());
+		io->out_size = (size_t)opts.pipeline * IO_MSG_SIZE;
+		io->out.reset(new char[io->out_size]);
+		io_parser_init(&io->parser);
+	} else {
+		if (ioctl(fd, HIDIOCGRAWINFO, &info) < 0) {
+			ret = -errno;
+			goto fail;
+		}
+		if ((uint16_t)info.vendor != THELIO_IO_VENDOR ||
+		    (uint16_t)info.product != THELIO_IO_DEVICE) {
+			ret = -ENODEV;
+			goto fail;
+		}
+	}
+
+	tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (tfd < 0) {
+		ret = -errno;
+		goto fail;
+	}
+
+	slots.reset(new slot[opts.queue_depth]());
+	head = sent = tail = 0;
+	writing = false;
+	gone = false;
+	counters = {};
+
+	ret = loop.add(fd, EPOLLIN, &port_handler);
+	if (ret)
+		goto fail;
+	ret = loop.add(tfd, EPOLLIN, &timer_handler);
+	if (ret) {
+		loop.remove(fd);
+		goto fail;
+	}
+
+	return 0;
+
+fail:
+	if (tfd >= 0)
+		::close(tfd);
+	::close(fd);
+	tfd = -1;
+	fd = -1;
+	io.reset();
+	return ret;
+}
+
+void device::close()
+{
+	if (fd < 0)
+		return;
+
+	loop->remove(tfd);
+	if (!gone)
+		loop->remove(fd);
+	::close(tfd);
+	::close(fd);
+	tfd = -1;
+	fd = -1;
+	slots.reset();
+	io.reset();
+}
+
+void device::set_unsolicited(unsolicited_fn fn, void *data)
+{
+	unsolicited = fn;
+	unsolicited_data = data;
+}
+
+unsigned int device::queued() const
+{
+	return tail - sent;
+}
+
+unsigned int device::in_flight() const
+{
+	return sent - head;
+}
+
+int device::submit(const request &req)
+{
+	if (fd < 0)
+		return -EBADF;
+	if (gone)
+		return -ENODEV;
+	if (req.fan >= fan_count(kind) || req.kind > op::pwm_set)
+		return -EINVAL;
+	if (tail - head >= opts.queue_depth)
+		return -EAGAIN;
+
+	slot &s = slots[tail % opts.queue_depth];
+	s.req = req;
+	s.deadline_ns = 0;
+	s.done = false;
+	tail++;
+
+	return 0;
+}
+
+int device::flush()
+{
+	int ret;
+
+	if (fd < 0)
+		return -EBADF;
+	if (gone)
+		return -ENODEV;
+
+	ret = kind == board::io ? send_io() : send_thelio();
+	arm_timer();
+	return ret;
+}
+
+void device::want_write(bool on)
+{
+	if (on == writing || gone)
+		return;
+	writing = on;
+	loop->modify(fd, EPOLLIN | (on ? (uint32_t)EPOLLOUT : 0), &port_handler);
+}
+
+/* formats queued requests into the output buffer and writes as much as fits */
+int device::send_io()
+{
+	const char *name;
+	ssize_t ret;
+	int len;
+
+	if (io->drain_until_ns)
+		return 0;
+
+	while (sent < tail && sent - head < opts.pipeline) {
+		slot &s = slots[sent % opts.queue_depth];
+
+		name = io_fans[s.req.fan];
+		switch (s.req.kind) {
+		case op::tach:
+			len = snprintf(io->out.get() + io->out_len, IO_MSG_SIZE, IO_CMD_TACH "%s\r", name);
+			break;
+		case op::pwm_get:
+			len = snprintf(io->out.get() + io->out_len, IO_MSG_SIZE, IO_CMD_DUTY "%s\r", name);
+			break;
+		default:
+			len = snprintf(io->out.get() + io->out_len, IO_MSG_SIZE, IO_CMD_DUTY "%s%04X\r",
+				       name, io_pwm_to_duty(s.req.pwm));
+			break;
+		}
+		io->out_len += len;
+		s.deadline_ns = now_ns() + (uint64_t)opts.timeout_ms * 1000000;
+		sent++;
+	}
+
+	if (!io->out_len) {
+		want_write(false);
+		return 0;
+	}
+
+	ret = write(fd, io->out.get(), io->out_len);
+	if (ret < 0) {
+		if (errno == EAGAIN) {
+			want_write(true);
+			return 0;
+		}
+		ret = -errno;
+		io->out_len = 0;
+		fail_in_flight(ret);
+		return ret;
+	}
+
+	counters.writes++;
+	io->out_len -= ret;
+	memmove(io->out.get(), io->out.get() + ret, io->out_len);
+	want_write(io->out_len > 0);
+
+	return 0;
+}
+
+/* hidraw takes one report per write, preceded by report number 0 */
+int device::send_thelio()
+{
+	uint8_t report[1 + THELIO_IO_REPORT_SIZE];
+	ssize_t ret;
+
+	while (sent < tail && sent - head < opts.pipeline) {
+		slot &s = slots[sent % opts.queue_depth];
+
+		memset(report, 0, sizeof(report));
+		report[1 + THELIO_IO_REPORT_CMD] = thelio_io_cmd(s.req.kind);
+		report[1 + THELIO_IO_REPORT_DATA] = s.req.fan;
+		if (s.req.kind == op::pwm_set)
+			report[1 + THELIO_IO_REPORT_DATA + 1] = s.req.pwm;
+
+		ret = write(fd, report, sizeof(report));
+		if (ret < 0 && errno == EAGAIN) {
+			want_write(true);
+			return 0;
+		}
+
+		s.deadline_ns = now_ns() + (uint64_t)opts.timeout_ms * 1000000;
+		sent++;
+		if (ret < 0) {
+			ret = -errno;
+			complete(sent - 1, ret, 0);
+			return ret;
+		}
+		counters.writes++;
+	}
+
+	want_write(false);
+	return 0;
+}
+
+void device::on_writable()
+{
+	flush();
+}
+
+void device::on_readable()
+{
+	char buf[IO_MSG_SIZE * 4];
+	ssize_t len;
+
+	for (;;) {
+		len = read(fd, buf, sizeof(buf));
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		if (len == 0)
+			break;
+
+		if (kind == board::io)
+			receive_io(buf, len);
+		else
+			receive_thelio((const uint8_t *)buf, len);
+	}
+
+	if (!gone)
+		flush();
+}
+
+/*
+ * Replies are matched to requests in order. The parser only ever sees up to
+ * the end of one line at a time, so replies to pipelined requests that
+ * arrive in one read are told apart.
+ */
+void device::receive_io(const char *data, size_t len)
+{
+	const char *error;
+	const char *reply;
+	const char *end;
+	char *rest;
+	unsigned long value;
+	size_t chunk;
+	int ret;
+
+	if (io->drain_until_ns)
+		return;
+
+	while (len) {
+		end = (const char *)memchr(data, '\n', len);
+		chunk = end ? (size_t)(end - data) + 1 : len;
+
+		error = nullptr;
+		ret = io_parser_feed(&io->parser, data, chunk, &error);
+		data += chunk;
+		len -= chunk;
+
+		if (ret < 0 || (ret == 1 && head == sent)) {
+			/* out of step with the board, start over once it is quiet */
+			if (head == sent)
+				counters.unsolicited++;
+			fail_in_flight(-EPROTO);
+			io->drain_until_ns = now_ns() + (uint64_t)io_drain_ms * 1000000;
+			return;
+		}
+		if (ret == 0)
+			continue;
+
+		const request &req = slots[head % opts.queue_depth].req;
+
+		if (io->parser.error) {
+			io_parser_init(&io->parser);
+			complete(head, -EIO, 0);
+			continue;
+		}
+
+		value = 0;
+		if (req.kind != op::pwm_set) {
+			reply = io_parser_reply(&io->parser);
+			value = strtoul(reply, &rest, 16);
+			if (!reply[0] || *rest || value > 0xFFFF) {
+				io_parser_init(&io->parser);
+				complete(head, -EPROTO, 0);
+				continue;
+			}
+		}
+		io_parser_init(&io->parser);
+
+		switch (req.kind) {
+		case op::tach:
+			complete(head, 0, value * IO_TACH_SCALE);
+			break;
+		case op::pwm_get:
+			complete(head, 0, io_duty_to_pwm(value));
+			break;
+		default:
+			complete(head, 0, req.pwm);
+			break;
+		}
+	}
+}
+
+/* replies echo the command, and the channel of fan commands */
+void device::receive_thelio(const uint8_t *report, size_t len)
+{
+	unsigned int channel;
+	unsigned int value;
+	uint64_t i;
+	int error;
+
+	if (len < THELIO_IO_REPORT_DATA + 3)
+		return;
+
+	channel = report[THELIO_IO_REPORT_DATA];
+	for (i = head; i < sent; i++) {
+		slot &s = slots[i % opts.queue_depth];
+
+		if (s.done || report[THELIO_IO_REPORT_CMD] != thelio_io_cmd(s.req.kind) ||
+		    channel != s.req.fan)
+			continue;
+
+		error = report[THELIO_IO_REPORT_RES] ? -EIO : 0;
+		switch (s.req.kind) {
+		case op::tach:
+			value = report[THELIO_IO_REPORT_DATA + 1] | report[THELIO_IO_REPORT_DATA + 2] << 8;
+			break;
+		case op::pwm_get:
+			value = report[THELIO_IO_REPORT_DATA + 1];
+			break;
+		default:
+			value = s.req.pwm;
+			break;
+		}
+		complete(i, error, error ? 0 : value);
+		return;
+	}
+
+	counters.unsolicited++;
+	if (unsolicited && report[THELIO_IO_REPORT_CMD] == THELIO_IO_CMD_FAN_TACH &&
+	    !report[THELIO_IO_REPORT_RES] && channel < fan_count(kind))
+		unsolicited(unsolicited_data, channel,
+			    report[THELIO_IO_REPORT_DATA + 1] | report[THELIO_IO_REPORT_DATA + 2] << 8);
+}
+
+void device::complete(uint64_t index, int error, unsigned int value)
+{
+	slot &s = slots[index % opts.queue_depth];
+
+	s.done = true;
+	counters.requests++;
+	if (error)
+		counters.errors++;
+	if (error == -ETIMEDOUT)
+		counters.timeouts++;
+
+	/* the slot stays taken until retire, so the callback may submit */
+	if (s.req.done)
+		s.req.done(s.req.data, s.req, error, value);
+
+	retire();
+}
+
+void device::retire()
+{
+	while (head < sent && slots[head % opts.queue_depth].done)
+		head++;
+}
+
+/* fails everything on the wire, and everything queued if the board is gone */
+void device::fail_in_flight(int error)
+{
+	uint64_t end = gone ? tail : sent;
+	uint64_t i;
+
+	if (io) {
+		io->out_len = 0;
+		io_parser_init(&io->parser);
+		want_write(false);
+	}
+
+	sent = end;
+	for (i = head; i < end; i++) {
+		if (!slots[i % opts.queue_depth].done)
+			complete(i, error, 0);
+	}
+}
+
+void device::arm_timer()
+{
+	itimerspec its = {};
+	uint64_t deadline = 0;
+	uint64_t i;
+
+	if (io && io->drain_until_ns) {
+		deadline = io->drain_until_ns;
+	} else {
+		for (i = head; i < sent; i++) {
+			const slot &s = slots[i % opts.queue_depth];
+
+			if (!s.done && (!deadline || s.deadline_ns < deadline))
+				deadline = s.deadline_ns;
+		}
+	}
+
+	its.it_value.tv_sec = deadline / 1000000000;
+	its.it_value.tv_nsec = deadline % 1000000000;
+	timerfd_settime(tfd, TFD_TIMER_ABSTIME, &its, nullptr);
+}
+
+void device::on_timer()
+{
+	uint64_t expirations;
+	uint64_t now = now_ns();
+	uint64_t i;
+	char buf[IO_MSG_SIZE * 4];
+
+	if (read(tfd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+		return;
+
+	if (io && io->drain_until_ns) {
+		if (now < io->drain_until_ns)
+			return;
+		/* whatever the board said in the meantime is dropped */
+		while (read(fd, buf, sizeof(buf)) > 0)
+			;
+		tcflush(fd, TCIFLUSH);
+		io->drain_until_ns = 0;
+		flush();
+		return;
+	}
+
+	if (io) {
+		if (head < sent && slots[head % opts.queue_depth].deadline_ns <= now) {
+			fail_in_flight(-ETIMEDOUT);
+			io->drain_until_ns = now + (uint64_t)io_drain_ms * 1000000;
+		}
+	} else {
+		/* a late reply is counted as unsolicited */
+		for (i = head; i < sent; i++) {
+			const slot &s = slots[i % opts.queue_depth];
+
+			if (!s.done && s.deadline_ns <= now)
+				complete(i, -ETIMEDOUT, 0);
+		}
+	}
+
+	flush();
+}
+
+} // namespace system76_io
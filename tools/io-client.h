@@ -0,0 +1,214 @@
+/*
+ * io-client.h
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This program is free software;  you can redistribute it and/or modify
+ * it under the terms of the  GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is  distributed in the hope that it  will be useful, but
+ * WITHOUT  ANY   WARRANTY;  without   even  the  implied   warranty  of
+ * MERCHANTABILITY  or FITNESS FOR  A PARTICULAR  PURPOSE.  See  the GNU
+ * General Public License for more details.
+ *
+ * You should  have received  a copy of  the GNU General  Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Userspace access to both Io boards without the kernel drivers, for hosts
+ * that cannot load them. An Io is driven over its CDC ACM tty
+ * (/dev/ttyACMn) with the line protocol of system76-io_dev.c, a Thelio Io
+ * over hidraw (/dev/hidrawN) with the reports of system76-thelio-io.c. Both
+ * take their constants from system76-io_proto.h and the Io replies go
+ * through system76-io_parser.c, so the library cannot drift from the
+ * drivers. Do not use it while the driver is bound to the same board.
+ *
+ * A device queues requests and completes them from its event loop's
+ * dispatch, in submission order for an Io and as the replies arrive for a
+ * Thelio Io. submit only queues, flush puts as many queued requests on the
+ * wire as the pipeline allows, an Io's in a single write, and every
+ * completion refills the pipeline from the queue. All memory is taken in
+ * open, nothing is allocated per request.
+ *
+ * Errors are negative errno values, as in the drivers: -EIO for a board
+ * that answered with an error, -ETIMEDOUT for one that did not answer,
+ * -EPROTO for an Io reply that does not parse.
+ */
+
+#ifndef SYSTEM76_IO_CLIENT_H
+#define SYSTEM76_IO_CLIENT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+#include <sys/epoll.h>
+
+namespace system76_io {
+
+enum class board {
+	io,
+	thelio_io,
+};
+
+enum class op : uint8_t {
+	tach,		/* fan speed in RPM */
+	pwm_get,	/* duty as PWM 0-255, like the hwmon pwmN files */
+	pwm_set,
+};
+
+struct request;
+
+/* value is the RPM for op::tach and the PWM otherwise, 0 on errors */
+typedef void (*completion_fn)(void *data, const request &req, int error, unsigned int value);
+
+/* a tach reading the Thelio Io sent without being asked */
+typedef void (*unsolicited_fn)(void *data, unsigned int fan, unsigned int rpm);
+
+struct request {
+	op kind;
+	uint8_t fan;	/* 0 based, below device::fan_count */
+	uint8_t pwm;	/* op::pwm_set only */
+	completion_fn done;
+	void *data;
+};
+
+class handler {
+public:
+	virtual void handle(uint32_t events) = 0;
+
+protected:
+	~handler() = default;
+};
+
+/* an epoll instance, or use add with an epoll fd of your own */
+class event_loop {
+public:
+	event_loop() = default;
+	~event_loop();
+	event_loop(const event_loop &) = delete;
+	event_loop &operator=(const event_loop &) = delete;
+
+	int open();
+	int fd() const { return epfd; }
+
+	int add(int fd, uint32_t events, handler *h);
+	int modify(int fd, uint32_t events, handler *h);
+	void remove(int fd);
+
+	/* waits up to timeout_ms, -1 for ever, returns the events handled */
+	int run_once(int timeout_ms);
+
+private:
+	static constexpr int max_events = 16;
+
+	int epfd = -1;
+	epoll_event events[max_events];
+};
+
+/*
+ * Io replies carry no tag, they are matched to requests by order. With a
+ * pipeline deeper than 1 a command the board drops shifts the following
+ * replies onto the wrong requests until the timeout, so only pipeline an Io
+ * over a link that does not lose data. Thelio Io replies echo the command
+ * and fan and are matched by those.
+ */
+struct options {
+	unsigned int queue_depth = 64;	/* submit fails with -EAGAIN beyond this */
+	unsigned int pipeline = 1;	/* requests on the wire at once */
+	unsigned int timeout_ms = 0;	/* 0 for the driver's timeout of the board */
+};
+
+struct statistics {
+	uint64_t requests;
+	uint64_t errors;
+	uint64_t timeouts;
+	uint64_t unsolicited;
+	uint64_t writes;	/* write calls, below requests when batching */
+};
+
+class device {
+public:
+	device();
+	~device();
+	device(const device &) = delete;
+	device &operator=(const device &) = delete;
+
+	int open(event_loop &loop, const char *path, board type, const options &opts = options());
+	void close();
+
+	/* queues a request, -EINVAL for a fan the board does not have */
+	int submit(const request &req);
+	/* writes queued requests up to the pipeline depth */
+	int flush();
+
+	void set_unsolicited(unsolicited_fn fn, void *data);
+
+	unsigned int queued() const;
+	unsigned int in_flight() const;
+	const statistics &stats() const { return counters; }
+	board type() const { return kind; }
+
+	static unsigned int fan_count(board type);
+	/* CPUF and INTF as on the Io's wire, the hwmon labels for a Thelio Io */
+	static const char *fan_name(board type, unsigned int fan);
+
+private:
+	struct slot;
+	struct io_state;
+
+	struct timer : handler {
+		device *dev;
+		void handle(uint32_t events) override;
+	};
+
+	struct port : handler {
+		device *dev;
+		void handle(uint32_t events) override;
+	};
+
+	void on_readable();
+	void on_writable();
+	void on_timer();
+
+	int send_io();
+	int send_thelio();
+	void receive_io(const char *data, size_t len);
+	void receive_thelio(const uint8_t *report, size_t len);
+	void complete(uint64_t index, int error, unsigned int value);
+	void fail_in_flight(int error);
+	void retire();
+	void arm_timer();
+	void want_write(bool on);
+
+	event_loop *loop = nullptr;
+	board kind = board::io;
+	options opts;
+	int fd = -1;
+	int tfd = -1;
+	bool writing = false;
+	bool gone = false;	/* hung up, everything fails with -ENODEV */
+
+	/* ring of queue_depth slots: [head, sent) on the wire, [sent, tail) queued */
+	std::unique_ptr<slot[]> slots;
+	uint64_t head = 0;
+	uint64_t sent = 0;
+	uint64_t tail = 0;
+
+	/* Io only: pending output and the reply being parsed */
+	std::unique_ptr<io_state> io;
+
+	unsolicited_fn unsolicited = nullptr;
+	void *unsolicited_data = nullptr;
+
+	timer timer_handler;
+	port port_handler;
+	statistics counters = {};
+};
+
+} // namespace system76_io
+
+#endif // SYSTEM76_IO_CLIENT_H
@@ -0,0 +1,282 @@
+/*
+ * io-ctl.cpp
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This program is free software;  you can redistribute it and/or modify
+ * it under the terms of the  GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is  distributed in the hope that it  will be useful, but
+ * WITHOUT  ANY   WARRANTY;  without   even  the  implied   warranty  of
+ * MERCHANTABILITY  or FITNESS FOR  A PARTICULAR  PURPOSE.  See  the GNU
+ * General Public License for more details.
+ *
+ * You should  have received  a copy of  the GNU General  Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Command line front end of io-client: reads fan speeds, reads and sets
+ * PWM, and measures request throughput and latency with a given pipeline
+ * depth, straight from /dev/ttyACMn or /dev/hidrawN.
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <memory>
+
+#include <getopt.h>
+
+#include "io-client.h"
+
+using namespace system76_io;
+
+struct pending {
+	unsigned int *outstanding;
+	int error;
+	uint64_t start_ns;
+	uint64_t latency_ns;
+};
+
+struct result {
+	pending p;
+	board type;
+};
+
+static uint64_t now_ns(clockid_t clock)
+{
+	timespec ts;
+
+	clock_gettime(clock, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void done(void *data, const request &req, int error, unsigned int value)
+{
+	pending *p = static_cast<pending *>(data);
+
+	p->error = error;
+	p->latency_ns = now_ns(CLOCK_MONOTONIC) - p->start_ns;
+	(*p->outstanding)--;
+}
+
+static void print_done(void *data, const request &req, int error, unsigned int value)
+{
+	result *r = static_cast<result *>(data);
+
+	done(&r->p, req, error, value);
+	if (error)
+		fprintf(stderr, "%s: %s\n", device::fan_name(r->type, req.fan), strerror(-error));
+	else
+		printf("%s: %u%s\n", device::fan_name(r->type, req.fan), value,
+		       req.kind == op::tach ? " RPM" : "");
+}
+
+static int wait_all(event_loop &loop, const unsigned int &outstanding)
+{
+	int ret;
+
+	while (outstanding) {
+		ret = loop.run_once(-1);
+		if (ret < 0)
+			return ret;
+	}
+	return 0;
+}
+
+/* count tach requests round robin over the fans, pipelined */
+static int bench(event_loop &loop, device &dev, unsigned int count)
+{
+	std::unique_ptr<pending[]> pendings(new pending[count]);
+	std::unique_ptr<uint64_t[]> latencies(new uint64_t[count]);
+	unsigned int outstanding = 0;
+	unsigned int submitted = 0;
+	unsigned int failed = 0;
+	unsigned int ok = 0;
+	unsigned int fans = device::fan_count(dev.type());
+	uint64_t wall;
+	uint64_t cpu;
+	unsigned int i;
+	request req = {};
+	int ret;
+
+	wall = now_ns(CLOCK_MONOTONIC);
+	cpu = now_ns(CLOCK_PROCESS_CPUTIME_ID);
+	while (submitted < count || outstanding) {
+		/* keep the queue full, the device keeps the pipeline full from it */
+		while (submitted < count) {
+			pending &p = pendings[submitted];
+
+			req.kind = op::tach;
+			req.fan = submitted % fans;
+			req.done = done;
+			req.data = &p;
+			p.outstanding = &outstanding;
+			p.start_ns = now_ns(CLOCK_MONOTONIC);
+			if (dev.submit(req))
+				break;
+			outstanding++;
+			submitted++;
+		}
+		dev.flush();
+
+		ret = loop.run_once(-1);
+		if (ret < 0)
+			return ret;
+	}
+	wall = now_ns(CLOCK_MONOTONIC) - wall;
+	cpu = now_ns(CLOCK_PROCESS_CPUTIME_ID) - cpu;
+
+	for (i = 0; i < count; i++) {
+		if (pendings[i].error)
+			failed++;
+		else
+			latencies[ok++] = pendings[i].latency_ns;
+	}
+	std::sort(latencies.get(), latencies.get() + ok);
+
+	printf("requests        %u, %u failed\n", count, failed);
+	printf("writes          %llu\n", (unsigned long long)dev.stats().writes);
+	printf("unsolicited     %llu\n", (unsigned long long)dev.stats().unsolicited);
+	printf("requests/sec    %.0f\n", count / (wall / 1e9));
+	if (ok) {
+		printf("latency p50     %.0f us\n", latencies[ok / 2] / 1e3);
+		printf("latency p99     %.0f us\n", latencies[(ok - 1) * 99 / 100] / 1e3);
+	}
+	printf("cpu/request     %.1f us\n", cpu / 1e3 / count);
+
+	return failed ? 1 : 0;
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr,
+		"usage: %s [-b io|thelio] [-p pipeline] [-q queue] [-t timeout_ms] DEVICE COMMAND\n"
+		"  tach [FAN]         fan speed, of every fan without FAN\n"
+		"  pwm FAN [VALUE]    read or set the PWM, 0-255\n"
+		"  bench [COUNT]      COUNT tach requests, 10000 by default\n"
+		"FAN counts from 1 like the hwmon files. DEVICE is an Io's /dev/ttyACMn or a\n"
+		"Thelio Io's /dev/hidrawN, the board type follows the name unless -b is given.\n",
+		argv0);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	result results[8] = {};
+	event_loop loop;
+	device dev;
+	options opts;
+	unsigned int outstanding = 0;
+	unsigned int fan;
+	unsigned int i;
+	const char *path;
+	const char *cmd;
+	board type;
+	bool typed = false;
+	request req = {};
+	int ret;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "b:p:q:t:")) != -1) {
+		switch (opt) {
+		case 'b':
+			if (!strcmp(optarg, "io"))
+				type = board::io;
+			else if (!strcmp(optarg, "thelio"))
+				type = board::thelio_io;
+			else
+				usage(argv[0]);
+			typed = true;
+			break;
+		case 'p':
+			opts.pipeline = strtoul(optarg, NULL, 0);
+			break;
+		case 'q':
+			opts.queue_depth = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			opts.timeout_ms = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (argc - optind < 2)
+		usage(argv[0]);
+	path = argv[optind];
+	cmd = argv[optind + 1];
+	if (!typed)
+		type = strstr(path, "hidraw") ? board::thelio_io : board::io;
+	if (opts.pipeline > opts.queue_depth)
+		opts.queue_depth = opts.pipeline;
+
+	ret = loop.open();
+	if (!ret)
+		ret = dev.open(loop, path, type, opts);
+	if (ret) {
+		fprintf(stderr, "%s: %s\n", path, strerror(-ret));
+		return 1;
+	}
+
+	if (!strcmp(cmd, "bench")) {
+		ret = bench(loop, dev, argc - optind > 2 ? strtoul(argv[optind + 2], NULL, 0) : 10000);
+		return ret ? 1 : 0;
+	}
+
+	req.done = print_done;
+	if (!strcmp(cmd, "tach")) {
+		req.kind = op::tach;
+		for (fan = 0; fan < device::fan_count(type); fan++) {
+			if (argc - optind > 2 && fan + 1 != strtoul(argv[optind + 2], NULL, 0))
+				continue;
+			req.fan = fan;
+			req.data = &results[fan];
+			results[fan].p.outstanding = &outstanding;
+			results[fan].type = type;
+			if (!dev.submit(req))
+				outstanding++;
+		}
+	} else if (!strcmp(cmd, "pwm") && argc - optind > 2) {
+		req.fan = strtoul(argv[optind + 2], NULL, 0) - 1;
+		req.kind = op::pwm_get;
+		if (argc - optind > 3) {
+			req.kind = op::pwm_set;
+			req.pwm = std::min(strtoul(argv[optind + 3], NULL, 0), 255UL);
+		}
+		req.data = &results[0];
+		results[0].p.outstanding = &outstanding;
+		results[0].type = type;
+		ret = dev.submit(req);
+		if (ret) {
+			fprintf(stderr, "%s: %s\n", cmd, strerror(-ret));
+			return 1;
+		}
+		outstanding++;
+	} else {
+		usage(argv[0]);
+	}
+	if (!outstanding) {
+		fprintf(stderr, "%s: no such fan\n", cmd);
+		return 1;
+	}
+
+	dev.flush();
+	ret = wait_all(loop, outstanding);
+	if (ret) {
+		fprintf(stderr, "epoll: %s\n", strerror(-ret));
+		return 1;
+	}
+
+	for (i = 0; i < device::fan_count(type); i++) {
+		if (results[i].p.outstanding && results[i].p.error)
+			return 1;
+	}
+	return 0;
+}
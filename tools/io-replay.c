@@ -0,0 +1,715 @@
+/*
+ * io-replay.c
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This program is free software;  you can redistribute it and/or modify
+ * it under the terms of the  GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is  distributed in the hope that it  will be useful, but
+ * WITHOUT  ANY   WARRANTY;  without   even  the  implied   warranty  of
+ * MERCHANTABILITY  or FITNESS FOR  A PARTICULAR  PURPOSE.  See  the GNU
+ * General Public License for more details.
+ *
+ * You should  have received  a copy of  the GNU General  Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Replays command captures taken from the capture file in a device's
+ * debugfs directory (see system76-io_capture.c), for example
+ *
+ *   echo 1 > /sys/kernel/debug/system76-thelio-io/0003:3384:000B.0001/capture_enable
+ *   cat .../capture >> trace.bin   (repeat before the ring wraps)
+ *
+ * Every capture is summarized per command first. A Thelio Io capture is
+ * then replayed against the loaded system76-thelio-io through a stand-in
+ * on /dev/uhid: each captured command is turned back into the hwmon access
+ * that causes it (FAN_TACH reads fanN_input, FAN_GET reads pwmN, FAN_SET
+ * writes pwmN) at its original time, divided by -x. The stand-in answers
+ * those with the captured reply, result and latency, and every other
+ * report the driver sends from the last captured state. The driver's
+ * own capture of the replay is summarized next to the original, and any
+ * queue and latency statistics the driver keeps are printed, so two driver
+ * builds can be compared on the same workload.
+ *
+ * Io captures are only summarized, there is no CDC stand-in without USB
+ * gadget support.
+ */
+
+#include <getopt.h>
+#include <math.h>
+#include <pthread.h>
+#include <signal.h>
+
+#include "kshim.h"
+
+#include "../system76-io_proto.h"
+#include "thelio-uhid.c"
+
+#define REPLAY_PHYS	"io-replay"
+#define DEBUGFS		"/sys/kernel/debug/system76-thelio-io"
+#define FANS		4
+#define NAME_SIZE	16
+
+/* struct io_capture_record in system76-io_capture.c */
+struct record {
+	uint64_t timestamp_ns;
+	uint32_t latency_ns;
+	int16_t result;
+	uint8_t tx_len;
+	uint8_t rx_len;
+	uint8_t tx[32];
+	uint8_t rx[32];
+} __attribute__((packed));
+
+_Static_assert(sizeof(struct record) == 80, "struct io_capture_record changed");
+
+struct trace {
+	struct record *records;
+	size_t len;
+	size_t cap;
+};
+
+struct command {
+	char name[NAME_SIZE];
+	unsigned long count;
+	unsigned long errors;
+	double *latency; /* microseconds */
+	size_t len;
+	size_t cap;
+};
+
+/* what the stand-in answers with, shared with the board thread */
+struct board {
+	pthread_mutex_t lock;
+	pthread_cond_t done;
+	uint8_t duty[FANS];
+	uint16_t tach[FANS];
+	uint32_t latency_ns[256]; /* median per command code */
+	const struct record *expect; /* the captured command in flight */
+	bool quick;
+};
+
+static struct board board = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.done = PTHREAD_COND_INITIALIZER,
+};
+static volatile sig_atomic_t stop;
+
+static const char *thelio_name(uint8_t cmd)
+{
+	switch (cmd) {
+	case THELIO_IO_CMD_FAN_GET:
+		return "FAN_GET";
+	case THELIO_IO_CMD_FAN_SET:
+		return "FAN_SET";
+	case THELIO_IO_CMD_FAN_TACH:
+		return "FAN_TACH";
+	case THELIO_IO_CMD_LED_SET_MODE:
+		return "LED_SET_MODE";
+	default:
+		return NULL;
+	}
+}
+
+static bool is_thelio(const struct record *record)
+{
+	return record->tx_len == THELIO_IO_REPORT_SIZE &&
+	       thelio_name(record->tx[THELIO_IO_REPORT_CMD]);
+}
+
+static void record_name(const struct record *record, char *name)
+{
+	size_t len;
+
+	if (is_thelio(record)) {
+		snprintf(name, NAME_SIZE, "%s", thelio_name(record->tx[THELIO_IO_REPORT_CMD]));
+		return;
+	}
+
+	/* Io commands are the name before any fan or argument, e.g. IoTACH */
+	len = min((size_t)record->tx_len, (size_t)NAME_SIZE - 1);
+	if (len > strlen(IO_CMD_TACH) && !strncmp((const char *)record->tx, "Io", 2) &&
+	    strncmp((const char *)record->tx, IO_CMD_REVISION, strlen(IO_CMD_REVISION)))
+		len = strlen(IO_CMD_TACH);
+	memcpy(name, record->tx, len);
+	name[len] = 0;
+	while (len && (name[len - 1] == '\r' || name[len - 1] == '\n'))
+		name[--len] = 0;
+}
+
+static int trace_read(struct trace *trace, FILE *file, const char *path)
+{
+	struct record record;
+	size_t ret;
+
+	while ((ret = fread(&record, 1, sizeof(record), file)) == sizeof(record)) {
+		if (trace->len == trace->cap) {
+			trace->cap = trace->cap ? trace->cap * 2 : 1024;
+			trace->records = realloc(trace->records, trace->cap * sizeof(record));
+			if (!trace->records) {
+				perror("realloc");
+				return -1;
+			}
+		}
+		trace->records[trace->len++] = record;
+	}
+	if (ferror(file)) {
+		perror(path);
+		return -1;
+	}
+	if (ret)
+		fprintf(stderr, "%s: ignoring %zu trailing bytes\n", path, ret);
+	return 0;
+}
+
+static int compare_record(const void *a, const void *b)
+{
+	const struct record *x = a;
+	const struct record *y = b;
+
+	return x->timestamp_ns < y->timestamp_ns ? -1 : x->timestamp_ns > y->timestamp_ns;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double percentile(const struct command *command, double p)
+{
+	return command->latency[(size_t)(p * (command->len - 1))];
+}
+
+/* prints per command count, rate, errors and latency percentiles */
+static void summarize(const char *title, const struct trace *trace)
+{
+	struct command commands[64];
+	struct command *command;
+	size_t commands_len = 0;
+	char name[NAME_SIZE];
+	double seconds;
+	size_t i;
+	size_t j;
+
+	if (!trace->len) {
+		printf("%s: no records\n\n", title);
+		return;
+	}
+
+	memset(commands, 0, sizeof(commands));
+	for (i = 0; i < trace->len; i++) {
+		record_name(&trace->records[i], name);
+		for (j = 0; j < commands_len && strcmp(commands[j].name, name); j++)
+			;
+		if (j == commands_len) {
+			if (commands_len == ARRAY_SIZE(commands))
+				continue;
+			snprintf(commands[commands_len++].name, NAME_SIZE, "%s", name);
+		}
+		command = &commands[j];
+		command->count++;
+		if (trace->records[i].result) {
+			command->errors++;
+			continue;
+		}
+		if (command->len == command->cap) {
+			command->cap = command->cap ? command->cap * 2 : 64;
+			command->latency = realloc(command->latency, command->cap * sizeof(double));
+			if (!command->latency) {
+				perror("realloc");
+				exit(1);
+			}
+		}
+		command->latency[command->len++] = trace->records[i].latency_ns / 1000.0;
+	}
+
+	seconds = (trace->records[trace->len - 1].timestamp_ns - trace->records[0].timestamp_ns) / 1e9;
+	printf("%s: %zu records over %.1f s\n", title, trace->len, seconds);
+	printf("  %-14s %8s %9s %7s %10s %10s %10s\n", "command", "count", "per min", "errors",
+	       "p50 us", "p99 us", "max us");
+	for (i = 0; i < commands_len; i++) {
+		command = &commands[i];
+		printf("  %-14s %8lu %9.1f %7lu", command->name, command->count,
+		       seconds > 0 ? command->count * 60 / seconds : 0, command->errors);
+		if (command->len) {
+			qsort(command->latency, command->len, sizeof(double), compare_double);
+			printf(" %10.0f %10.0f %10.0f", percentile(command, 0.5),
+			       percentile(command, 0.99), command->latency[command->len - 1]);
+		}
+		printf("\n");
+		free(command->latency);
+	}
+	printf("\n");
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void sleep_until(double t)
+{
+	struct timespec ts;
+
+	ts.tv_sec = (time_t)t;
+	ts.tv_nsec = (long)((t - ts.tv_sec) * 1e9);
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR && !stop)
+		;
+}
+
+/* the board state after a captured exchange, called with board.lock held */
+static void board_track(const struct record *record)
+{
+	unsigned int channel = record->tx[THELIO_IO_REPORT_DATA];
+
+	if (channel >= FANS || record->result)
+		return;
+
+	switch (record->tx[THELIO_IO_REPORT_CMD]) {
+	case THELIO_IO_CMD_FAN_SET:
+		board.duty[channel] = record->tx[THELIO_IO_REPORT_DATA + 1];
+		break;
+	case THELIO_IO_CMD_FAN_GET:
+		if (record->rx_len == THELIO_IO_REPORT_SIZE)
+			board.duty[channel] = record->rx[THELIO_IO_REPORT_DATA + 1];
+		break;
+	case THELIO_IO_CMD_FAN_TACH:
+		if (record->rx_len == THELIO_IO_REPORT_SIZE)
+			board.tach[channel] = record->rx[THELIO_IO_REPORT_DATA + 1] |
+					      record->rx[THELIO_IO_REPORT_DATA + 2] << 8;
+		break;
+	}
+}
+
+/* median latency per command, used for the driver's own background commands */
+static void board_latency(const struct trace *trace)
+{
+	struct command command;
+	unsigned int cmd;
+	size_t i;
+
+	for (cmd = 0; cmd < 256; cmd++) {
+		memset(&command, 0, sizeof(command));
+		for (i = 0; i < trace->len; i++) {
+			if (trace->records[i].tx[THELIO_IO_REPORT_CMD] != cmd || trace->records[i].result)
+				continue;
+			if (command.len == command.cap) {
+				command.cap = command.cap ? command.cap * 2 : 64;
+				command.latency = realloc(command.latency, command.cap * sizeof(double));
+				if (!command.latency) {
+					perror("realloc");
+					exit(1);
+				}
+			}
+			command.latency[command.len++] = trace->records[i].latency_ns;
+		}
+		if (command.len) {
+			qsort(command.latency, command.len, sizeof(double), compare_double);
+			board.latency_ns[cmd] = percentile(&command, 0.5);
+		}
+		free(command.latency);
+	}
+}
+
+static void board_sleep(uint32_t latency_ns)
+{
+	struct timespec ts = {
+		.tv_sec = latency_ns / 1000000000,
+		.tv_nsec = latency_ns % 1000000000,
+	};
+
+	if (!board.quick)
+		nanosleep(&ts, NULL);
+}
+
+static void *board_thread(void *data)
+{
+	struct thelio_uhid *uhid = data;
+	uint8_t report[THELIO_IO_REPORT_SIZE];
+	uint8_t reply[THELIO_IO_REPORT_SIZE];
+	const struct record *record;
+	unsigned int channel;
+	uint32_t latency_ns;
+	bool send;
+	int ret;
+
+	while (!stop) {
+		ret = thelio_uhid_poll(uhid, report, 100);
+		if (ret < 0) {
+			stop = 1;
+			break;
+		}
+		if (ret == 0)
+			continue;
+
+		channel = report[THELIO_IO_REPORT_DATA];
+		send = true;
+		memset(reply, 0, sizeof(reply));
+		reply[THELIO_IO_REPORT_CMD] = report[THELIO_IO_REPORT_CMD];
+		reply[THELIO_IO_REPORT_DATA] = channel;
+
+		pthread_mutex_lock(&board.lock);
+		record = board.expect;
+		if (record && record->tx[THELIO_IO_REPORT_CMD] == report[THELIO_IO_REPORT_CMD] &&
+		    record->tx[THELIO_IO_REPORT_DATA] == channel) {
+			/* the replayed command, answered as it was captured */
+			board.expect = NULL;
+			latency_ns = record->latency_ns;
+			if (record->result == -ETIMEDOUT)
+				send = false;
+			else if (record->rx_len == THELIO_IO_REPORT_SIZE)
+				memcpy(reply, record->rx, sizeof(reply));
+			else
+				reply[THELIO_IO_REPORT_RES] = record->result ? 1 : 0;
+			pthread_cond_signal(&board.done);
+		} else {
+			latency_ns = board.latency_ns[report[THELIO_IO_REPORT_CMD]];
+			switch (report[THELIO_IO_REPORT_CMD]) {
+			case THELIO_IO_CMD_FAN_GET:
+				reply[THELIO_IO_REPORT_DATA + 1] = channel < FANS ? board.duty[channel] : 0;
+				break;
+			case THELIO_IO_CMD_FAN_SET:
+				if (channel < FANS)
+					board.duty[channel] = report[THELIO_IO_REPORT_DATA + 1];
+				reply[THELIO_IO_REPORT_DATA + 1] = report[THELIO_IO_REPORT_DATA + 1];
+				break;
+			case THELIO_IO_CMD_FAN_TACH:
+				if (channel < FANS) {
+					reply[THELIO_IO_REPORT_DATA + 1] = board.tach[channel] & 0xFF;
+					reply[THELIO_IO_REPORT_DATA + 2] = board.tach[channel] >> 8;
+				}
+				break;
+			case THELIO_IO_CMD_LED_SET_MODE:
+				break;
+			default:
+				reply[THELIO_IO_REPORT_RES] = 1;
+				break;
+			}
+		}
+		pthread_mutex_unlock(&board.lock);
+
+		board_sleep(latency_ns);
+		if (send)
+			thelio_uhid_send(uhid, reply);
+	}
+
+	return NULL;
+}
+
+static int sysfs_access(const char *dir, const char *attr, int value)
+{
+	char path[PATH_MAX + 64];
+	char buf[32];
+	ssize_t ret;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, attr);
+	fd = open(path, value < 0 ? O_RDONLY : O_WRONLY);
+	if (fd < 0)
+		return -errno;
+
+	if (value < 0) {
+		ret = read(fd, buf, sizeof(buf));
+	} else {
+		snprintf(buf, sizeof(buf), "%d\n", value);
+		ret = write(fd, buf, strlen(buf));
+	}
+	if (ret < 0)
+		ret = -errno;
+	close(fd);
+
+	return ret < 0 ? ret : 0;
+}
+
+static int debugfs_write(const char *dir, const char *attr, const char *value)
+{
+	char path[PATH_MAX + 64];
+	FILE *file;
+	int ret;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, attr);
+	file = fopen(path, "w");
+	if (!file)
+		return -1;
+	ret = fputs(value, file) < 0;
+	ret |= fclose(file) != 0;
+	return ret ? -1 : 0;
+}
+
+static void debugfs_print(const char *dir, const char *attr)
+{
+	char path[PATH_MAX + 64];
+	char line[256];
+	FILE *file;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, attr);
+	file = fopen(path, "r");
+	if (!file)
+		return;
+	printf("%s:\n", attr);
+	while (fgets(line, sizeof(line), file))
+		printf("  %s", line);
+	fclose(file);
+	printf("\n");
+}
+
+static int debugfs_drain(const char *dir, struct trace *trace)
+{
+	char path[PATH_MAX + 64];
+	FILE *file;
+	int ret = 0;
+
+	snprintf(path, sizeof(path), "%s/capture", dir);
+	file = fopen(path, "rb");
+	if (!file)
+		return -1;
+	if (trace)
+		ret = trace_read(trace, file, path);
+	else
+		while (fgetc(file) != EOF)
+			;
+	fclose(file);
+	return ret;
+}
+
+/* the debugfs directory of the stand-in, named after its hid device */
+static int debugfs_dir(const char *hwmon, char *path, size_t size)
+{
+	char link[PATH_MAX];
+	char buf[PATH_MAX + 16];
+	const char *name;
+
+	snprintf(buf, sizeof(buf), "%s/device", hwmon);
+	if (!realpath(buf, link))
+		return -1;
+	name = strrchr(link, '/');
+	if (!name)
+		return -1;
+	snprintf(path, size, DEBUGFS "%s", name);
+	return access(path, R_OK) ? -1 : 0;
+}
+
+static int replay(const struct trace *trace, double speed, FILE *out)
+{
+	struct trace result = { 0 };
+	struct thelio_uhid uhid;
+	const struct record *record;
+	pthread_t thread;
+	char hwmon[PATH_MAX];
+	char debugfs[PATH_MAX];
+	char attr[32];
+	unsigned int channel;
+	double behind = 0;
+	double start;
+	double due;
+	size_t skipped = 0;
+	size_t failed = 0;
+	size_t i;
+	int value;
+	int ret = -1;
+
+	board_latency(trace);
+
+	if (thelio_uhid_create(&uhid, "System76 Thelio Io (io-replay)", REPLAY_PHYS))
+		return -1;
+	if (pthread_create(&thread, NULL, board_thread, &uhid)) {
+		fprintf(stderr, "pthread_create failed\n");
+		thelio_uhid_destroy(&uhid);
+		return -1;
+	}
+
+	due = now() + 10;
+	while (thelio_uhid_hwmon(REPLAY_PHYS, hwmon, sizeof(hwmon)) && !stop) {
+		if (now() > due) {
+			fprintf(stderr, "system76-thelio-io did not bind, is it loaded?\n");
+			goto out;
+		}
+		usleep(100000);
+	}
+	if (stop)
+		goto out;
+
+	if (debugfs_dir(hwmon, debugfs, sizeof(debugfs)) ||
+	    debugfs_write(debugfs, "capture_enable", "1")) {
+		fprintf(stderr, "no debugfs capture for %s, replaying without it\n", hwmon);
+		debugfs[0] = 0;
+	} else {
+		/* the probe is not part of the workload */
+		debugfs_drain(debugfs, NULL);
+	}
+
+	start = now();
+	for (i = 0; i < trace->len && !stop; i++) {
+		record = &trace->records[i];
+		if (speed > 0) {
+			due = start + (record->timestamp_ns - trace->records[0].timestamp_ns) / 1e9 / speed;
+			sleep_until(due);
+			behind = fmax(behind, now() - due);
+		}
+
+		pthread_mutex_lock(&board.lock);
+		board_track(record);
+		pthread_mutex_unlock(&board.lock);
+
+		channel = record->tx[THELIO_IO_REPORT_DATA];
+		if (!is_thelio(record) || channel >= FANS) {
+			skipped++;
+			continue;
+		}
+
+		value = -1;
+		switch (record->tx[THELIO_IO_REPORT_CMD]) {
+		case THELIO_IO_CMD_FAN_TACH:
+			snprintf(attr, sizeof(attr), "fan%u_input", channel + 1);
+			break;
+		case THELIO_IO_CMD_FAN_GET:
+			snprintf(attr, sizeof(attr), "pwm%u", channel + 1);
+			break;
+		case THELIO_IO_CMD_FAN_SET:
+			snprintf(attr, sizeof(attr), "pwm%u", channel + 1);
+			value = record->tx[THELIO_IO_REPORT_DATA + 1];
+			break;
+		default:
+			/* LED_SET_MODE comes from the PM notifier, not from userspace */
+			skipped++;
+			continue;
+		}
+
+		pthread_mutex_lock(&board.lock);
+		board.expect = record;
+		pthread_mutex_unlock(&board.lock);
+
+		if (sysfs_access(hwmon, attr, value) && !record->result)
+			failed++;
+
+		/* a read served from the sample ring never reaches the board */
+		pthread_mutex_lock(&board.lock);
+		board.expect = NULL;
+		pthread_mutex_unlock(&board.lock);
+	}
+
+	printf("replayed %zu records in %.1f s, %zu skipped, %zu failed unexpectedly, "
+	       "up to %.1f ms behind schedule\n\n", trace->len - skipped, now() - start,
+	       skipped, failed, behind * 1000);
+
+	if (debugfs[0]) {
+		debugfs_drain(debugfs, &result);
+		debugfs_write(debugfs, "capture_enable", "0");
+		summarize("replay", &result);
+		debugfs_print(debugfs, "queue");
+		debugfs_print(debugfs, "latency");
+		if (out && result.len &&
+		    fwrite(result.records, sizeof(*result.records), result.len, out) != result.len)
+			perror("write");
+		free(result.records);
+	}
+
+	ret = 0;
+out:
+	stop = 1;
+	pthread_join(thread, NULL);
+	thelio_uhid_destroy(&uhid);
+	return ret;
+}
+
+static void on_signal(int sig)
+{
+	stop = 1;
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr, "usage: %s [-s] [-q] [-x speed] [-o replay.bin] capture.bin...\n"
+		"  -s  summarize only\n"
+		"  -q  answer at once instead of with the captured latency\n"
+		"  -x  divide captured times by speed, 0 for back to back (default 1)\n"
+		"  -o  save the driver's capture of the replay\n", argv0);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	struct trace trace = { 0 };
+	struct sigaction action;
+	bool summary = false;
+	double speed = 1;
+	FILE *out = NULL;
+	FILE *file;
+	size_t i;
+	int ret;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "sqx:o:")) != -1) {
+		switch (opt) {
+		case 's':
+			summary = true;
+			break;
+		case 'q':
+			board.quick = true;
+			break;
+		case 'x':
+			speed = strtod(optarg, NULL);
+			if (speed < 0)
+				usage(argv[0]);
+			break;
+		case 'o':
+			out = fopen(optarg, "wb");
+			if (!out) {
+				perror(optarg);
+				return 1;
+			}
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind == argc)
+		usage(argv[0]);
+
+	for (i = optind; i < (size_t)argc; i++) {
+		file = strcmp(argv[i], "-") ? fopen(argv[i], "rb") : stdin;
+		if (!file) {
+			perror(argv[i]);
+			return 1;
+		}
+		ret = trace_read(&trace, file, argv[i]);
+		if (file != stdin)
+			fclose(file);
+		if (ret)
+			return 1;
+	}
+	/* drains concatenated from several reads are in order, files may not be */
+	qsort(trace.records, trace.len, sizeof(*trace.records), compare_record);
+
+	summarize("capture", &trace);
+	if (summary || !trace.len)
+		return 0;
+
+	for (i = 0; i < trace.len && !is_thelio(&trace.records[i]); i++)
+		;
+	if (i == trace.len) {
+		fprintf(stderr, "no Thelio Io commands to replay, Io captures can only be summarized\n");
+		return 1;
+	}
+
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = on_signal;
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+
+	ret = replay(&trace, speed, out);
+	if (out)
+		fclose(out);
+
+	return ret ? 1 : 0;
+}
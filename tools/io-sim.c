@@ -0,0 +1,895 @@
+/*
+ * io-sim.c
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This program is free software;  you can redistribute it and/or modify
+ * it under the terms of the  GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is  distributed in the hope that it  will be useful, but
+ * WITHOUT  ANY   WARRANTY;  without   even  the  implied   warranty  of
+ * MERCHANTABILITY  or FITNESS FOR  A PARTICULAR  PURPOSE.  See  the GNU
+ * General Public License for more details.
+ *
+ * You should  have received  a copy of  the GNU General  Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Closed-loop thermal plant for comparing fan control policies.
+ *
+ * The plant is a CPU heat source with a lumped heat capacity, cooled by
+ * airflow proportional to the mean fan speed. Every fan follows its duty
+ * with a first order lag and stops below a minimum duty. The workload is a
+ * list of power steps, and each step is scored for settling time and
+ * overshoot of both the CPU temperature and the fan speed.
+ *
+ * -b thelio creates a Thelio Io stand-in on /dev/uhid, which
+ * system76-thelio-io binds to. The plant answers the driver's reports and
+ * the policy runs against the driver's hwmon attributes, so the run takes
+ * real time and measures the driver as built and loaded.
+ *
+ * -b io runs an Io board in process, as no CDC stand-in is available
+ * without USB gadget support. Commands are formatted like
+ * system76-io_dev.c formats them, replies are cut into IO_MSG_SIZE packets
+ * and read back with the driver's own parser, and the simulation runs as
+ * fast as the host allows.
+ *
+ * Policies:
+ *   curve  userspace writes pwmN from a temperature curve every interval
+ *   ramp   like curve, with pwmN_ramp_rate limiting the slew in the driver
+ *   target userspace writes fanN_target from the curve (or -T) and the
+ *          in-kernel regulator of system76-io_pid.c drives the duty, for
+ *          -b io that regulator runs here every -s ms like io_pid_run
+ *
+ * Transactions are counted at the board, CPU cost is that of this process
+ * and, for -b thelio, of the whole system from /proc/stat.
+ */
+
+#include <getopt.h>
+#include <math.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#include "kshim.h"
+
+#include "../system76-io_proto.h"
+#include "../system76-io_parser.c"
+#include "../system76-io_pid.c"
+#include "thelio-uhid.c"
+
+#define FANS_MAX	4
+#define STEP_MS		10
+#define PHASES_MAX	16
+#define CURVE_MAX	16
+#define SIM_PHYS	"io-sim"
+
+/* plant constants, a tower cooler on a desktop CPU */
+#define AMBIENT_C	25.0
+#define HEAT_CAPACITY	150.0	/* J/K */
+#define CONDUCT_IDLE	0.4	/* W/K with the fans stopped */
+#define CONDUCT_FAN	2.6	/* W/K added at full airflow */
+#define RPM_MAX		2040.0	/* 8 RPM per PWM unit */
+#define STALL_DUTY	0.08	/* fans stop below this duty */
+#define FAN_TAU_MS	900.0
+
+enum board {
+	BOARD_IO,
+	BOARD_THELIO,
+};
+
+enum policy {
+	POLICY_CURVE,
+	POLICY_RAMP,
+	POLICY_TARGET,
+};
+
+struct phase {
+	double power;	/* W */
+	double seconds;
+	size_t start;	/* first trace sample */
+	size_t end;
+};
+
+struct point {
+	double temp;
+	double percent;
+};
+
+struct plant {
+	double temp;
+	double power;
+	double duty[FANS_MAX];	/* 0 to 1 */
+	double rpm[FANS_MAX];
+};
+
+struct trace {
+	double *temp;
+	double *rpm;
+	size_t len;
+	size_t cap;
+};
+
+enum io_kind {
+	IO_KIND_TACH,
+	IO_KIND_DUTY,
+};
+
+/* Io board in process, see io_board_exchange */
+struct io_board {
+	struct io_parser parser;
+	char tx[IO_MSG_SIZE];
+	unsigned long commands;
+	unsigned long errors;
+};
+
+static const char * const io_fans[] = { "CPUF", "INTF" }; /* IO_FANS */
+
+static enum board board = BOARD_THELIO;
+static enum policy policy = POLICY_CURVE;
+static unsigned int fans;
+static unsigned int interval_ms = 1000;
+static unsigned int ramp_rate = 25;
+static unsigned int push_ms;
+static unsigned int sample_ms = 250;
+static unsigned int fixed_rpm;
+static struct io_pid_gains gains;
+static bool gains_set;
+static struct phase phases[PHASES_MAX];
+static size_t phases_len;
+static struct point curve[CURVE_MAX];
+static size_t curve_len;
+static struct plant plant;
+static struct trace trace;
+static unsigned long commands[256]; /* Thelio Io command codes, or enum io_kind */
+static pthread_mutex_t plant_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t phase_cur = SIZE_MAX;
+static volatile sig_atomic_t stop;
+
+static void plant_step(double dt)
+{
+	double airflow = 0;
+	double target;
+	unsigned int i;
+
+	for (i = 0; i < fans; i++) {
+		target = plant.duty[i] < STALL_DUTY ? 0 : plant.duty[i] * RPM_MAX;
+		plant.rpm[i] += (target - plant.rpm[i]) * (1 - exp(-dt * 1000 / FAN_TAU_MS));
+		airflow += plant.rpm[i] / RPM_MAX;
+	}
+	airflow /= fans;
+
+	plant.temp += (plant.power - (CONDUCT_IDLE + CONDUCT_FAN * airflow) *
+		       (plant.temp - AMBIENT_C)) * dt / HEAT_CAPACITY;
+}
+
+static double plant_rpm(void)
+{
+	double rpm = 0;
+	unsigned int i;
+
+	for (i = 0; i < fans; i++)
+		rpm += plant.rpm[i];
+	return rpm / fans;
+}
+
+static void trace_add(void)
+{
+	if (trace.len == trace.cap) {
+		trace.cap = trace.cap ? trace.cap * 2 : 4096;
+		trace.temp = realloc(trace.temp, trace.cap * sizeof(*trace.temp));
+		trace.rpm = realloc(trace.rpm, trace.cap * sizeof(*trace.rpm));
+		if (!trace.temp || !trace.rpm) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	trace.temp[trace.len] = plant.temp;
+	trace.rpm[trace.len] = plant_rpm();
+	trace.len++;
+}
+
+/* percent of full duty for the current temperature, linear between points */
+static double curve_percent(double temp)
+{
+	size_t i;
+
+	if (temp <= curve[0].temp)
+		return curve[0].percent;
+	for (i = 1; i < curve_len; i++) {
+		if (temp < curve[i].temp)
+			return curve[i - 1].percent + (curve[i].percent - curve[i - 1].percent) *
+			       (temp - curve[i - 1].temp) / (curve[i].temp - curve[i - 1].temp);
+	}
+	return curve[curve_len - 1].percent;
+}
+
+/* Io: answers one command the way the board firmware does */
+static size_t io_board_reply(const char *cmd, char *reply, size_t size)
+{
+	size_t name = strlen(IO_CMD_DUTY);
+	unsigned int value;
+	unsigned int i;
+	char end;
+
+	for (i = 0; i < fans; i++) {
+		if (strncmp(cmd + name, io_fans[i], 4))
+			continue;
+
+		if (!strncmp(cmd, IO_CMD_TACH, name) && cmd[name + 4] == '\r')
+			return snprintf(reply, size, "\r\n%04X\r\n\r\n" IO_REPLY_OK "\r\n",
+					(unsigned int)lround(plant.rpm[i] / IO_TACH_SCALE));
+		if (!strncmp(cmd, IO_CMD_DUTY, name) && cmd[name + 4] == '\r')
+			return snprintf(reply, size, "\r\n%04X\r\n\r\n" IO_REPLY_OK "\r\n",
+					(unsigned int)lround(plant.duty[i] * IO_DUTY_MAX));
+		if (!strncmp(cmd, IO_CMD_DUTY, name) &&
+		    sscanf(cmd + name + 4, "%4X%c", &value, &end) == 2 && end == '\r' &&
+		    value <= IO_DUTY_MAX) {
+			plant.duty[i] = (double)value / IO_DUTY_MAX;
+			return snprintf(reply, size, "\r\n" IO_REPLY_OK "\r\n");
+		}
+	}
+
+	return snprintf(reply, size, "\r\n" IO_REPLY_ERROR "\r\n\r\n" IO_REPLY_OK "\r\n");
+}
+
+/*
+ * Io: one command as io_dev_exchange runs it, with the reply fed to the
+ * parser in IO_MSG_SIZE packets. Returns the reply line or NULL on errors.
+ */
+static const char *io_board_exchange(struct io_board *io, enum io_kind kind)
+{
+	char stream[4 * IO_MSG_SIZE];
+	const char *error;
+	size_t len;
+	size_t pos;
+	int ret = 0;
+
+	commands[kind]++;
+	io->commands++;
+
+	len = io_board_reply(io->tx, stream, sizeof(stream));
+	io_parser_init(&io->parser);
+	for (pos = 0; pos < len && !ret; pos += IO_MSG_SIZE) {
+		ret = io_parser_feed(&io->parser, stream + pos, min((size_t)IO_MSG_SIZE, len - pos),
+				     &error);
+	}
+	if (ret != 1 || io->parser.error) {
+		io->errors++;
+		return NULL;
+	}
+
+	return io_parser_reply(&io->parser);
+}
+
+static int io_board_tach(struct io_board *io, unsigned int fan, unsigned int *rpm)
+{
+	const char *reply;
+
+	snprintf(io->tx, IO_MSG_SIZE, IO_CMD_TACH "%s\r", io_fans[fan]);
+	reply = io_board_exchange(io, IO_KIND_TACH);
+	if (!reply)
+		return -1;
+
+	*rpm = strtoul(reply, NULL, 16) * IO_TACH_SCALE;
+	return 0;
+}
+
+static int io_board_set_duty(struct io_board *io, unsigned int fan, unsigned int pwm)
+{
+	/* io_pwm_to_duty */
+	snprintf(io->tx, IO_MSG_SIZE, IO_CMD_DUTY "%s%04X\r", io_fans[fan],
+		 pwm * IO_DUTY_MAX / 255);
+	return io_board_exchange(io, IO_KIND_DUTY) ? 0 : -1;
+}
+
+/* Thelio Io: answers one report the way the board firmware does */
+static void thelio_board_reply(const uint8_t *cmd, uint8_t *reply)
+{
+	unsigned int channel = cmd[THELIO_IO_REPORT_DATA];
+	unsigned int value;
+
+	commands[cmd[THELIO_IO_REPORT_CMD]]++;
+
+	memset(reply, 0, THELIO_IO_REPORT_SIZE);
+	reply[THELIO_IO_REPORT_CMD] = cmd[THELIO_IO_REPORT_CMD];
+	reply[THELIO_IO_REPORT_DATA] = channel;
+
+	switch (cmd[THELIO_IO_REPORT_CMD]) {
+	case THELIO_IO_CMD_FAN_GET:
+		if (channel >= fans)
+			goto error;
+		reply[THELIO_IO_REPORT_DATA + 1] = lround(plant.duty[channel] * 255);
+		break;
+	case THELIO_IO_CMD_FAN_SET:
+		if (channel >= fans)
+			goto error;
+		plant.duty[channel] = cmd[THELIO_IO_REPORT_DATA + 1] / 255.0;
+		reply[THELIO_IO_REPORT_DATA + 1] = cmd[THELIO_IO_REPORT_DATA + 1];
+		break;
+	case THELIO_IO_CMD_FAN_TACH:
+		if (channel >= fans)
+			goto error;
+		value = lround(plant.rpm[channel]);
+		reply[THELIO_IO_REPORT_DATA + 1] = value & 0xFF;
+		reply[THELIO_IO_REPORT_DATA + 2] = value >> 8;
+		break;
+	case THELIO_IO_CMD_LED_SET_MODE:
+		break;
+	default:
+		goto error;
+	}
+	return;
+
+error:
+	reply[THELIO_IO_REPORT_RES] = 1;
+}
+
+static void thelio_board_push(struct thelio_uhid *uhid)
+{
+	uint8_t report[THELIO_IO_REPORT_SIZE];
+	unsigned int value;
+	unsigned int i;
+
+	for (i = 0; i < fans; i++) {
+		memset(report, 0, sizeof(report));
+		value = lround(plant.rpm[i]);
+		report[THELIO_IO_REPORT_CMD] = THELIO_IO_CMD_FAN_TACH;
+		report[THELIO_IO_REPORT_DATA] = i;
+		report[THELIO_IO_REPORT_DATA + 1] = value & 0xFF;
+		report[THELIO_IO_REPORT_DATA + 2] = value >> 8;
+		thelio_uhid_send(uhid, report);
+	}
+}
+
+static int sysfs_write(const char *dir, const char *attr, unsigned int value)
+{
+	char path[PATH_MAX];
+	FILE *file;
+	int ret;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, attr);
+	file = fopen(path, "w");
+	if (!file) {
+		perror(path);
+		return -1;
+	}
+	ret = fprintf(file, "%u\n", value) < 0;
+	ret |= fclose(file) != 0;
+	if (ret)
+		fprintf(stderr, "%s: write %u failed\n", path, value);
+	return ret ? -1 : 0;
+}
+
+static double now(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double cpu_self(void)
+{
+	struct rusage usage;
+
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+	       usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+/* busy seconds over all CPUs, from the first line of /proc/stat */
+static double cpu_system(void)
+{
+	unsigned long long v[8] = { 0 };
+	FILE *file;
+	int n;
+
+	file = fopen("/proc/stat", "r");
+	if (!file)
+		return 0;
+	n = fscanf(file, "cpu %llu %llu %llu %llu %llu %llu %llu %llu",
+		   &v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7]);
+	fclose(file);
+	if (n < 4)
+		return 0;
+
+	/* everything but idle and iowait */
+	return (double)(v[0] + v[1] + v[2] + v[5] + v[6] + v[7]) / sysconf(_SC_CLK_TCK);
+}
+
+/* the policy decision made every interval_ms, a PWM or for POLICY_TARGET an RPM */
+static unsigned int policy_value(void)
+{
+	if (policy != POLICY_TARGET)
+		return lround(curve_percent(plant.temp) * 255 / 100);
+	if (fixed_rpm)
+		return fixed_rpm;
+	/* 0 would stop the regulator */
+	return max(1L, lround(curve_percent(plant.temp) * RPM_MAX / 100));
+}
+
+/* sets the workload power for time t and tracks which samples each phase owns */
+static void phase_power(double t)
+{
+	double end = 0;
+	size_t i;
+
+	for (i = 0; i < phases_len - 1; i++) {
+		end += phases[i].seconds;
+		if (t < end)
+			break;
+	}
+
+	if (i != phase_cur) {
+		if (phase_cur != SIZE_MAX)
+			phases[phase_cur].end = trace.len;
+		phases[i].start = trace.len;
+		phase_cur = i;
+	}
+	plant.power = phases[i].power;
+}
+
+static void phase_finish(void)
+{
+	if (phase_cur != SIZE_MAX)
+		phases[phase_cur].end = trace.len;
+}
+
+static double total_seconds(void)
+{
+	double total = 0;
+	size_t i;
+
+	for (i = 0; i < phases_len; i++)
+		total += phases[i].seconds;
+	return total;
+}
+
+/* io_pid_run and io_duty_work without ramping, on duty in PWM thousandths */
+static void io_regulate(struct io_board *io, struct io_pid *pid, unsigned int *last, u64 now_ns)
+{
+	unsigned int rpm;
+	unsigned int pwm;
+	unsigned int i;
+	u32 out;
+
+	for (i = 0; i < fans; i++) {
+		if (!pid[i].target || io_board_tach(io, i, &rpm))
+			continue;
+
+		out = io_pid_update(&pid[i], &gains, rpm, now_ns);
+		pwm = DIV_ROUND_CLOSEST(out, 1000);
+		if (pwm != last[i] && !io_board_set_duty(io, i, pwm))
+			last[i] = pwm;
+	}
+}
+
+static int run_io(double *seconds)
+{
+	struct io_pid pid[FANS_MAX];
+	struct io_board io;
+	unsigned int last[FANS_MAX];
+	unsigned int steps;
+	unsigned int step;
+	unsigned int value;
+	unsigned int rpm;
+	unsigned int i;
+
+	memset(&io, 0, sizeof(io));
+	memset(pid, 0, sizeof(pid));
+	memset(last, 0, sizeof(last));
+
+	steps = lround(total_seconds() * 1000 / STEP_MS);
+	for (step = 0; step < steps && !stop; step++) {
+		phase_power(step * STEP_MS / 1000.0);
+
+		if (step % (interval_ms / STEP_MS) == 0) {
+			/* what a userspace daemon reads and writes each interval */
+			value = policy_value();
+			for (i = 0; i < fans; i++) {
+				io_board_tach(&io, i, &rpm);
+				if (policy == POLICY_TARGET) {
+					if (!pid[i].target)
+						io_pid_start(&pid[i], &gains, value, last[i] * 1000);
+					else
+						pid[i].target = value;
+				} else if (value != last[i] && !io_board_set_duty(&io, i, value)) {
+					last[i] = value;
+				}
+			}
+		}
+
+		if (policy == POLICY_TARGET && step % (sample_ms / STEP_MS) == 0)
+			io_regulate(&io, pid, last, (u64)step * STEP_MS * NSEC_PER_MSEC);
+
+		plant_step(STEP_MS / 1000.0);
+		trace_add();
+	}
+	phase_finish();
+
+	*seconds = step * STEP_MS / 1000.0;
+	if (io.errors)
+		fprintf(stderr, "%lu of %lu commands failed\n", io.errors, io.commands);
+	return 0;
+}
+
+/*
+ * Thelio Io: answers reports on its own thread, as hwmon stores like pwmN
+ * block until the driver got its reply
+ */
+static void *thelio_board_thread(void *data)
+{
+	struct thelio_uhid *uhid = data;
+	uint8_t report[THELIO_IO_REPORT_SIZE];
+	uint8_t reply[THELIO_IO_REPORT_SIZE];
+	int ret;
+
+	while (!stop) {
+		ret = thelio_uhid_poll(uhid, report, 100);
+		if (ret < 0) {
+			stop = 1;
+			break;
+		}
+		if (ret > 0) {
+			pthread_mutex_lock(&plant_lock);
+			thelio_board_reply(report, reply);
+			pthread_mutex_unlock(&plant_lock);
+			thelio_uhid_send(uhid, reply);
+		}
+	}
+
+	return NULL;
+}
+
+static void sleep_until(double t)
+{
+	struct timespec ts;
+
+	ts.tv_sec = (time_t)t;
+	ts.tv_nsec = (long)((t - ts.tv_sec) * 1e9);
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR && !stop)
+		;
+}
+
+static int run_thelio(double *seconds)
+{
+	struct thelio_uhid uhid;
+	pthread_t thread;
+	char hwmon[PATH_MAX] = "";
+	char attr[32];
+	unsigned int last = UINT_MAX;
+	unsigned int value;
+	unsigned int step;
+	unsigned int i;
+	double deadline;
+	double start;
+	int ret = -1;
+
+	if (thelio_uhid_create(&uhid, "System76 Thelio Io (io-sim)", SIM_PHYS))
+		return -1;
+
+	if (pthread_create(&thread, NULL, thelio_board_thread, &uhid)) {
+		fprintf(stderr, "pthread_create failed\n");
+		thelio_uhid_destroy(&uhid);
+		return -1;
+	}
+
+	/* the board thread serves the probe until the driver registers hwmon */
+	deadline = now(CLOCK_MONOTONIC) + 10;
+	while (thelio_uhid_hwmon(SIM_PHYS, hwmon, sizeof(hwmon)) && !stop) {
+		if (now(CLOCK_MONOTONIC) > deadline) {
+			fprintf(stderr, "system76-thelio-io did not bind, is it loaded?\n");
+			goto out;
+		}
+		usleep(100000);
+	}
+	if (stop)
+		goto out;
+	fprintf(stderr, "driver bound at %s\n", hwmon);
+
+	for (i = 0; i < fans; i++) {
+		snprintf(attr, sizeof(attr), "pwm%u_ramp_rate", i + 1);
+		if (sysfs_write(hwmon, attr, policy == POLICY_RAMP ? ramp_rate : 0))
+			goto out;
+	}
+	if (gains_set && (sysfs_write(hwmon, "fan_pid_kp", gains.kp) ||
+			  sysfs_write(hwmon, "fan_pid_ki", gains.ki) ||
+			  sysfs_write(hwmon, "fan_pid_kd", gains.kd)))
+		goto out;
+
+	pthread_mutex_lock(&plant_lock);
+	memset(commands, 0, sizeof(commands));
+	pthread_mutex_unlock(&plant_lock);
+
+	/* the plant runs in fixed steps on an absolute schedule, catching up
+	 * after a policy write that blocked */
+	start = now(CLOCK_MONOTONIC);
+	for (step = 0; step * STEP_MS < total_seconds() * 1000 && !stop; step++) {
+		sleep_until(start + step * STEP_MS / 1000.0);
+
+		pthread_mutex_lock(&plant_lock);
+		phase_power(step * STEP_MS / 1000.0);
+		plant_step(STEP_MS / 1000.0);
+		trace_add();
+		value = policy_value();
+		pthread_mutex_unlock(&plant_lock);
+
+		if (push_ms && step % (push_ms / STEP_MS) == 0) {
+			pthread_mutex_lock(&plant_lock);
+			thelio_board_push(&uhid);
+			pthread_mutex_unlock(&plant_lock);
+		}
+
+		if (step % (interval_ms / STEP_MS) == 0 && value != last) {
+			for (i = 0; i < fans; i++) {
+				snprintf(attr, sizeof(attr),
+					 policy == POLICY_TARGET ? "fan%u_target" : "pwm%u", i + 1);
+				sysfs_write(hwmon, attr, value);
+			}
+			last = value;
+		}
+	}
+	phase_finish();
+
+	*seconds = step * STEP_MS / 1000.0;
+	ret = 0;
+out:
+	/* hand the fans back to pwmN so the driver stops regulating */
+	if (policy == POLICY_TARGET && hwmon[0]) {
+		for (i = 0; i < fans; i++) {
+			snprintf(attr, sizeof(attr), "fan%u_target", i + 1);
+			sysfs_write(hwmon, attr, 0);
+		}
+	}
+	stop = 1;
+	pthread_join(thread, NULL);
+	thelio_uhid_destroy(&uhid);
+	return ret;
+}
+
+struct score {
+	double start;
+	double final;
+	double settle;	/* seconds, negative if it never settled */
+	double overshoot; /* percent of the step */
+};
+
+static void score_phase(const double *v, const struct phase *phase, double floor, struct score *s)
+{
+	size_t len = phase->end - phase->start;
+	size_t tail = len / 10 ? len / 10 : 1;
+	double band;
+	double step;
+	double over = 0;
+	size_t last = 0;
+	size_t i;
+
+	s->start = v[phase->start];
+	s->final = 0;
+	for (i = phase->end - tail; i < phase->end; i++)
+		s->final += v[i];
+	s->final /= tail;
+
+	step = s->final - s->start;
+	band = fmax(fabs(step) * 0.02, floor);
+	for (i = phase->start; i < phase->end; i++) {
+		if (fabs(v[i] - s->final) > band)
+			last = i - phase->start + 1;
+		if (step > 0)
+			over = fmax(over, v[i] - s->final);
+		else
+			over = fmax(over, s->final - v[i]);
+	}
+
+	s->settle = last >= len ? -1 : last * STEP_MS / 1000.0;
+	s->overshoot = fabs(step) > floor ? over * 100 / fabs(step) : 0;
+}
+
+static void report(double seconds, double cpu, double sys)
+{
+	static const char * const names[256] = {
+		[THELIO_IO_CMD_FAN_GET] = "FAN_GET",
+		[THELIO_IO_CMD_FAN_SET] = "FAN_SET",
+		[THELIO_IO_CMD_FAN_TACH] = "FAN_TACH",
+		[THELIO_IO_CMD_LED_SET_MODE] = "LED_SET_MODE",
+	};
+	struct score temp;
+	struct score rpm;
+	unsigned long total = 0;
+	char settle[2][16];
+	size_t i;
+
+	printf("%-5s %6s  %-24s %8s %9s  %-24s %8s %9s\n", "phase", "power",
+	       "temp C start -> final", "settle", "overshoot",
+	       "rpm start -> final", "settle", "overshoot");
+	for (i = 0; i < phases_len; i++) {
+		if (phases[i].end <= phases[i].start)
+			continue;
+		score_phase(trace.temp, &phases[i], 0.5, &temp);
+		score_phase(trace.rpm, &phases[i], IO_TACH_SCALE, &rpm);
+		snprintf(settle[0], sizeof(settle[0]), temp.settle < 0 ? "never" : "%.1f s", temp.settle);
+		snprintf(settle[1], sizeof(settle[1]), rpm.settle < 0 ? "never" : "%.1f s", rpm.settle);
+		printf("%-5zu %5.0fW  %7.1f -> %-13.1f %8s %8.1f%%  %7.0f -> %-13.0f %8s %8.1f%%\n",
+		       i + 1, phases[i].power, temp.start, temp.final, settle[0], temp.overshoot,
+		       rpm.start, rpm.final, settle[1], rpm.overshoot);
+	}
+
+	printf("\ntransactions per minute\n");
+	for (i = 0; i < 256; i++) {
+		if (!commands[i])
+			continue;
+		total += commands[i];
+		if (board == BOARD_THELIO)
+			printf("  %-12s %10.1f\n", names[i] ? names[i] : "?", commands[i] * 60 / seconds);
+		else
+			printf("  %-12s %10.1f\n", i == IO_KIND_TACH ? IO_CMD_TACH : IO_CMD_DUTY,
+			       commands[i] * 60 / seconds);
+	}
+	printf("  %-12s %10.1f\n", "total", total * 60 / seconds);
+
+	printf("\ncpu\n");
+	printf("  %-12s %10.2f ms per second simulated\n", "io-sim", cpu * 1000 / seconds);
+	if (board == BOARD_THELIO)
+		printf("  %-12s %10.2f ms per second, all CPUs\n", "system", sys * 1000 / seconds);
+}
+
+static int parse_pairs(const char *arg, double *a, double *b, size_t stride, size_t max)
+{
+	const char *p = arg;
+	size_t n = 0;
+	int len;
+
+	while (*p) {
+		if (n == max || sscanf(p, "%lf:%lf%n", a + n * stride, b + n * stride, &len) != 2)
+			return -1;
+		n++;
+		p += len;
+		if (*p == ',')
+			p++;
+		else if (*p)
+			return -1;
+	}
+	return n;
+}
+
+static void on_signal(int sig)
+{
+	stop = 1;
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr,
+		"usage: %s [-b io|thelio] [-p curve|ramp|target] [-f fans] [-i interval_ms]\n"
+		"       [-r ramp_rate] [-u push_ms] [-s sample_ms] [-T rpm] [-g kp:ki:kd]\n"
+		"       [-w watts:seconds,...] [-c celsius:percent,...]\n",
+		argv0);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	struct sigaction action;
+	double seconds = 0;
+	double cpu;
+	double sys;
+	int ret;
+	int opt;
+	int n;
+
+	n = parse_pairs("15:30,120:180,15:120", &phases[0].power, &phases[0].seconds,
+			sizeof(phases[0]) / sizeof(double), PHASES_MAX);
+	phases_len = n;
+	n = parse_pairs("40:25,55:35,65:50,75:75,85:100", &curve[0].temp, &curve[0].percent,
+			sizeof(curve[0]) / sizeof(double), CURVE_MAX);
+	curve_len = n;
+
+	/* gains come from -g rather than sysfs strings, and -b io never stops a regulator */
+	(void)io_pid_gain_parse;
+	(void)io_pid_windup_parse;
+	(void)io_pid_stop;
+
+	io_pid_gains_init(&gains);
+
+	while ((opt = getopt(argc, argv, "b:p:f:i:r:u:s:T:g:w:c:")) != -1) {
+		switch (opt) {
+		case 'b':
+			if (!strcmp(optarg, "io"))
+				board = BOARD_IO;
+			else if (!strcmp(optarg, "thelio"))
+				board = BOARD_THELIO;
+			else
+				usage(argv[0]);
+			break;
+		case 'p':
+			if (!strcmp(optarg, "curve"))
+				policy = POLICY_CURVE;
+			else if (!strcmp(optarg, "ramp"))
+				policy = POLICY_RAMP;
+			else if (!strcmp(optarg, "target"))
+				policy = POLICY_TARGET;
+			else
+				usage(argv[0]);
+			break;
+		case 'f':
+			fans = strtoul(optarg, NULL, 0);
+			break;
+		case 'i':
+			interval_ms = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			ramp_rate = strtoul(optarg, NULL, 0);
+			break;
+		case 'u':
+			push_ms = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			sample_ms = strtoul(optarg, NULL, 0);
+			break;
+		case 'T':
+			fixed_rpm = strtoul(optarg, NULL, 0);
+			break;
+		case 'g':
+			if (sscanf(optarg, "%d:%d:%d", &gains.kp, &gains.ki, &gains.kd) != 3)
+				usage(argv[0]);
+			gains_set = true;
+			break;
+		case 'w':
+			n = parse_pairs(optarg, &phases[0].power, &phases[0].seconds,
+					sizeof(phases[0]) / sizeof(double), PHASES_MAX);
+			if (n < 1)
+				usage(argv[0]);
+			phases_len = n;
+			break;
+		case 'c':
+			n = parse_pairs(optarg, &curve[0].temp, &curve[0].percent,
+					sizeof(curve[0]) / sizeof(double), CURVE_MAX);
+			if (n < 1)
+				usage(argv[0]);
+			curve_len = n;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc)
+		usage(argv[0]);
+
+	if (!fans)
+		fans = board == BOARD_IO ? ARRAY_SIZE(io_fans) : FANS_MAX;
+	if (fans > (board == BOARD_IO ? ARRAY_SIZE(io_fans) : FANS_MAX) ||
+	    interval_ms < STEP_MS || interval_ms % STEP_MS || push_ms % STEP_MS ||
+	    sample_ms < STEP_MS || sample_ms % STEP_MS || fixed_rpm > IO_PID_TARGET_MAX)
+		usage(argv[0]);
+	if (board == BOARD_IO && (policy == POLICY_RAMP || push_ms)) {
+		fprintf(stderr, "-p ramp and -u need the driver, use -b thelio\n");
+		return 2;
+	}
+
+	plant.temp = AMBIENT_C + 10;
+
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = on_signal;
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+
+	cpu = cpu_self();
+	sys = cpu_system();
+	if (board == BOARD_IO)
+		ret = run_io(&seconds);
+	else
+		ret = run_thelio(&seconds);
+	cpu = cpu_self() - cpu;
+	sys = cpu_system() - sys;
+	if (ret || seconds <= 0)
+		return 1;
+
+	report(seconds, cpu, sys);
+
+	return 0;
+}
@@ -0,0 +1,676 @@
+/*
+ * io-usbmon.c
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This program is free software;  you can redistribute it and/or modify
+ * it under the terms of the  GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is  distributed in the hope that it  will be useful, but
+ * WITHOUT  ANY   WARRANTY;  without   even  the  implied   warranty  of
+ * MERCHANTABILITY  or FITNESS FOR  A PARTICULAR  PURPOSE.  See  the GNU
+ * General Public License for more details.
+ *
+ * You should  have received  a copy of  the GNU General  Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Decodes Io and Thelio Io traffic from usbmon, either live from
+ * /dev/usbmonN (until interrupted) or from a pcap file written by
+ * Wireshark or tcpdump on a usbmonN interface, and prints per command
+ * counts, rates, errors and request to response latency.
+ *
+ * Io commands are the bulk OUT submissions on IO_EP_OUT, answered by the
+ * bulk IN completions on IO_EP_IN up to the final OK or ERROR line. Thelio
+ * Io commands are 32 byte interrupt OUT reports or SET_REPORT requests,
+ * answered by the next 32 byte interrupt IN report echoing the command.
+ *
+ * Only devices with the Io or Thelio Io vendor and product ids are decoded.
+ * A live capture looks them up in sysfs, a pcap file only knows the ids of
+ * devices it saw enumerate. -d BUS:DEV decodes that one device whatever it
+ * is.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include "../system76-io_proto.h"
+#include "../system76-io_parser.c"
+
+/* binary usbmon interface, see Documentation/usb/usbmon.rst */
+struct usbmon_packet {
+	uint64_t id;
+	uint8_t type;
+	uint8_t xfer_type;
+	uint8_t epnum;
+	uint8_t devnum;
+	uint16_t busnum;
+	int8_t flag_setup;
+	int8_t flag_data;
+	int64_t ts_sec;
+	int32_t ts_usec;
+	int32_t status;
+	uint32_t length;
+	uint32_t len_cap;
+	uint8_t setup[8];
+	int32_t interval;
+	int32_t start_frame;
+	uint32_t xfer_flags;
+	uint32_t ndesc;
+};
+
+struct mon_bin_get {
+	struct usbmon_packet *hdr;
+	void *data;
+	size_t alloc;
+};
+
+#define MON_IOC_MAGIC	0x92
+#define MON_IOCX_GETX	_IOW(MON_IOC_MAGIC, 10, struct mon_bin_get)
+
+#define USBMON_HDR_LEGACY	48
+#define USBMON_HDR_MMAPPED	64
+
+#define XFER_INTR	1
+#define XFER_CONTROL	2
+#define XFER_BULK	3
+
+#define USB_REQ_GET_DESCRIPTOR	0x06
+#define USB_DT_DEVICE		0x01
+
+#define LINKTYPE_USB_LINUX		189
+#define LINKTYPE_USB_LINUX_MMAPPED	220
+
+#define PCAP_MAGIC_USEC	0xa1b2c3d4
+#define PCAP_MAGIC_NSEC	0xa1b23c4d
+
+#define MAX_DATA	65536
+#define MAX_DEVICES	32
+#define MAX_STATS	128
+#define NAME_SIZE	24
+
+struct pcap_header {
+	uint32_t magic;
+	uint16_t version_major;
+	uint16_t version_minor;
+	int32_t thiszone;
+	uint32_t sigfigs;
+	uint32_t snaplen;
+	uint32_t linktype;
+};
+
+struct pcap_record {
+	uint32_t ts_sec;
+	uint32_t ts_frac;
+	uint32_t incl_len;
+	uint32_t orig_len;
+};
+
+struct command {
+	unsigned int busnum;
+	unsigned int devnum;
+	char name[NAME_SIZE];
+	unsigned long count;
+	unsigned long errors;
+	double *latency; /* microseconds, completed requests only */
+	size_t len;
+	size_t cap;
+};
+
+enum device_kind {
+	KIND_UNKNOWN,
+	KIND_IO,
+	KIND_THELIO,
+	KIND_OTHER,
+};
+
+struct device {
+	unsigned int busnum;
+	unsigned int devnum;
+	enum device_kind kind;
+	bool descriptor_pending;
+	uint64_t descriptor_id;
+	bool pending;
+	double start;
+	char name[NAME_SIZE];
+	uint8_t cmd;
+	uint8_t channel;
+	struct io_parser parser;
+	unsigned long lost;
+	unsigned long unsolicited;
+};
+
+static struct command stats[MAX_STATS];
+static size_t stats_len;
+static struct device devices[MAX_DEVICES];
+static size_t devices_len;
+static double first_ts;
+static double last_ts;
+static int filter_bus = -1;
+static int filter_dev = -1;
+static bool live;
+static unsigned long oversize;
+static volatile sig_atomic_t stop;
+
+static void device_identify(struct device *device, unsigned int vendor, unsigned int product)
+{
+	if (vendor == IO_VENDOR && product == IO_DEVICE)
+		device->kind = KIND_IO;
+	else if (vendor == THELIO_IO_VENDOR && product == THELIO_IO_DEVICE)
+		device->kind = KIND_THELIO;
+	else
+		device->kind = KIND_OTHER;
+}
+
+static int sysfs_read(const char *name, const char *attr, int base, unsigned int *value)
+{
+	char path[PATH_MAX];
+	char buf[32];
+	FILE *file;
+	char *end;
+
+	snprintf(path, sizeof(path), "/sys/bus/usb/devices/%s/%s", name, attr);
+	file = fopen(path, "r");
+	if (!file)
+		return -1;
+
+	if (!fgets(buf, sizeof(buf), file)) {
+		fclose(file);
+		return -1;
+	}
+	fclose(file);
+
+	*value = strtoul(buf, &end, base);
+	return end == buf ? -1 : 0;
+}
+
+/* identifies a device on a live bus by its ids in sysfs */
+static void device_lookup(struct device *device)
+{
+	unsigned int busnum, devnum, vendor, product;
+	struct dirent *entry;
+	DIR *dir;
+
+	dir = opendir("/sys/bus/usb/devices");
+	if (!dir)
+		return;
+
+	while ((entry = readdir(dir))) {
+		/* interfaces are named BUS-PORT:CONFIG.INTERFACE */
+		if (entry->d_name[0] == '.' || strchr(entry->d_name, ':'))
+			continue;
+		if (sysfs_read(entry->d_name, "busnum", 10, &busnum) ||
+		    sysfs_read(entry->d_name, "devnum", 10, &devnum) ||
+		    busnum != device->busnum || devnum != device->devnum)
+			continue;
+		if (!sysfs_read(entry->d_name, "idVendor", 16, &vendor) &&
+		    !sysfs_read(entry->d_name, "idProduct", 16, &product))
+			device_identify(device, vendor, product);
+		break;
+	}
+
+	closedir(dir);
+}
+
+/* identifies a device from the GET_DESCRIPTOR(DEVICE) of its enumeration */
+static void device_descriptor(struct device *device, const struct usbmon_packet *hdr,
+			      const uint8_t *data)
+{
+	if (hdr->type == 'S' && hdr->flag_setup == 0 && hdr->setup[0] == 0x80 &&
+	    hdr->setup[1] == USB_REQ_GET_DESCRIPTOR && hdr->setup[3] == USB_DT_DEVICE) {
+		device->descriptor_pending = true;
+		device->descriptor_id = hdr->id;
+	} else if (hdr->type == 'C' && device->descriptor_pending && hdr->id == device->descriptor_id) {
+		device->descriptor_pending = false;
+		/* idVendor and idProduct, little endian at offsets 8 and 10 */
+		if (hdr->status == 0 && hdr->len_cap >= 12)
+			device_identify(device, data[8] | data[9] << 8, data[10] | data[11] << 8);
+	}
+}
+
+static struct device *device_get(unsigned int busnum, unsigned int devnum)
+{
+	struct device *device;
+	size_t i;
+
+	for (i = 0; i < devices_len; i++)
+		if (devices[i].busnum == busnum && devices[i].devnum == devnum)
+			return &devices[i];
+
+	if (devices_len == MAX_DEVICES)
+		return NULL;
+
+	device = &devices[devices_len++];
+	memset(device, 0, sizeof(*device));
+	device->busnum = busnum;
+	device->devnum = devnum;
+	if (live)
+		device_lookup(device);
+	return device;
+}
+
+static struct command *stat_get(const struct device *device, const char *name)
+{
+	struct command *stat;
+	size_t i;
+
+	for (i = 0; i < stats_len; i++) {
+		stat = &stats[i];
+		if (stat->busnum == device->busnum && stat->devnum == device->devnum &&
+		    strcmp(stat->name, name) == 0)
+			return stat;
+	}
+
+	if (stats_len == MAX_STATS)
+		return NULL;
+
+	stat = &stats[stats_len++];
+	memset(stat, 0, sizeof(*stat));
+	stat->busnum = device->busnum;
+	stat->devnum = device->devnum;
+	snprintf(stat->name, sizeof(stat->name), "%s", name);
+	return stat;
+}
+
+static void request_start(struct device *device, const char *name, double ts)
+{
+	/* the driver gave up on the previous request without a reply */
+	if (device->pending)
+		device->lost++;
+
+	device->pending = true;
+	device->start = ts;
+	snprintf(device->name, sizeof(device->name), "%s", name);
+}
+
+static void request_finish(struct device *device, bool error, double ts)
+{
+	struct command *stat;
+	double *latency;
+
+	device->pending = false;
+
+	stat = stat_get(device, device->name);
+	if (!stat)
+		return;
+
+	stat->count++;
+	if (error) {
+		stat->errors++;
+		return;
+	}
+
+	if (stat->len == stat->cap) {
+		stat->cap = stat->cap ? stat->cap * 2 : 256;
+		latency = realloc(stat->latency, stat->cap * sizeof(*latency));
+		if (!latency) {
+			perror("realloc");
+			exit(1);
+		}
+		stat->latency = latency;
+	}
+	stat->latency[stat->len++] = (ts - device->start) * 1e6;
+}
+
+/* names an Io command line by its command, telling duty reads from writes */
+static void io_command_name(const uint8_t *data, size_t len, char *name)
+{
+	static const char * const commands[] = {
+		IO_CMD_REVISION,
+		IO_CMD_BOOT,
+		IO_CMD_RESET,
+		IO_CMD_TACH,
+		IO_CMD_DUTY,
+		IO_CMD_SUSPEND,
+	};
+	size_t args;
+	size_t i;
+
+	for (i = 0; i < len && data[i] != '\r'; i++)
+		;
+	len = i;
+
+	for (i = 0; i < sizeof(commands) / sizeof(commands[0]); i++) {
+		if (len >= strlen(commands[i]) &&
+		    memcmp(data, commands[i], strlen(commands[i])) == 0) {
+			args = len - strlen(commands[i]);
+			/* IoDUTY takes a 4 character fan name and an optional value */
+			snprintf(name, NAME_SIZE, "%s%s", commands[i],
+				 strcmp(commands[i], IO_CMD_DUTY) == 0 && args > 4 ? " set" : "");
+			return;
+		}
+	}
+
+	snprintf(name, NAME_SIZE, "unknown");
+}
+
+static void io_request(struct device *device, const uint8_t *data, size_t len, double ts)
+{
+	char name[NAME_SIZE];
+
+	io_command_name(data, len, name);
+	request_start(device, name, ts);
+	io_parser_init(&device->parser);
+}
+
+static void io_response(struct device *device, int status, const uint8_t *data, size_t len,
+			double ts)
+{
+	const char *error;
+	int ret;
+
+	/* only the framing matters here, not the reply line */
+	(void)io_parser_reply;
+
+	if (!device->pending)
+		return;
+
+	/* a killed read is the driver timing out */
+	if (status) {
+		request_finish(device, true, ts);
+		return;
+	}
+
+	ret = io_parser_feed(&device->parser, (const char *)data, len, &error);
+	if (ret < 0 || device->parser.error)
+		request_finish(device, true, ts);
+	else if (ret > 0)
+		request_finish(device, false, ts);
+}
+
+static void thelio_request(struct device *device, const uint8_t *data, double ts)
+{
+	char name[NAME_SIZE];
+
+	switch (data[THELIO_IO_REPORT_CMD]) {
+	case THELIO_IO_CMD_FAN_GET:
+		snprintf(name, sizeof(name), "FAN_GET");
+		break;
+	case THELIO_IO_CMD_FAN_SET:
+		snprintf(name, sizeof(name), "FAN_SET");
+		break;
+	case THELIO_IO_CMD_LED_SET_MODE:
+		snprintf(name, sizeof(name), "LED_SET_MODE");
+		break;
+	case THELIO_IO_CMD_FAN_TACH:
+		snprintf(name, sizeof(name), "FAN_TACH");
+		break;
+	default:
+		snprintf(name, sizeof(name), "CMD_%u", data[THELIO_IO_REPORT_CMD]);
+		break;
+	}
+
+	request_start(device, name, ts);
+	device->cmd = data[THELIO_IO_REPORT_CMD];
+	device->channel = data[THELIO_IO_REPORT_DATA];
+}
+
+static void thelio_response(struct device *device, const uint8_t *data, double ts)
+{
+	bool reply;
+
+	reply = device->pending && data[THELIO_IO_REPORT_CMD] == device->cmd;
+	switch (data[THELIO_IO_REPORT_CMD]) {
+	case THELIO_IO_CMD_FAN_GET:
+	case THELIO_IO_CMD_FAN_SET:
+	case THELIO_IO_CMD_FAN_TACH:
+		reply = reply && data[THELIO_IO_REPORT_DATA] == device->channel;
+		break;
+	}
+
+	if (reply)
+		request_finish(device, data[THELIO_IO_REPORT_RES] != 0, ts);
+	else
+		device->unsolicited++;
+}
+
+static void handle(const struct usbmon_packet *hdr, const uint8_t *data)
+{
+	struct device *device;
+	size_t len = hdr->len_cap;
+	double ts;
+
+	if (filter_bus >= 0 && (hdr->busnum != filter_bus || hdr->devnum != filter_dev))
+		return;
+
+	ts = hdr->ts_sec + hdr->ts_usec * 1e-6;
+	if (!first_ts)
+		first_ts = ts;
+	last_ts = ts;
+
+	device = device_get(hdr->busnum, hdr->devnum);
+	if (!device)
+		return;
+
+	if (hdr->xfer_type == XFER_CONTROL)
+		device_descriptor(device, hdr, data);
+
+	if (filter_bus < 0 && device->kind != KIND_IO && device->kind != KIND_THELIO)
+		return;
+
+	switch (hdr->xfer_type) {
+	case XFER_BULK:
+		if (hdr->epnum == IO_EP_OUT && hdr->type == 'S' && len)
+			io_request(device, data, len, ts);
+		else if (hdr->epnum == IO_EP_OUT && hdr->type == 'C' && hdr->status && device->pending)
+			request_finish(device, true, ts);
+		else if (hdr->epnum == IO_EP_IN && hdr->type == 'C')
+			io_response(device, hdr->status, data, len, ts);
+		break;
+	case XFER_INTR:
+		if (len != THELIO_IO_REPORT_SIZE)
+			break;
+		if (!(hdr->epnum & 0x80) && hdr->type == 'S')
+			thelio_request(device, data, ts);
+		else if ((hdr->epnum & 0x80) && hdr->type == 'C' && hdr->status == 0)
+			thelio_response(device, data, ts);
+		break;
+	case XFER_CONTROL:
+		/* output reports go over SET_REPORT when there is no interrupt OUT endpoint */
+		if (hdr->type == 'S' && hdr->flag_setup == 0 && hdr->setup[0] == 0x21 &&
+		    hdr->setup[1] == 0x09 && len == THELIO_IO_REPORT_SIZE)
+			thelio_request(device, data, ts);
+		break;
+	}
+}
+
+static int read_usbmon(int fd)
+{
+	struct usbmon_packet hdr;
+	struct mon_bin_get get;
+	static uint8_t data[MAX_DATA];
+
+	get.hdr = &hdr;
+	get.data = data;
+	get.alloc = sizeof(data);
+
+	while (!stop) {
+		if (ioctl(fd, MON_IOCX_GETX, &get) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("MON_IOCX_GETX");
+			return -1;
+		}
+		handle(&hdr, data);
+	}
+
+	return 0;
+}
+
+static int read_pcap(FILE *file)
+{
+	struct usbmon_packet hdr;
+	struct pcap_header header;
+	struct pcap_record record;
+	static uint8_t packet[MAX_DATA];
+	size_t hdr_len;
+
+	if (fread(&header, sizeof(header), 1, file) != 1) {
+		fprintf(stderr, "short pcap header\n");
+		return -1;
+	}
+
+	if (header.magic != PCAP_MAGIC_USEC && header.magic != PCAP_MAGIC_NSEC) {
+		fprintf(stderr, "not a pcap file in host byte order (pcapng is not supported)\n");
+		return -1;
+	}
+
+	switch (header.linktype) {
+	case LINKTYPE_USB_LINUX:
+		hdr_len = USBMON_HDR_LEGACY;
+		break;
+	case LINKTYPE_USB_LINUX_MMAPPED:
+		hdr_len = USBMON_HDR_MMAPPED;
+		break;
+	default:
+		fprintf(stderr, "unsupported link type %u, capture on a usbmonN interface\n",
+			header.linktype);
+		return -1;
+	}
+
+	while (!stop && fread(&record, sizeof(record), 1, file) == 1) {
+		/* larger than any Io transfer, so not one worth decoding */
+		if (record.incl_len > sizeof(packet)) {
+			if (fseek(file, record.incl_len, SEEK_CUR)) {
+				fprintf(stderr, "truncated pcap record\n");
+				return -1;
+			}
+			oversize++;
+			continue;
+		}
+		if (fread(packet, record.incl_len, 1, file) != 1) {
+			fprintf(stderr, "truncated pcap record\n");
+			return -1;
+		}
+		if (record.incl_len < hdr_len)
+			continue;
+
+		memset(&hdr, 0, sizeof(hdr));
+		memcpy(&hdr, packet, hdr_len);
+		if (hdr.len_cap > record.incl_len - hdr_len)
+			hdr.len_cap = record.incl_len - hdr_len;
+		handle(&hdr, packet + hdr_len);
+	}
+
+	return 0;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double percentile(const struct command *stat, double p)
+{
+	return stat->latency[(size_t)(p * (stat->len - 1) + 0.5)];
+}
+
+static void report(void)
+{
+	const struct device *device;
+	const struct command *stat;
+	double duration = last_ts - first_ts;
+	size_t i;
+
+	printf("capture: %.3f s\n\n", duration);
+	printf("%-7s %-16s %8s %7s %9s %9s %9s %9s %9s %9s\n", "device", "command", "count",
+	       "errors", "rate/s", "min us", "p50 us", "p90 us", "p99 us", "max us");
+
+	for (i = 0; i < stats_len; i++) {
+		stat = &stats[i];
+		printf("%3u:%-3u %-16s %8lu %7lu %9.2f", stat->busnum, stat->devnum, stat->name,
+		       stat->count, stat->errors, duration > 0 ? stat->count / duration : 0.0);
+		if (stat->len) {
+			qsort(stat->latency, stat->len, sizeof(*stat->latency), compare_double);
+			printf(" %9.0f %9.0f %9.0f %9.0f %9.0f\n", stat->latency[0],
+			       percentile(stat, 0.5), percentile(stat, 0.9),
+			       percentile(stat, 0.99), stat->latency[stat->len - 1]);
+		} else {
+			printf(" %9s %9s %9s %9s %9s\n", "-", "-", "-", "-", "-");
+		}
+	}
+
+	for (i = 0; i < devices_len; i++) {
+		device = &devices[i];
+		if (device->lost || device->unsolicited)
+			printf("\n%u:%u: %lu requests without reply, %lu unsolicited reports",
+			       device->busnum, device->devnum, device->lost, device->unsolicited);
+	}
+	if (oversize)
+		printf("\n%lu records over %d bytes skipped", oversize, MAX_DATA);
+	printf("\n");
+
+	if (!stats_len && filter_bus < 0)
+		fprintf(stderr, "no Io or Thelio Io device identified, use -d BUS:DEV to pick one\n");
+}
+
+static void on_signal(int sig)
+{
+	stop = 1;
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr, "usage: %s [-d BUS:DEV] /dev/usbmonN | capture.pcap\n", argv0);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	struct sigaction action;
+	FILE *file;
+	int opt;
+	int ret;
+
+	while ((opt = getopt(argc, argv, "d:")) != -1) {
+		switch (opt) {
+		case 'd':
+			if (sscanf(optarg, "%d:%d", &filter_bus, &filter_dev) != 2)
+				usage(argv[0]);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1)
+		usage(argv[0]);
+
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = on_signal;
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+
+	file = fopen(argv[optind], "rb");
+	if (!file) {
+		perror(argv[optind]);
+		return 1;
+	}
+
+	live = strncmp(argv[optind], "/dev/usbmon", strlen("/dev/usbmon")) == 0;
+	if (live)
+		ret = read_usbmon(fileno(file));
+	else
+		ret = read_pcap(file);
+
+	fclose(file);
+
+	report();
+
+	return ret ? 1 : 0;
+}
@@ -0,0 +1,125 @@
+/*
+ * kshim.h
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This program is free software;  you can redistribute it and/or modify
+ * it under the terms of the  GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is  distributed in the hope that it  will be useful, but
+ * WITHOUT  ANY   WARRANTY;  without   even  the  implied   warranty  of
+ * MERCHANTABILITY  or FITNESS FOR  A PARTICULAR  PURPOSE.  See  the GNU
+ * General Public License for more details.
+ *
+ * You should  have received  a copy of  the GNU General  Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Just enough of the kernel API to build the device independent driver
+ * pieces (system76-io_parser.c, system76-io_filter.c, system76-io_pid.c)
+ * into host tools unchanged. Anything those files start using that is not
+ * here is a build error, not a silent difference.
+ */
+
+#ifndef IO_KSHIM_H
+#define IO_KSHIM_H
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef int16_t s16;
+typedef int32_t s32;
+typedef int64_t s64;
+
+#define S32_MAX		INT32_MAX
+#define NSEC_PER_MSEC	1000000ULL
+#define NSEC_PER_SEC	1000000000ULL
+
+#define ARRAY_SIZE(a)	(sizeof(a) / sizeof((a)[0]))
+#define BUILD_BUG_ON(cond)	((void)sizeof(char[1 - 2 * !!(cond)]))
+
+/* the kernel versions also type check, the drivers are built with those */
+#define min(a, b)	((a) < (b) ? (a) : (b))
+#define max(a, b)	((a) > (b) ? (a) : (b))
+#define min_t(type, a, b)	min((type)(a), (type)(b))
+#define max_t(type, a, b)	max((type)(a), (type)(b))
+#define clamp(val, lo, hi)	min(max(val, lo), hi)
+#define DIV_ROUND_UP(n, d)	(((n) + (d) - 1) / (d))
+#define DIV_ROUND_CLOSEST(n, d)	(((n) + (d) / 2) / (d))
+
+static inline u64 div_u64(u64 dividend, u32 divisor)
+{
+	return dividend / divisor;
+}
+
+static inline s64 div_s64(s64 dividend, s32 divisor)
+{
+	return dividend / divisor;
+}
+
+static inline int kstrtouint(const char *s, unsigned int base, unsigned int *res)
+{
+	unsigned long value;
+	char *end;
+
+	if (*s == '-' || *s == '+' || *s == ' ')
+		return -EINVAL;
+	errno = 0;
+	value = strtoul(s, &end, base);
+	if (end == s || (*end && !(*end == '\n' && !end[1])))
+		return -EINVAL;
+	if (errno || value > UINT32_MAX)
+		return -ERANGE;
+	*res = value;
+	return 0;
+}
+
+static inline int kstrtoint(const char *s, unsigned int base, int *res)
+{
+	long value;
+	char *end;
+
+	if (*s == ' ')
+		return -EINVAL;
+	errno = 0;
+	value = strtol(s, &end, base);
+	if (end == s || (*end && !(*end == '\n' && !end[1])))
+		return -EINVAL;
+	if (errno || value < INT32_MIN || value > INT32_MAX)
+		return -ERANGE;
+	*res = value;
+	return 0;
+}
+
+/* like sysfs_streq, a single trailing newline on either side is ignored */
+static inline int __sysfs_match_string(const char * const *array, size_t n, const char *str)
+{
+	size_t len;
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		if (!array[i])
+			continue;
+		len = strlen(array[i]);
+		if (!strncmp(array[i], str, len) &&
+		    (!str[len] || (str[len] == '\n' && !str[len + 1])))
+			return i;
+	}
+	return -EINVAL;
+}
+
+#define sysfs_match_string(array, str)	__sysfs_match_string(array, ARRAY_SIZE(array), str)
+
+#endif /* IO_KSHIM_H */
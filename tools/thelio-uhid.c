@@ -0,0 +1,265 @@
+/*
+ * thelio-uhid.c
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This program is free software;  you can redistribute it and/or modify
+ * it under the terms of the  GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is  distributed in the hope that it  will be useful, but
+ * WITHOUT  ANY   WARRANTY;  without   even  the  implied   warranty  of
+ * MERCHANTABILITY  or FITNESS FOR  A PARTICULAR  PURPOSE.  See  the GNU
+ * General Public License for more details.
+ *
+ * You should  have received  a copy of  the GNU General  Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Thelio Io stand-in on /dev/uhid, included by the host tools that need
+ * one. The device is BUS_USB THELIO_IO_VENDOR:THELIO_IO_DEVICE with a
+ * single THELIO_IO_USAGE collection of 32 byte input and output reports,
+ * so system76-thelio-io binds to it like to the real board. Needs root
+ * and the uhid module.
+ */
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/uhid.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef BUS_USB
+#define BUS_USB	0x03
+#endif
+
+/* vendor page 0xFF60, usage 0x61, as THELIO_IO_USAGE */
+static const uint8_t thelio_uhid_rdesc[] = {
+	0x06, 0x60, 0xFF,	/* Usage Page (0xFF60) */
+	0x09, 0x61,		/* Usage (0x61) */
+	0xA1, 0x01,		/* Collection (Application) */
+	0x09, 0x62,		/*   Usage (0x62) */
+	0x15, 0x00,		/*   Logical Minimum (0) */
+	0x26, 0xFF, 0x00,	/*   Logical Maximum (255) */
+	0x95, THELIO_IO_REPORT_SIZE, /* Report Count */
+	0x75, 0x08,		/*   Report Size (8) */
+	0x81, 0x02,		/*   Input (Data, Var, Abs) */
+	0x09, 0x63,		/*   Usage (0x63) */
+	0x15, 0x00,		/*   Logical Minimum (0) */
+	0x26, 0xFF, 0x00,	/*   Logical Maximum (255) */
+	0x95, THELIO_IO_REPORT_SIZE, /* Report Count */
+	0x75, 0x08,		/*   Report Size (8) */
+	0x91, 0x02,		/*   Output (Data, Var, Abs) */
+	0xC0,			/* End Collection */
+};
+
+struct thelio_uhid {
+	int fd;
+	bool open; /* between UHID_OPEN and UHID_CLOSE, hid_hw_open in probe */
+	unsigned long outputs;
+};
+
+static int thelio_uhid_write(struct thelio_uhid *uhid, const struct uhid_event *ev)
+{
+	ssize_t ret;
+
+	ret = write(uhid->fd, ev, sizeof(*ev));
+	if (ret < 0) {
+		perror("uhid write");
+		return -1;
+	}
+	if (ret != sizeof(*ev)) {
+		fprintf(stderr, "uhid write: short write\n");
+		return -1;
+	}
+	return 0;
+}
+
+static int thelio_uhid_create(struct thelio_uhid *uhid, const char *name, const char *phys)
+{
+	struct uhid_event ev;
+
+	memset(uhid, 0, sizeof(*uhid));
+
+	uhid->fd = open("/dev/uhid", O_RDWR | O_CLOEXEC);
+	if (uhid->fd < 0) {
+		perror("/dev/uhid");
+		return -1;
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = UHID_CREATE2;
+	snprintf((char *)ev.u.create2.name, sizeof(ev.u.create2.name), "%s", name);
+	snprintf((char *)ev.u.create2.phys, sizeof(ev.u.create2.phys), "%s", phys);
+	ev.u.create2.rd_size = sizeof(thelio_uhid_rdesc);
+	ev.u.create2.bus = BUS_USB;
+	ev.u.create2.vendor = THELIO_IO_VENDOR;
+	ev.u.create2.product = THELIO_IO_DEVICE;
+	memcpy(ev.u.create2.rd_data, thelio_uhid_rdesc, sizeof(thelio_uhid_rdesc));
+
+	if (thelio_uhid_write(uhid, &ev)) {
+		close(uhid->fd);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void thelio_uhid_destroy(struct thelio_uhid *uhid)
+{
+	struct uhid_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = UHID_DESTROY;
+	thelio_uhid_write(uhid, &ev);
+	close(uhid->fd);
+}
+
+/* sends one input report, either a reply or an unsolicited one */
+static int thelio_uhid_send(struct thelio_uhid *uhid, const uint8_t *report)
+{
+	struct uhid_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = UHID_INPUT2;
+	ev.u.input2.size = THELIO_IO_REPORT_SIZE;
+	memcpy(ev.u.input2.data, report, THELIO_IO_REPORT_SIZE);
+
+	return thelio_uhid_write(uhid, &ev);
+}
+
+/*
+ * Waits up to timeout_ms for the next uhid event. Returns 1 with the output
+ * report in report, 0 for any other event or a timeout, -1 on errors. Get
+ * and set report requests are refused, the driver does not use them.
+ */
+static int thelio_uhid_poll(struct thelio_uhid *uhid, uint8_t *report, int timeout_ms)
+{
+	struct pollfd pfd = { .fd = uhid->fd, .events = POLLIN };
+	struct uhid_event ev;
+	ssize_t ret;
+
+	ret = poll(&pfd, 1, timeout_ms);
+	if (ret < 0) {
+		perror("poll");
+		return -1;
+	}
+	if (ret == 0)
+		return 0;
+
+	ret = read(uhid->fd, &ev, sizeof(ev));
+	if (ret < 0) {
+		perror("uhid read");
+		return -1;
+	}
+
+	switch (ev.type) {
+	case UHID_OPEN:
+		uhid->open = true;
+		break;
+	case UHID_CLOSE:
+		uhid->open = false;
+		break;
+	case UHID_OUTPUT:
+		if (ev.u.output.rtype != UHID_OUTPUT_REPORT)
+			break;
+		memset(report, 0, THELIO_IO_REPORT_SIZE);
+		memcpy(report, ev.u.output.data,
+		       ev.u.output.size < THELIO_IO_REPORT_SIZE ?
+		       ev.u.output.size : THELIO_IO_REPORT_SIZE);
+		uhid->outputs++;
+		return 1;
+	case UHID_GET_REPORT: {
+		uint32_t id = ev.u.get_report.id;
+
+		memset(&ev, 0, sizeof(ev));
+		ev.type = UHID_GET_REPORT_REPLY;
+		ev.u.get_report_reply.id = id;
+		ev.u.get_report_reply.err = 5; /* EIO */
+		thelio_uhid_write(uhid, &ev);
+		break;
+	}
+	case UHID_SET_REPORT: {
+		uint32_t id = ev.u.set_report.id;
+
+		memset(&ev, 0, sizeof(ev));
+		ev.type = UHID_SET_REPORT_REPLY;
+		ev.u.set_report_reply.id = id;
+		ev.u.set_report_reply.err = 5; /* EIO */
+		thelio_uhid_write(uhid, &ev);
+		break;
+	}
+	default:
+		break;
+	}
+
+	return 0;
+}
+
+/*
+ * Finds the hwmon directory system76-thelio-io registered for the stand-in
+ * with the given phys. Returns 0 once found, -1 if it did not show up.
+ */
+static int thelio_uhid_hwmon(const char *phys, char *path, size_t size)
+{
+	char name[64];
+	char link[PATH_MAX];
+	char buf[PATH_MAX + 16];
+	struct dirent *ent;
+	FILE *file;
+	DIR *dir;
+	bool found = false;
+
+	dir = opendir("/sys/class/hwmon");
+	if (!dir)
+		return -1;
+
+	while (!found && (ent = readdir(dir))) {
+		if (ent->d_name[0] == '.')
+			continue;
+
+		snprintf(buf, sizeof(buf), "/sys/class/hwmon/%s/name", ent->d_name);
+		file = fopen(buf, "r");
+		if (!file)
+			continue;
+		if (!fgets(name, sizeof(name), file))
+			name[0] = 0;
+		fclose(file);
+		if (strcmp(name, "system76_thelio_io\n"))
+			continue;
+
+		/* the hid device of a uhid stand-in lives below .../uhid/ */
+		snprintf(buf, sizeof(buf), "/sys/class/hwmon/%s/device", ent->d_name);
+		if (!realpath(buf, link) || !strstr(link, "/uhid/"))
+			continue;
+
+		snprintf(buf, sizeof(buf), "%s/uevent", link);
+		file = fopen(buf, "r");
+		if (!file)
+			continue;
+		while (fgets(buf, sizeof(buf), file)) {
+			if (!strncmp(buf, "HID_PHYS=", 9) && !strncmp(buf + 9, phys, strlen(phys)) &&
+			    buf[9 + strlen(phys)] == '\n') {
+				found = true;
+				break;
+			}
+		}
+		fclose(file);
+
+		if (found)
+			snprintf(path, size, "/sys/class/hwmon/%s", ent->d_name);
+	}
+
+	closedir(dir);
+
+	return found ? 0 : -1;
+}